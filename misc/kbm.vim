@@ -7,12 +7,16 @@ if exists("b:current_syntax")
     finish
 endif
 
-syn keyword kbm_operation click rclick exec toggle quit
-syn keyword kbm_operation jump nextgroup=kbm_number skipwhite
+syn keyword kbm_operation click rclick mclick exec toggle quit macro type layer profile
+syn keyword kbm_operation press release scroll jumpto
+syn keyword kbm_operation jump wait drag move nextgroup=kbm_number skipwhite
 syn keyword kbm_operation key nextgroup=kbm_keydef skipwhite
-syn keyword kbm_qualifier norepeat
-syn keyword kbm_global active_window
+syn keyword kbm_qualifier norepeat single capture double
+syn keyword kbm_qualifier max repeat over accel monitor hold long nextgroup=kbm_number skipwhite
+syn keyword kbm_qualifier linear ease push pop set next
+syn keyword kbm_global active_window sequence_timeout chord_window include
 syn match kbm_arrow /->\>/
+syn match kbm_separator /&/
 
 syn keyword kbm_todo contained TODO XXX NOTE
 syn match kbm_comment /#.*$/ contains=kbm_todo
@@ -23,7 +27,11 @@ syn match kbm_modifier /\c\v(control|ctrl)-/
 syn match kbm_modifier /\c\v(shift)-/
 syn match kbm_modifier /\c\v(super|command|cmd|win|windows)-/
 syn match kbm_modifier /\c\v(alt|meta|option)-/
-syn match kbm_modifier /[!@~^]/
+syn match kbm_modifier /\c\v(rcontrol|rctrl|rightcontrol|rightctrl)-/
+syn match kbm_modifier /\c\v(rshift|rightshift)-/
+syn match kbm_modifier /\c\v(rsuper|rcommand|rcmd|rwin|rightsuper)-/
+syn match kbm_modifier /\c\v(ralt|rmeta|roption|rightalt|rightmeta)-/
+syn match kbm_modifier /[!@~^*]/
 " single character keys
 syn match kbm_keydef /\<[a-zA-z0-9]\>/
 syn match kbm_keydef /\c\v(F[1-9]|F10|F11|F12)>/
@@ -40,6 +48,13 @@ syn match kbm_keydef /\c\v(numminus|numplus|numenter|numdel|numdelete|numins)>/
 syn match kbm_keydef /\c\v(numinsert|numend|numdown|numpgdn|numpagedown|numleft)>/
 syn match kbm_keydef /\c\v(numclear|numright|numhome|numup|numpgup|numpageup)>/
 syn match kbm_keydef /\c\v(numdecimal|numdec|num[0-9])>/
+syn match kbm_keydef /\c\v(button[1-9]|scrollup|scrolldown|scrollleft|scrollright)>/
+syn match kbm_keydef /\c\v(F1[3-9]|F2[0-4]|mute|volumedown|voldown|volumeup|volup)>/
+syn match kbm_keydef /\c\v(play|playpause|stop|prev|previous|next|back|browserback)>/
+syn match kbm_keydef /\c\v(forward|browserforward|refresh|browserrefresh|search)>/
+syn match kbm_keydef /\c\v(homepage|browserhome|mail|calculator|calc|sleep|menu)>/
+syn match kbm_keydef /\c\v(apps|help|brightnessdown|brightnessup)>/
+syn match kbm_keydef /\c\vkeycode:\d+>/
 
 syn match kbm_escaped /\\./ contained
 syn region kbm_string start='"' skip=/\\./ end='"' contains=kbm_escaped
@@ -50,6 +65,7 @@ hi def link kbm_operation Function
 hi def link kbm_qualifier Statement
 hi def link kbm_global Statement
 hi def link kbm_arrow Operator
+hi def link kbm_separator Operator
 hi def link kbm_todo Todo
 hi def link kbm_comment Comment
 hi def link kbm_escaped SpecialChar
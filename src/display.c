@@ -39,17 +39,25 @@ static struct hotkey *toggles;
 
 static void map_keys(struct hotkey *head, int set_state);
 static void unmap_keys(struct hotkey *head, int set_state);
+static void split_keys(struct hotkey *head);
+#ifndef __linux__
 static struct hotkey *find_by_os_code(struct hotkey *head,
                                       uint32_t code, uint32_t mask);
+#endif
 static void send_notification(const char *msg);
 
 
 #ifdef __linux__
+#include <signal.h>
 #include <libnotify/notify.h>
 #include <xcb/xcb.h>
 #include <xcb/xcb_aux.h>
 #include <xcb/xcb_keysyms.h>
+#include <xcb/randr.h>
+#include <xcb/xkb.h>
 #include <xcb/xtest.h>
+#include "loop.h"
+#include "proc.h"
 
 /* connection to the X server */
 static xcb_connection_t *conn;
@@ -61,7 +69,336 @@ static xcb_window_t root;
 /* X11 keysyms */
 static xcb_key_symbols_t *keysyms;
 
+/*
+ * The active window is tracked through property change events on the
+ * root window, so it is known without a round trip on every keypress.
+ */
+static xcb_atom_t net_active_window;
+static xcb_window_t active_win;
+static xcb_get_property_cookie_t active_cookie;
+static int active_pending;
+
+/* cursor position at the most recent key event */
+static int16_t cursor_x, cursor_y;
+
+/*
+ * Modifiers held by the user at the most recent key event, and those of
+ * them which have been released by kbm so that they do not apply to a
+ * simulated key. Suppressed modifiers are still treated as held when
+ * matching hotkeys, as the server no longer reports them.
+ */
+static uint16_t held_mods;
+static uint16_t suppressed_mods;
+
+/*
+ * Modifiers whose right-hand key is held, followed through XKB state
+ * notifications, which name the key that changed the modifier state.
+ * The right-hand sides of suppressed modifiers are remembered separately,
+ * as releasing them clears their bits in right_mods.
+ */
+static uint16_t right_mods;
+static uint16_t suppressed_right;
+
+/* code of the XKB events, or 0 if XKB is not available */
+static uint8_t xkb_event;
+
+/* whether the server omits the key releases of autorepeated keys */
+static int detectable_repeat;
+
+/*
+ * Geometry of each RandR monitor, kept up to date through screen change
+ * events so that placing the cursor needs no requests. Without RandR 1.5,
+ * the whole screen is treated as the only monitor.
+ */
+struct monitor {
+	int16_t		x;
+	int16_t		y;
+	uint16_t	width;
+	uint16_t	height;
+};
+
+static struct monitor *monitors;
+static size_t nmonitors;
+static uint16_t screen_width, screen_height;
+
+/* code of the first RandR event, or 0 if RandR is not available */
+static uint8_t randr_event;
+
+/*
+ * Bindings which only replace one unmodified key with another, such as
+ * a -> key b, are applied as changes to the server's keyboard mapping
+ * instead of being grabbed, so the server translates the key itself.
+ * The original keysyms of each remapped keycode are kept for restoring.
+ */
+struct remap {
+	struct hotkey	*hk;		/* binding applied as a remap */
+	xcb_keycode_t	keycode;	/* keycode of the binding's key */
+	xcb_keysym_t	*orig;		/* keysyms previously bound to it */
+};
+
+static struct remap *remaps;
+static size_t nremaps;
+static uint8_t remap_width;
+
+/* actions found eligible as remaps when hotkeys are loaded */
+static struct hotkey **remap_keys;
+static size_t nremap_keys;
+
+/*
+ * Grabbed keys and buttons are found from their OS code and modifiers
+ * through an open-addressed hash table, so the cost of dispatching an
+ * event does not grow with the number of bindings. It is rebuilt when
+ * hotkeys are loaded. Actions take precedence over toggles.
+ *
+ * A wildcard binding is entered under every combination of modifiers it
+ * matches which is not already taken, after the exact bindings and the
+ * wildcards naming more modifiers, so the most specific binding of any
+ * combination is found with a single lookup.
+ *
+ * Key sequences form a trie whose nodes are numbered states, with the
+ * bindings at rest in state 0. Each entry belongs to a state and leads
+ * either to a binding or, for a sequence prefix, to a further state.
+ */
+struct dispatch_entry {
+	uint32_t	code;
+	uint32_t	mask;
+	uint16_t	state;		/* state in which the entry applies */
+	uint16_t	next;		/* state entered by a prefix, or 0 */
+	struct hotkey	*hk;		/* binding run if not a prefix */
+};
+
+static struct dispatch_entry *dispatch;
+static size_t dispatch_mask;
+
+/*
+ * While a sequence prefix has been typed, the keys continuing it are
+ * grabbed and seq_state is the state reached. The slots of the entries
+ * of each state are listed in state_slots, from state_start[state] up
+ * to state_start[state + 1]. Bindings run by the final key of a sequence
+ * are kept by keycode to receive the key's release.
+ */
+static uint16_t seq_state;
+static uint16_t nstates;
+static size_t *state_slots;
+static size_t *state_start;
+static struct hotkey *seq_down[256];
+
+/*
+ * The keys of chords are entered into the dispatch table in CHORD_STATE,
+ * which no sequence reaches. Pressed keys which may form a chord are held
+ * back in chord_pend until a chord is complete, another key is pressed or
+ * the chord window runs out. Held back keys which form no chord are then
+ * replayed: a key bound on its own runs its binding, and any other key is
+ * sent on through XTest with its grab lifted until it is released.
+ *
+ * The keys in each stage are tracked in bitmaps indexed by keycode.
+ */
+#define CHORD_STATE	UINT16_MAX
+
+#define KC_TEST(map, kc)	((map)[(kc) / 8] & 1 << ((kc) % 8))
+#define KC_SET(map, kc)		((map)[(kc) / 8] |= 1 << ((kc) % 8))
+#define KC_CLEAR(map, kc)	((map)[(kc) / 8] &= ~(1 << ((kc) % 8)))
+
+struct chord_key {
+	xcb_keycode_t	kc;		/* keycode of the pressed key */
+	xcb_keysym_t	ks;		/* its keysym */
+	uint16_t	mods;		/* modifiers of its grab */
+	struct hotkey	*own;		/* binding of the key on its own */
+};
+
+static struct hotkey **chords;
+static size_t nchords;
+
+static struct chord_key chord_pend[KBM_MAX_CHORD];
+static size_t npend;
+
+/* completed chord and the number of its keys still held */
+static struct hotkey *chord_fired;
+static size_t chord_nheld;
+
+static uint8_t chord_held[256 / 8];	/* held back */
+static uint8_t chord_replayed[256 / 8];	/* replayed through XTest */
+static uint8_t chord_down[256 / 8];	/* part of the fired chord */
+static uint16_t replay_mods[256];	/* grab lifted from replayed keys */
+
+/*
+ * A tap and hold key is pending from its press until it is released,
+ * is held for its hold time or another key is pressed. A release makes
+ * it a tap, running its own operations, and anything else makes it
+ * a hold, running those of hk->hold until the key is released.
+ */
+static struct hotkey *dual_pending;
+static xcb_keycode_t dual_kc;
+static xcb_timestamp_t dual_time;
+static struct hotkey *dual_held[256];
+static unsigned int dual_nheld;
+
+/* the bindings of a key's tap, double tap and long press */
+struct gesture {
+	struct hotkey	*tap;		/* binding without double or long */
+	struct hotkey	*dbl;		/* binding of a double tap */
+	struct hotkey	*lng;		/* binding of a long press */
+};
+
+static struct gesture *gestures;
+
+/* progress of a key with a double tap or long press binding */
+enum {
+	GEST_IDLE,			/* not pressed */
+	GEST_DOWN,			/* pressed, not yet held long */
+	GEST_WAIT,			/* tapped, waiting for a second tap */
+	GEST_HELD			/* running held until released */
+};
+
+/*
+ * Slots indexed by keycode time the keys which have double tap or long
+ * press bindings. Only these keys are timed, so other bindings dispatch
+ * as before. A tap is only run once its key has been released, and, if
+ * the key has a double tap binding, no second tap followed in time.
+ */
+struct gesture_slot {
+	struct gesture	*g;		/* bindings of the key */
+	struct hotkey	*held;		/* binding run while GEST_HELD */
+	xcb_timestamp_t	down;		/* time of the last press */
+	uint8_t		state;		/* GEST_* */
+	struct timer	timer;		/* ends a long press or double tap */
+};
+
+static struct gesture_slot gest_slots[256];
+static xcb_keycode_t gest_wait;		/* key waiting for a second tap */
+
+/*
+ * While one of its keys is held, kbm has the whole keyboard grabbed, and
+ * key events sent through XTest come back to kbm instead of reaching the
+ * focused window. Events meant for the window are sent with the grab
+ * lifted. If keys are still held then, kbm grabs the keyboard itself to
+ * receive their releases, until the last of them is let go.
+ */
+static uint8_t keys_down[256 / 8];
+static unsigned int nkeys_down;
+static unsigned int grab_lifted;	/* depth of lift_grab calls */
+static int kbd_grabbed;			/* keyboard grabbed by kbm itself */
+
+static uint8_t forwarded[256 / 8];	/* presses sent on to the window */
+
+/*
+ * Layers are numbered from 1, and the entries of a layer's bindings are
+ * in the dispatch state of its number, below the states of sequences.
+ * Keys are looked up in the active layer, the top of layer_stack, before
+ * the bindings outside layers.
+ *
+ * A layer's bindings are only grabbed while it is active. Their grabs are
+ * worked out at load into layer_grabs, from layer_start[layer] up to
+ * layer_start[layer + 1], each the keycode in the upper and modifiers in
+ * the lower 16 bits, sorted and leaving out those grabbed outside layers.
+ * Switching layers grabs and ungrabs only what differs between the two.
+ */
+static uint16_t nlayers;
+static uint8_t layer_stack[KBM_MAX_LAYER_DEPTH];
+static size_t layer_depth;
+static uint32_t *layer_grabs;
+static size_t *layer_start;
+
+#define ACTIVE_LAYER	(layer_depth ? layer_stack[layer_depth - 1] : 0)
+
+/*
+ * The grabs of the bindings outside layers, in the form of layer_grabs,
+ * are kept in base_grabs, and those of the toggles alone in toggle_grabs.
+ * A button's grab has GRAB_BUTTON set in the place of a keycode.
+ */
+#define GRAB_BUTTON	0x100
+
+static uint32_t *base_grabs;
+static size_t nbase_grabs;
+static uint32_t *toggle_grabs;
+static size_t ntoggle_grabs;
+
+/*
+ * Each keymap file given is loaded into a profile, which keeps its
+ * bindings, dispatch table and grabs while others are in use, so that
+ * switching profiles needs no parsing or rebuilding. The tables of the
+ * profile in use are those above, saved back into it when it is left.
+ */
+struct profile {
+	const char		*name;
+	struct keymap		map;
+	struct hotkey		*actions;
+	struct hotkey		*toggles;
+	struct dispatch_entry	*dispatch;
+	size_t			dispatch_mask;
+	uint16_t		nstates;
+	size_t			*state_slots;
+	size_t			*state_start;
+	struct hotkey		**chords;
+	size_t			nchords;
+	struct gesture		*gestures;
+	uint16_t		nlayers;
+	uint32_t		*layer_grabs;
+	size_t			*layer_start;
+	uint32_t		*base_grabs;
+	size_t			nbase_grabs;
+	uint32_t		*toggle_grabs;
+	size_t			ntoggle_grabs;
+	struct hotkey		**remap_keys;
+	size_t			nremap_keys;
+};
+
+static struct profile *profiles;
+static size_t nprofiles;
+static size_t curr_profile;
+
 static int isnummod(unsigned int keysym);
+static void reset_keycodes(void);
+static void find_spare_keycodes(void);
+static void stop_typing(void);
+static void enable_detectable_repeat(void);
+static void watch_modifier_sides(void);
+static void track_sides(const xcb_xkb_state_notify_event_t *sn);
+static void watch_monitors(void);
+static void update_monitors(void);
+static void watch_active_window(void);
+static void request_active_window(void);
+static void grab_button(const struct hotkey *hk);
+static void ungrab_button(const struct hotkey *hk);
+static void grab_hotkey(const struct hotkey *hk);
+static void grab_wildcard(const struct hotkey *hk, xcb_keycode_t kc);
+static void ungrab_wildcard(const struct hotkey *hk, xcb_keycode_t kc);
+static void restore_grabs(struct hotkey *head);
+static int uses_keycode(const struct hotkey *hk, xcb_keycode_t kc);
+static void build_dispatch(void);
+static struct dispatch_entry *find_entry(uint16_t state, uint32_t code,
+                                         uint32_t mask);
+static struct dispatch_entry *match_entry(uint16_t state, uint32_t code,
+                                          uint32_t mask);
+static struct dispatch_entry *match_root(uint32_t code, uint32_t mask);
+static struct hotkey *match_hotkey(uint32_t code, uint32_t mask);
+static void build_grabs(void);
+static void build_layer_grabs(void);
+static void grab_layer(unsigned int layer, int grab);
+static void diff_grabs(const uint32_t *a, size_t na,
+                       const uint32_t *b, size_t nb);
+static void free_profiles(void);
+static int sequence_key(const xcb_key_press_event_t *evt, xcb_keysym_t ks);
+static void enter_state(uint16_t state);
+static void end_sequence(void);
+static void grab_keycode(xcb_keycode_t kc, uint16_t mods, int grab);
+static void grab_chord(const struct hotkey *hk, int grab);
+static int chord_key(const xcb_key_press_event_t *evt, xcb_keysym_t ks);
+static int chord_release(const xcb_key_press_event_t *evt);
+static void reset_chords(void);
+static void dual_press(struct hotkey *hk, const xcb_key_press_event_t *evt);
+static uint32_t dual_hold(void);
+static int dual_release(const xcb_key_press_event_t *evt);
+static void reset_dual(void);
+static void gesture_init(void);
+static void gesture_press(struct gesture *g, const xcb_key_press_event_t *evt);
+static void gesture_tap(struct gesture_slot *s);
+static int gesture_release(const xcb_key_press_event_t *evt);
+static void reset_gestures(void);
+static void lift_grab(void);
+static void restore_grab(void);
+static void forward_press(xcb_keycode_t kc);
+static int forward_release(xcb_keycode_t kc);
 
 /* init_display: connect to the X server and grab the root window */
 int init_display(void)
@@ -76,258 +413,2898 @@ int init_display(void)
 	root_screen = xcb_aux_get_screen(conn, screen);
 	root = root_screen->root;
 	keysyms = xcb_key_symbols_alloc(conn);
+	reset_keycodes();
+	find_spare_keycodes();
+	gesture_init();
+
+	actions = toggles = NULL;
+	proc_init();
+	enable_detectable_repeat();
+	watch_modifier_sides();
+	watch_active_window();
+	watch_monitors();
+
+	if (kbm_info.notifications)
+		notify_init(PROGRAM_NAME);
+
+	return 0;
+}
+
+/* close_display: disconnect from X server and clean up */
+void close_display(void)
+{
+	stop_typing();
+	xcb_flush(conn);
+	free(remaps);
+	free(monitors);
+	xcb_key_symbols_free(keysyms);
+	xcb_disconnect(conn);
+
+	if (kbm_info.notifications)
+		notify_uninit();
+}
+
+/*
+ * With detectable autorepeat, a key press event following a previous key
+ * press with the same key is an automatically repeated key. Otherwise, it
+ * is one which occurs at the same time as a release of the same key.
+ */
+#define DETECT_AUTOREPEAT(last, evt, last_ks, ks) \
+	((last) && (last_ks) == (ks) \
+	 && (detectable_repeat \
+	     ? ((last)->response_type & ~0x80) == XCB_KEY_PRESS \
+	     : ((last)->response_type & ~0x80) == XCB_KEY_RELEASE \
+	       && (last)->time == (evt)->time))
+
+/* whether the event loop should keep running */
+static int running;
+
+/* most recent key event received and its keysym */
+static xcb_key_press_event_t *last;
+static xcb_keysym_t last_ks;
+
+static void process_event(xcb_generic_event_t *e);
+
+/*
+ * quit:
+ * End the event loop on a signal to terminate, so that kbm exits through
+ * unload_keys and puts back the keys it has remapped.
+ */
+static void quit(int sig)
+{
+	KBM_UNUSED(sig);
+	running = 0;
+}
+
+/*
+ * start_listening:
+ * Map all hotkeys and start listening for keypresses.
+ * The X connection is polled alongside all other event
+ * sources, such as running child processes.
+ */
+void start_listening(void)
+{
+	xcb_generic_event_t *e;
+
+	if (loop_add(xcb_get_file_descriptor(conn), NULL, NULL) != 0)
+		return;
+	loop_signal(SIGINT, quit);
+	loop_signal(SIGTERM, quit);
+	loop_signal(SIGHUP, quit);
+
+	last = NULL;
+	running = 1;
+	while (running) {
+		/* events may have been queued while waiting for a reply */
+		while (running && (e = xcb_poll_for_event(conn)))
+			process_event(e);
+
+		if (xcb_connection_has_error(conn)) {
+			fprintf(stderr, "error: lost connection to X server\n");
+			break;
+		}
+		/* fake input from all processed hotkeys goes out at once */
+		xcb_flush(conn);
+
+		if (running && loop_poll(-1) != 0)
+			break;
+	}
+	free(last);
+}
+
+/* stop_listening: end the event loop once the current event is handled */
+void stop_listening(void)
+{
+	running = 0;
+}
+
+/* process_event: act on a single event received from the X server */
+static void process_event(xcb_generic_event_t *e)
+{
+	xcb_key_press_event_t *evt;
+	xcb_button_press_event_t *bevt;
+	xcb_randr_screen_change_notify_event_t *sc;
+	struct dispatch_entry *ent;
+	xcb_keysym_t ks;
+	struct hotkey *hk;
+
+	switch (e->response_type & ~0x80) {
+	case XCB_KEY_PRESS:
+		evt = (xcb_key_press_event_t *)e;
+		ks = xcb_key_press_lookup_keysym(keysyms, evt, 0);
+		if (!KC_TEST(keys_down, evt->detail)) {
+			KC_SET(keys_down, evt->detail);
+			nkeys_down++;
+		}
+		cursor_x = evt->root_x;
+		cursor_y = evt->root_y;
+
+		/*
+		 * If the key is not a numpad key, unset the Num Lock
+		 * bit as it is irrelevant. If it is a numpad key, the
+		 * Num Lock bit differentiates between the key's two
+		 * functions.
+		 */
+		if (!isnummod(ks))
+			evt->state &= ~XCB_MOD_MASK_2;
+		/* unset the caps lock bit for every key */
+		evt->state &= ~XCB_MOD_MASK_LOCK;
+		evt->state |= suppressed_mods;
+
+		/* another key pressed makes a pending tap and hold key held */
+		if (dual_pending && evt->detail != dual_kc)
+			evt->state |= dual_hold();
+		/* and ends the wait for a second tap of a tapped key */
+		if (gest_wait && evt->detail != gest_wait)
+			gesture_tap(&gest_slots[gest_wait]);
+		held_mods = evt->state;
+
+		/* the final key of a sequence repeats to its binding */
+		if ((hk = seq_down[evt->detail])) {
+			if (DETECT_AUTOREPEAT(last, evt, last_ks, ks)
+			    && !(hk->key_flags & KBM_NOREPEAT)
+			    && process_hotkey(hk, KBM_AUTOREPEAT) == -1)
+				running = 0;
+			break;
+		}
+
+		/* after a sequence prefix, a key continues or ends it */
+		if (seq_state && (DETECT_AUTOREPEAT(last, evt, last_ks, ks)
+		                  || sequence_key(evt, ks)))
+			break;
+
+		/* keys which may form a chord are held back */
+		if (chord_key(evt, ks))
+			break;
+
+		if (!(ent = match_root(ks, evt->state))
+		    && !(ent = match_root(X11_KEYCODE(evt->detail),
+		                          evt->state))) {
+			/*
+			 * This sometimes happens when keys are
+			 * pressed in quick succession.
+			 * The event should be sent back out.
+			 *
+			 * Keys pressed with a held tap and hold key
+			 * only reach kbm because of its grab, and
+			 * are sent on to the focused window.
+			 */
+			if (dual_nheld)
+				forward_press(evt->detail);
+			break;
+		}
+		if (ent->next) {
+			enter_state(ent->next);
+			break;
+		}
+		hk = ent->hk;
+
+		/* a tap and hold key waits to learn which it is */
+		if (hk->key_flags & KBM_HOLD) {
+			if (!dual_held[evt->detail]
+			    && !(dual_pending && evt->detail == dual_kc))
+				dual_press(hk, evt);
+			break;
+		}
+
+		/* as does a key with double tap or long press bindings */
+		if (hk->gest) {
+			gesture_press(hk->gest, evt);
+			break;
+		}
+
+		/* don't send an autorepeated key if norepeat flag */
+		if (DETECT_AUTOREPEAT(last, evt, last_ks, ks)) {
+			if (hk->key_flags & KBM_NOREPEAT)
+				break;
+			if (process_hotkey(hk, KBM_AUTOREPEAT) == -1)
+				running = 0;
+			break;
+		}
+
+		/* a layer's binding keeps its key's release if it is left */
+		if (ent->state)
+			seq_down[evt->detail] = hk;
+		if (process_hotkey(hk, KBM_PRESS) == -1)
+			running = 0;
+		break;
+	case XCB_KEY_RELEASE:
+		evt = (xcb_key_press_event_t *)e;
+		ks = xcb_key_press_lookup_keysym(keysyms, evt, 0);
+		if (KC_TEST(keys_down, evt->detail)) {
+			KC_CLEAR(keys_down, evt->detail);
+			nkeys_down--;
+		}
+		/* the last key let go ends kbm's own grab of the keyboard */
+		if (kbd_grabbed && !nkeys_down) {
+			xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+			kbd_grabbed = 0;
+		}
+
+		if (!isnummod(ks))
+			evt->state &= ~XCB_MOD_MASK_2;
+		evt->state &= ~XCB_MOD_MASK_LOCK;
+		evt->state |= suppressed_mods;
+		held_mods = evt->state;
+
+		if ((hk = seq_down[evt->detail])) {
+			seq_down[evt->detail] = NULL;
+			process_hotkey(hk, KBM_RELEASE);
+			break;
+		}
+		if (dual_release(evt) || gesture_release(evt)
+		    || chord_release(evt) || forward_release(evt->detail))
+			break;
+
+		if (!(hk = match_hotkey(ks, evt->state))
+		    && !(hk = match_hotkey(X11_KEYCODE(evt->detail),
+		                           evt->state)))
+			break;
+
+		process_hotkey(hk, KBM_RELEASE);
+		break;
+	case XCB_BUTTON_PRESS:
+	case XCB_BUTTON_RELEASE:
+		bevt = (xcb_button_press_event_t *)e;
+		cursor_x = bevt->root_x;
+		cursor_y = bevt->root_y;
+
+		/* only keyboard modifiers distinguish button bindings */
+		bevt->state &= 0xFF & ~(XCB_MOD_MASK_2 | XCB_MOD_MASK_LOCK);
+		bevt->state |= suppressed_mods;
+		held_mods = bevt->state;
+
+		hk = match_hotkey(X11_BUTTON(bevt->detail), bevt->state);
+		if (hk && process_hotkey(hk, (e->response_type & ~0x80)
+		                         == XCB_BUTTON_PRESS
+		                         ? KBM_PRESS : KBM_RELEASE) == -1)
+			running = 0;
+		free(e);
+		return;
+	case XCB_PROPERTY_NOTIFY:
+		if (((xcb_property_notify_event_t *)e)->atom
+		    == net_active_window)
+			request_active_window();
+		free(e);
+		return;
+	case XCB_MAPPING_NOTIFY:
+		xcb_refresh_keyboard_mapping(keysyms,
+		                             (xcb_mapping_notify_event_t *)e);
+		reset_keycodes();
+		free(e);
+		return;
+	default:
+		if (randr_event && (e->response_type & ~0x80)
+		    == randr_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+			sc = (xcb_randr_screen_change_notify_event_t *)e;
+			screen_width = sc->width;
+			screen_height = sc->height;
+			update_monitors();
+		} else if (xkb_event && (e->response_type & ~0x80)
+		           == xkb_event && ((xcb_xkb_state_notify_event_t *)e)
+		           ->xkbType == XCB_XKB_STATE_NOTIFY) {
+			track_sides((xcb_xkb_state_notify_event_t *)e);
+		}
+		free(e);
+		return;
+	}
+	free(last);
+	last = evt;
+	last_ks = ks;
+}
+
+/* active_window: return the id of the active window */
+unsigned long active_window(void)
+{
+	xcb_get_property_reply_t *r;
+
+	if (active_pending) {
+		active_pending = 0;
+		r = xcb_get_property_reply(conn, active_cookie, NULL);
+		if (r && xcb_get_property_value_length(r) >= 4)
+			active_win = *(xcb_window_t *)xcb_get_property_value(r);
+		free(r);
+	}
+	return active_win;
+}
+
+/* cursor_position: get the position of the cursor at the last key event */
+void cursor_position(int *x, int *y)
+{
+	*x = cursor_x;
+	*y = cursor_y;
+}
+
+/*
+ * watch_active_window:
+ * Listen for changes to the root window's _NET_ACTIVE_WINDOW property
+ * and request its initial value.
+ */
+static void watch_active_window(void)
+{
+	static const char name[] = "_NET_ACTIVE_WINDOW";
+	xcb_intern_atom_reply_t *r;
+	uint32_t mask;
+
+	r = xcb_intern_atom_reply(conn, xcb_intern_atom(conn, 0,
+	                          sizeof name - 1, name), NULL);
+	if (!r)
+		return;
+	net_active_window = r->atom;
+	free(r);
+
+	mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+	xcb_change_window_attributes(conn, root, XCB_CW_EVENT_MASK, &mask);
+	request_active_window();
+}
+
+/*
+ * enable_detectable_repeat:
+ * Ask the server not to send key releases for autorepeated keys,
+ * so that a held key is seen as a single press and release.
+ */
+static void enable_detectable_repeat(void)
+{
+	xcb_xkb_use_extension_reply_t *ext;
+	xcb_xkb_per_client_flags_reply_t *pcf;
+
+	ext = xcb_xkb_use_extension_reply(conn,
+	                                  xcb_xkb_use_extension(conn,
+	                                  XCB_XKB_MAJOR_VERSION,
+	                                  XCB_XKB_MINOR_VERSION), NULL);
+	if (!ext || !ext->supported) {
+		free(ext);
+		return;
+	}
+	free(ext);
+
+	pcf = xcb_xkb_per_client_flags_reply(conn,
+	        xcb_xkb_per_client_flags(conn, XCB_XKB_ID_USE_CORE_KBD,
+	                XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT,
+	                XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT,
+	                0, 0, 0), NULL);
+	if (pcf) {
+		detectable_repeat = !!(pcf->value
+		        & XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT);
+		free(pcf);
+	}
+	PRINT_DEBUG("detectable autorepeat %s\n",
+	            detectable_repeat ? "enabled" : "unavailable");
+	xkb_event = xcb_get_extension_data(conn, &xcb_xkb_id)->first_event;
+}
+
+/*
+ * watch_modifier_sides:
+ * Ask XKB for a notification whenever the modifier state changes,
+ * to learn which side of each modifier the user is holding.
+ */
+static void watch_modifier_sides(void)
+{
+	if (!xkb_event)
+		return;
+
+	xcb_xkb_select_events(conn, XCB_XKB_ID_USE_CORE_KBD,
+	                      XCB_XKB_EVENT_TYPE_STATE_NOTIFY, 0,
+	                      XCB_XKB_EVENT_TYPE_STATE_NOTIFY, 0, 0, NULL);
+}
+
+/*
+ * watch_monitors:
+ * Listen for changes to the screen configuration
+ * and read the initial layout of the monitors.
+ */
+static void watch_monitors(void)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_randr_query_version_reply_t *ver;
+
+	screen_width = root_screen->width_in_pixels;
+	screen_height = root_screen->height_in_pixels;
+
+	ext = xcb_get_extension_data(conn, &xcb_randr_id);
+	if (ext && ext->present) {
+		ver = xcb_randr_query_version_reply(conn,
+		        xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION,
+		                                XCB_RANDR_MINOR_VERSION), NULL);
+		/* monitors were added in RandR 1.5 */
+		if (ver && (ver->major_version > 1 || ver->minor_version >= 5)) {
+			randr_event = ext->first_event;
+			xcb_randr_select_input(conn, root,
+			        XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE);
+		}
+		free(ver);
+	}
+	update_monitors();
+}
+
+/* update_monitors: read the current layout of the monitors */
+static void update_monitors(void)
+{
+	xcb_randr_get_monitors_reply_t *r;
+	xcb_randr_monitor_info_iterator_t it;
+	size_t i;
+
+	r = NULL;
+	if (randr_event)
+		r = xcb_randr_get_monitors_reply(conn,
+		        xcb_randr_get_monitors(conn, root, 1), NULL);
+
+	if (!r || !r->nMonitors) {
+		monitors = realloc(monitors, sizeof *monitors);
+		monitors[0].x = monitors[0].y = 0;
+		monitors[0].width = screen_width;
+		monitors[0].height = screen_height;
+		nmonitors = 1;
+		free(r);
+		return;
+	}
+
+	monitors = realloc(monitors, r->nMonitors * sizeof *monitors);
+	it = xcb_randr_get_monitors_monitors_iterator(r);
+	for (i = 0; it.rem; ++i, xcb_randr_monitor_info_next(&it)) {
+		monitors[i].x = it.data->x;
+		monitors[i].y = it.data->y;
+		monitors[i].width = it.data->width;
+		monitors[i].height = it.data->height;
+		PRINT_DEBUG("monitor %zu: %ux%u+%d+%d\n", i + 1,
+		            monitors[i].width, monitors[i].height,
+		            monitors[i].x, monitors[i].y);
+	}
+	nmonitors = i;
+	free(r);
+}
+
+/*
+ * request_active_window:
+ * Ask for the current active window. The reply is only
+ * read once the value is needed, replacing any older request.
+ */
+static void request_active_window(void)
+{
+	if (active_pending)
+		xcb_discard_reply(conn, active_cookie.sequence);
+
+	active_cookie = xcb_get_property(conn, 0, root, net_active_window,
+	                                 XCB_ATOM_WINDOW, 0, 1);
+	active_pending = 1;
+}
+
+/*
+ * Simulated input is queued in the XCB output buffer and written to the
+ * server all at once when the event loop flushes, at the end of each
+ * action. In immediate mode, each event is flushed as soon as it is queued.
+ */
+
+/* keys pressed to apply each modifier to a simulated key */
+static const struct {
+	uint16_t	mask;
+	xcb_keysym_t	keysym;
+	xcb_keysym_t	right;		/* keysym of the right-hand key */
+} mod_keys[] = {
+	{ XCB_MOD_MASK_SHIFT,   XK_Shift_L,   XK_Shift_R },
+	{ XCB_MOD_MASK_CONTROL, XK_Control_L, XK_Control_R },
+	{ XCB_MOD_MASK_4,       XK_Super_L,   XK_Super_R },
+	{ XCB_MOD_MASK_1,       XK_Alt_L,     XK_Alt_R }
+};
+
+#define NUM_MOD_KEYS (sizeof mod_keys / sizeof *mod_keys)
+
+/* all modifiers in mod_keys */
+#define INJECT_MODS (XCB_MOD_MASK_SHIFT | XCB_MOD_MASK_CONTROL \
+                     | XCB_MOD_MASK_4 | XCB_MOD_MASK_1)
+
+/* keycodes of mod_keys and of their right-hand versions */
+static xcb_keycode_t mod_keycodes[NUM_MOD_KEYS];
+static xcb_keycode_t right_keycodes[NUM_MOD_KEYS];
+
+/* direct-mapped cache of keysym to keycode lookups */
+#define KC_CACHE_SIZE 64
+
+static struct {
+	xcb_keysym_t	keysym;
+	xcb_keycode_t	keycode;
+} kc_cache[KC_CACHE_SIZE];
+
+/* get_keycode: return the first keycode producing keysym, or 0 */
+static xcb_keycode_t get_keycode(xcb_keysym_t keysym)
+{
+	xcb_keycode_t *kc, ret;
+	size_t i;
+
+	/* raw keycodes need no lookup */
+	if (X11_ISKEYCODE(keysym))
+		return keysym & 0xFF;
+
+	i = keysym % KC_CACHE_SIZE;
+	if (kc_cache[i].keycode && kc_cache[i].keysym == keysym)
+		return kc_cache[i].keycode;
+
+	if (!(kc = xcb_key_symbols_get_keycode(keysyms, keysym)))
+		return 0;
+	ret = kc[0];
+	free(kc);
+
+	kc_cache[i].keysym = keysym;
+	kc_cache[i].keycode = ret;
+	return ret;
+}
+
+/* reset_keycodes: discard cached keycodes after the keyboard mapping changes */
+static void reset_keycodes(void)
+{
+	size_t i;
+
+	memset(kc_cache, 0, sizeof kc_cache);
+	for (i = 0; i < NUM_MOD_KEYS; ++i) {
+		mod_keycodes[i] = get_keycode(mod_keys[i].keysym);
+		right_keycodes[i] = get_keycode(mod_keys[i].right);
+	}
+}
+
+/*
+ * track_sides:
+ * Update the held right-hand modifiers from an XKB state notification.
+ * A modifier which is no longer set has neither of its keys held.
+ * If both sides of a modifier are held and the right one is released,
+ * the modifier is taken to be held on the left only.
+ */
+static void track_sides(const xcb_xkb_state_notify_event_t *sn)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_MOD_KEYS; ++i) {
+		if (!right_keycodes[i] || sn->keycode != right_keycodes[i])
+			continue;
+		if (sn->eventType == XCB_KEY_PRESS)
+			right_mods |= mod_keys[i].mask;
+		else if (sn->eventType == XCB_KEY_RELEASE)
+			right_mods &= ~mod_keys[i].mask;
+	}
+	right_mods &= sn->baseMods;
+}
+
+/* fake_input: queue a simulated input event */
+static void fake_input(uint8_t type, uint8_t detail)
+{
+	xcb_test_fake_input(conn, type, detail, XCB_CURRENT_TIME,
+	                    XCB_NONE, 0, 0, 0);
+	if (kbm_info.immediate)
+		xcb_flush(conn);
+}
+
+/* send_button: send a button event */
+void send_button(unsigned int button)
+{
+	fake_input(XCB_BUTTON_PRESS, button);
+	fake_input(XCB_BUTTON_RELEASE, button);
+}
+
+/* send_button_event: send a press or release of a mouse button */
+void send_button_event(unsigned int button, unsigned int type)
+{
+	fake_input(type == KBM_PRESS ? XCB_BUTTON_PRESS : XCB_BUTTON_RELEASE,
+	           button);
+}
+
+/* send_scroll: scroll count notches in direction dir */
+void send_scroll(unsigned int dir, unsigned int count)
+{
+	/* X11 scroll wheels are buttons 4 to 7 */
+	while (count--)
+		send_button(dir);
+}
+
+/*
+ * fake_mods:
+ * Press or release the modifier keys in modmask, using the right-hand
+ * key of those which are also set in X11_RIGHT(modmask).
+ */
+static void fake_mods(uint8_t type, unsigned int modmask)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_MOD_KEYS; ++i) {
+		if (!(modmask & mod_keys[i].mask))
+			continue;
+		if (modmask & X11_RIGHT(mod_keys[i].mask) && right_keycodes[i])
+			fake_input(type, right_keycodes[i]);
+		else
+			fake_input(type, mod_keycodes[i]);
+	}
+}
+
+/*
+ * send_keycode:
+ * Send an event for key kc with exactly the modifiers in modmask applied.
+ * Modifiers held by the user which are not part of modmask are released
+ * for as long as the key is down and pressed again when it is released,
+ * in the same batch of requests as the key itself.
+ */
+static void send_keycode(xcb_keycode_t kc, unsigned int modmask,
+                         unsigned int type)
+{
+	unsigned int held, conflict;
+
+	/*
+	 * A held modifier satisfies modmask whichever side it is held on;
+	 * only the modifiers pressed by kbm follow the requested side.
+	 */
+	held = held_mods & INJECT_MODS;
+	if (type == KBM_PRESS) {
+		conflict = held & ~modmask & ~suppressed_mods;
+		fake_mods(XCB_KEY_RELEASE,
+		          conflict | X11_RIGHT(conflict & right_mods));
+		suppressed_mods |= conflict;
+		suppressed_right |= conflict & right_mods;
+
+		/* press missing modifier keys, then the requested key */
+		fake_mods(XCB_KEY_PRESS, modmask & ~held);
+		fake_input(XCB_KEY_PRESS, kc);
+	} else {
+		/* release the requested key and the modifiers pressed for it */
+		fake_input(XCB_KEY_RELEASE, kc);
+		fake_mods(XCB_KEY_RELEASE, modmask & ~held);
+
+		/* restore suppressed modifiers which are still held */
+		conflict = suppressed_mods & held;
+		fake_mods(XCB_KEY_PRESS,
+		          conflict | X11_RIGHT(conflict & suppressed_right));
+		suppressed_mods = suppressed_right = 0;
+	}
+}
+
+/* send_key: send a key event */
+void send_key(unsigned int keycode, unsigned int modmask, unsigned int type)
+{
+	xcb_keycode_t kc;
+
+	if ((kc = get_keycode(keycode)))
+		send_keycode(kc, modmask, type);
+}
+
+/*
+ * Text is typed by tapping the keys which produce each character. Those
+ * with no key in the current layout are bound to spare keycodes, which
+ * have no keysyms of their own, for as long as they are needed.
+ *
+ * Clients translate keycodes when they read the events, so a spare
+ * keycode cannot be rebound until earlier events using it have been
+ * handled. Text is therefore typed in batches of at most one character
+ * per spare keycode, with a short delay between batches.
+ */
+#define TYPE_QUEUE_LEN	16	/* maximum number of pending texts */
+#define TYPE_SPARE_MAX	32	/* maximum number of spare keycodes used */
+#define TYPE_DELAY	10	/* milliseconds between batches */
+
+/* pending texts, the first of which is being typed */
+static const uint32_t *type_queue[TYPE_QUEUE_LEN];
+static size_t type_head, type_count;
+
+/* next character of the text being typed */
+static const uint32_t *type_pos;
+
+/* delays the next batch, or resetting the spare keycodes after the last */
+static struct timer type_timer;
+
+static xcb_keycode_t spare_keycodes[TYPE_SPARE_MAX];
+static size_t nspare;
+static uint8_t is_spare[256 / 8];
+
+/* number of spare keycodes currently bound to a keysym */
+static size_t spares_bound;
+
+static void type_expire(struct timer *t);
+
+/* find_spare_keycodes: find keycodes with no keysyms bound to them */
+static void find_spare_keycodes(void)
+{
+	const xcb_setup_t *setup;
+	xcb_get_keyboard_mapping_reply_t *r;
+	xcb_keysym_t *syms;
+	int kc, i, n;
+
+	setup = xcb_get_setup(conn);
+	n = setup->max_keycode - setup->min_keycode + 1;
+	r = xcb_get_keyboard_mapping_reply(conn,
+	        xcb_get_keyboard_mapping(conn, setup->min_keycode, n), NULL);
+	if (!r)
+		return;
+
+	syms = xcb_get_keyboard_mapping_keysyms(r);
+	for (kc = setup->max_keycode; kc >= setup->min_keycode; --kc) {
+		if (nspare == TYPE_SPARE_MAX)
+			break;
+		for (i = 0; i < r->keysyms_per_keycode; ++i) {
+			if (syms[(kc - setup->min_keycode)
+			         * r->keysyms_per_keycode + i])
+				break;
+		}
+		if (i == r->keysyms_per_keycode) {
+			spare_keycodes[nspare++] = kc;
+			is_spare[kc / 8] |= 1 << (kc % 8);
+		}
+	}
+	free(r);
+
+	timer_init(&type_timer, type_expire, NULL);
+	PRINT_DEBUG("%zu spare keycodes for typing\n", nspare);
+}
+
+/* bind_spare: bind the ith spare keycode to keysym ks */
+static void bind_spare(size_t i, xcb_keysym_t ks)
+{
+	/* bind both levels so that held shift has no effect */
+	xcb_keysym_t syms[2] = { ks, ks };
+
+	xcb_change_keyboard_mapping(conn, 1, spare_keycodes[i], 2, syms);
+}
+
+/*
+ * type_batch:
+ * Type the queued text until it runs out or all spare keycodes have been
+ * used, then wait before continuing or unbinding the spare keycodes.
+ */
+static void type_batch(void)
+{
+	xcb_keycode_t kc;
+	unsigned int mods;
+	size_t used;
+
+	used = 0;
+	while (type_count) {
+		if (!*type_pos) {
+			type_head = (type_head + 1) % TYPE_QUEUE_LEN;
+			if (--type_count)
+				type_pos = type_queue[type_head];
+			continue;
+		}
+
+		mods = 0;
+		kc = get_keycode(*type_pos);
+		if (kc && !(is_spare[kc / 8] & 1 << (kc % 8))) {
+			if (xcb_key_symbols_get_keysym(keysyms, kc, 0) != *type_pos)
+				mods = XCB_MOD_MASK_SHIFT;
+			if (mods && xcb_key_symbols_get_keysym(keysyms, kc, 1)
+			            != *type_pos)
+				kc = 0;
+		} else {
+			kc = 0;
+		}
+
+		if (!kc && !nspare) {
+			/* the character cannot be typed */
+			type_pos++;
+			continue;
+		}
+		if (!kc) {
+			if (used == nspare)
+				break;
+			bind_spare(used, *type_pos);
+			kc = spare_keycodes[used++];
+		}
+		send_keycode(kc, mods, KBM_PRESS);
+		send_keycode(kc, mods, KBM_RELEASE);
+		type_pos++;
+	}
+
+	if (used > spares_bound)
+		spares_bound = used;
+	if (type_count || spares_bound)
+		timer_start(&type_timer, loop_now() + TYPE_DELAY * 1000000);
+}
+
+/* type_expire: continue typing, or unbind spare keycodes once done */
+static void type_expire(struct timer *t)
+{
+	KBM_UNUSED(t);
+
+	if (type_count) {
+		type_batch();
+		return;
+	}
+	while (spares_bound)
+		bind_spare(--spares_bound, XCB_NO_SYMBOL);
+}
+
+/* send_text: type the keysyms in the zero-terminated array text */
+void send_text(const uint32_t *text)
+{
+	if (type_count == TYPE_QUEUE_LEN) {
+		PRINT_DEBUG("too much text queued for typing\n");
+		return;
+	}
+
+	type_queue[(type_head + type_count++) % TYPE_QUEUE_LEN] = text;
+	if (type_count == 1)
+		type_pos = text;
+	if (!TIMER_ACTIVE(&type_timer))
+		type_batch();
+}
+
+/* stop_typing: discard queued text and unbind spare keycodes */
+static void stop_typing(void)
+{
+	type_count = 0;
+	if (TIMER_ACTIVE(&type_timer)) {
+		timer_stop(&type_timer);
+		type_expire(&type_timer);
+	}
+}
+
+/* move_cursor: move cursor along vector x,y from current position */
+void move_cursor(int x, int y)
+{
+	xcb_warp_pointer(conn, XCB_NONE, XCB_NONE, 0, 0, 0, 0, x, y);
+	if (kbm_info.immediate)
+		xcb_flush(conn);
+}
+
+/*
+ * warp_cursor:
+ * Move the cursor to x,y within the given monitor, counting from 1,
+ * or within the whole screen if monitor is 0. Coordinates flagged in
+ * flags as percentages are taken as fractions of the area's size.
+ */
+void warp_cursor(unsigned int monitor, int x, int y, unsigned int flags)
+{
+	struct monitor area;
+
+	if (monitor > nmonitors) {
+		PRINT_DEBUG("no monitor %u\n", monitor);
+		return;
+	}
+	if (monitor) {
+		area = monitors[monitor - 1];
+	} else {
+		area.x = area.y = 0;
+		area.width = screen_width;
+		area.height = screen_height;
+	}
+
+	if (flags & KBM_WARP_XPCT)
+		x = x * (area.width - 1) / 100;
+	if (flags & KBM_WARP_YPCT)
+		y = y * (area.height - 1) / 100;
+
+	xcb_warp_pointer(conn, XCB_NONE, root, 0, 0, 0, 0,
+	                 area.x + x, area.y + y);
+	if (kbm_info.immediate)
+		xcb_flush(conn);
+}
+
+/* drag_cursor: drag with the left button along vector x,y */
+void drag_cursor(int x, int y)
+{
+	fake_input(XCB_BUTTON_PRESS, KBM_BUTTON_LEFT);
+	move_cursor(x, y);
+	fake_input(XCB_BUTTON_RELEASE, KBM_BUTTON_LEFT);
+}
+
+/* keysym_used: check if hotkeys other than hk use keysym ks */
+static int keysym_used(xcb_keysym_t ks, const struct hotkey *hk)
+{
+	struct hotkey *lists[] = { actions, toggles }, *h;
+	size_t i, j;
+
+	for (i = 0; i < 2; ++i) {
+		for (h = lists[i]; h; h = h->next) {
+			if (h == hk)
+				continue;
+			if (h->os_code == ks)
+				return 1;
+			for (j = 0; h->seq && j < h->seq->len; ++j) {
+				if (h->seq->keys[j].os_code == ks)
+					return 1;
+			}
+			for (j = 0; j < h->nops; ++j) {
+				if (h->ops[j].op == OP_KEY
+				    && OSCODE(h->ops[j].args & 0xFFFFFFFF) == ks)
+					return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * is_remap:
+ * Check if hk can be applied as a remap: its only operation is an
+ * unmodified key, neither key is modified, and neither key is used by
+ * any other binding, whose grabs would otherwise be affected.
+ */
+static int is_remap(const struct hotkey *hk)
+{
+	uint32_t code, mods;
+
+	if (hk->nops != 1 || hk->ops[0].op != OP_KEY || hk->kbm_modmask
+	    || hk->key_flags || hk->layer || X11_ISBUTTON(hk->os_code)
+	    || X11_ISKEYCODE(hk->os_code))
+		return 0;
+
+	code = hk->ops[0].args & 0xFFFFFFFF;
+	mods = (hk->ops[0].args >> 32) & 0xFFFFFFFF;
+	return !mods && !K_ISRAW(code) && !keysym_used(hk->os_code, hk)
+	       && !keysym_used(OSCODE(code), hk);
+}
+
+/* find_keysym: find the keycode whose first keysym is ks in a mapping */
+static xcb_keycode_t find_keysym(const xcb_keysym_t *syms, uint8_t width,
+                                 xcb_keycode_t min, int n, xcb_keysym_t ks)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (syms[i * width] == ks)
+			return min + i;
+	}
+	return 0;
+}
+
+/* apply_remaps: apply the actions found eligible at load as remaps */
+static void apply_remaps(void)
+{
+	struct hotkey *hk;
+	const xcb_setup_t *setup;
+	xcb_get_keyboard_mapping_reply_t *r;
+	xcb_keysym_t *syms;
+	xcb_keycode_t src, dst;
+	struct remap *rm;
+	size_t i;
+	int n;
+
+	if (!nremap_keys)
+		return;
+
+	setup = xcb_get_setup(conn);
+	n = setup->max_keycode - setup->min_keycode + 1;
+	r = xcb_get_keyboard_mapping_reply(conn,
+	        xcb_get_keyboard_mapping(conn, setup->min_keycode, n), NULL);
+	if (!r)
+		return;
+
+	syms = xcb_get_keyboard_mapping_keysyms(r);
+	remap_width = r->keysyms_per_keycode;
+	for (i = 0; i < nremap_keys; ++i) {
+		hk = remap_keys[i];
+
+		/* both keys are looked up in the original mapping */
+		src = find_keysym(syms, remap_width, setup->min_keycode, n,
+		                  hk->os_code);
+		dst = find_keysym(syms, remap_width, setup->min_keycode, n,
+		                  OSCODE(hk->ops[0].args & 0xFFFFFFFF));
+		if (!src || !dst)
+			continue;
+
+		remaps = realloc(remaps, (nremaps + 1) * sizeof *remaps);
+		rm = &remaps[nremaps++];
+		rm->hk = hk;
+		rm->keycode = src;
+		rm->orig = malloc(remap_width * sizeof *rm->orig);
+		memcpy(rm->orig, syms + (src - setup->min_keycode) * remap_width,
+		       remap_width * sizeof *rm->orig);
+
+		xcb_change_keyboard_mapping(conn, 1, src, remap_width, syms
+		                            + (dst - setup->min_keycode)
+		                            * remap_width);
+		PRINT_DEBUG("remapped %s to keycode %u\n",
+		            keystr(hk->kbm_code, hk->kbm_modmask), dst);
+	}
+	free(r);
+}
+
+/* find_remap: return the remap applying hk, if any */
+static struct remap *find_remap(const struct hotkey *hk)
+{
+	size_t i;
+
+	for (i = 0; i < nremaps; ++i) {
+		if (remaps[i].hk == hk)
+			return &remaps[i];
+	}
+	return NULL;
+}
+
+/* undo_remap: restore the original keysyms of a remapped key */
+static void undo_remap(struct remap *rm)
+{
+	xcb_change_keyboard_mapping(conn, 1, rm->keycode, remap_width,
+	                            rm->orig);
+	free(rm->orig);
+	*rm = remaps[--nremaps];
+}
+
+/* map_keys: grab all provided hotkeys */
+static void map_keys(struct hotkey *head, int set_state)
+{
+	struct hotkey *hk;
+
+	if (!head)
+		return;
+
+	if (set_state && !has_op(head, OP_TOGGLE))
+		kbm_info.keys_toggled = 1;
+
+	if (!has_op(head, OP_TOGGLE))
+		apply_remaps();
+	for (hk = head; hk; hk = hk->next) {
+		if (!hk->layer && !find_remap(hk))
+			grab_hotkey(hk);
+	}
+	/* the active layer is grabbed along with the actions */
+	if (!has_op(head, OP_TOGGLE))
+		grab_layer(ACTIVE_LAYER, 1);
+	xcb_flush(conn);
+}
+
+/* grab_hotkey: grab the key or button of hotkey hk */
+static void grab_hotkey(const struct hotkey *hk)
+{
+	xcb_keycode_t kc;
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+
+	if (X11_ISBUTTON(hk->os_code)) {
+		grab_button(hk);
+		return;
+	}
+	if (hk->key_flags & KBM_CHORD) {
+		grab_chord(hk, 1);
+		return;
+	}
+
+	/* a grab of keycode 0 would be one of every key */
+	if (!(kc = get_keycode(hk->os_code))) {
+		fprintf(stderr, "warning: the key `%s' is not on "
+		        "the keyboard\n",
+		        keystr(hk->kbm_code, hk->kbm_modmask));
+		return;
+	}
+	if (hk->key_flags & KBM_WILDCARD) {
+		grab_wildcard(hk, kc);
+		return;
+	}
+	cookie = xcb_grab_key_checked(conn, 1, root,
+	                              X11_MODS(hk->os_modmask), kc,
+	                              XCB_GRAB_MODE_ASYNC,
+	                              XCB_GRAB_MODE_ASYNC);
+
+	/* key grab will fail if the key is already grabbed */
+	if ((err = xcb_request_check(conn, cookie))) {
+		fprintf(stderr, "error: the key `%s' is already "
+		        "mapped by another program\n",
+		        keystr(hk->kbm_code, hk->kbm_modmask));
+		free(err);
+	}
+
+	/*
+	 * In X11, Caps Lock and Num Lock are defined as modifiers and
+	 * events involving these keys held down are treated as
+	 * different events to those occurring without them.
+	 *
+	 * We don't want to distinguish between these events, so we
+	 * also grab the key with the Caps and Num Lock masks.
+	 */
+
+	/* num lock */
+	xcb_grab_key(conn, 1, root, X11_MODS(hk->os_modmask)
+	             | XCB_MOD_MASK_2, kc, XCB_GRAB_MODE_ASYNC,
+	             XCB_GRAB_MODE_ASYNC);
+	/* caps lock */
+	xcb_grab_key(conn, 1, root, X11_MODS(hk->os_modmask)
+	             | XCB_MOD_MASK_LOCK, kc, XCB_GRAB_MODE_ASYNC,
+	             XCB_GRAB_MODE_ASYNC);
+	/* both */
+	xcb_grab_key(conn, 1, root, X11_MODS(hk->os_modmask)
+	             | XCB_MOD_MASK_LOCK | XCB_MOD_MASK_2, kc,
+	             XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+}
+
+/* lock modifiers with which every button binding is also grabbed */
+static const uint16_t lock_masks[] = {
+	XCB_MOD_MASK_2,
+	XCB_MOD_MASK_LOCK,
+	XCB_MOD_MASK_2 | XCB_MOD_MASK_LOCK
+};
+
+#define NUM_LOCK_MASKS (sizeof lock_masks / sizeof *lock_masks)
+
+/* grab_keycode: grab or ungrab kc with mods, with and without locks */
+static void grab_keycode(xcb_keycode_t kc, uint16_t mods, int grab)
+{
+	uint16_t mask;
+	size_t i;
+
+	mask = mods;
+	for (i = 0; i <= NUM_LOCK_MASKS; ++i) {
+		if (grab)
+			xcb_grab_key(conn, 1, root, mask, kc,
+			             XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+		else
+			xcb_ungrab_key(conn, kc, root, mask);
+		if (i < NUM_LOCK_MASKS)
+			mask = mods | lock_masks[i];
+	}
+}
+
+/* grab_chord: grab or ungrab every key of chord hk */
+static void grab_chord(const struct hotkey *hk, int grab)
+{
+	const struct seq_key *k;
+	xcb_keycode_t kc;
+	size_t i;
+
+	if (!(kc = get_keycode(hk->os_code)) && grab)
+		fprintf(stderr, "warning: the key `%s' is not on "
+		        "the keyboard\n",
+		        keystr(hk->kbm_code, hk->kbm_modmask));
+	if (kc)
+		grab_keycode(kc, X11_MODS(hk->os_modmask), grab);
+
+	for (i = 0; i < hk->seq->len; ++i) {
+		k = &hk->seq->keys[i];
+		if ((kc = get_keycode(k->os_code)))
+			grab_keycode(kc, X11_MODS(k->os_modmask), grab);
+		else if (grab)
+			fprintf(stderr, "warning: the key `%s' is not on "
+			        "the keyboard\n",
+			        keystr(k->kbm_code, k->kbm_modmask));
+	}
+}
+
+/* the most modifier masks a wildcard binding is grabbed with */
+#define MAX_WILDCARD_MASKS 8
+
+/*
+ * wildcard_masks:
+ * Store the modifier masks, not counting the lock modifiers, with which
+ * wildcard binding hk is grabbed in masks and return their number.
+ * A wildcard requiring no modifiers is a single AnyModifier grab;
+ * others are grabbed with each combination of the remaining modifiers.
+ */
+static size_t wildcard_masks(const struct hotkey *hk, uint16_t *masks)
+{
+	uint16_t mods, free_mods, sub;
+	size_t n;
+
+	mods = X11_MODS(hk->os_modmask);
+	if (!(mods & INJECT_MODS)) {
+		masks[0] = XCB_MOD_MASK_ANY;
+		return 1;
+	}
+
+	free_mods = INJECT_MODS & ~mods;
+	n = 0;
+	sub = free_mods;
+	do {
+		masks[n++] = mods | sub;
+		sub = (sub - 1) & free_mods;
+	} while (sub != free_mods);
+	return n;
+}
+
+/* button_masks: store the modifier masks button binding hk is grabbed with */
+static size_t button_masks(const struct hotkey *hk, uint16_t *masks)
+{
+	if (hk->key_flags & KBM_WILDCARD)
+		return wildcard_masks(hk, masks);
+
+	masks[0] = X11_MODS(hk->os_modmask);
+	return 1;
+}
+
+/* grab_wildcard: grab key kc with every modifier mask wildcard hk matches */
+static void grab_wildcard(const struct hotkey *hk, xcb_keycode_t kc)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+	uint16_t masks[MAX_WILDCARD_MASKS];
+	size_t i, j, n;
+
+	n = wildcard_masks(hk, masks);
+	cookie = xcb_grab_key_checked(conn, 1, root, masks[0], kc,
+	                              XCB_GRAB_MODE_ASYNC,
+	                              XCB_GRAB_MODE_ASYNC);
+	if ((err = xcb_request_check(conn, cookie))) {
+		fprintf(stderr, "error: the key `%s' is already "
+		        "mapped by another program\n",
+		        keystr(hk->kbm_code, hk->kbm_modmask));
+		free(err);
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (i)
+			xcb_grab_key(conn, 1, root, masks[i], kc,
+			             XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+		/* AnyModifier already includes the lock modifiers */
+		if (masks[i] == XCB_MOD_MASK_ANY)
+			continue;
+		for (j = 0; j < NUM_LOCK_MASKS; ++j)
+			xcb_grab_key(conn, 1, root, masks[i] | lock_masks[j],
+			             kc, XCB_GRAB_MODE_ASYNC,
+			             XCB_GRAB_MODE_ASYNC);
+	}
+}
+
+/* ungrab_wildcard: release the grabs of wildcard hk on key kc */
+static void ungrab_wildcard(const struct hotkey *hk, xcb_keycode_t kc)
+{
+	uint16_t masks[MAX_WILDCARD_MASKS];
+	size_t i, j, n;
+
+	n = wildcard_masks(hk, masks);
+	for (i = 0; i < n; ++i) {
+		xcb_ungrab_key(conn, kc, root, masks[i]);
+		if (masks[i] == XCB_MOD_MASK_ANY)
+			continue;
+		for (j = 0; j < NUM_LOCK_MASKS; ++j)
+			xcb_ungrab_key(conn, kc, root,
+			               masks[i] | lock_masks[j]);
+	}
+}
+
+/*
+ * restore_grabs:
+ * Grab the keys of the other mapped list which are shared with the
+ * bindings in head again after these have been ungrabbed. Grabs of the
+ * same key overlap when one of them is a wildcard, and AnyModifier
+ * ungrabs release every grab of a key.
+ */
+static void restore_grabs(struct hotkey *head)
+{
+	struct hotkey *other, *hk;
+	xcb_keycode_t kc;
+
+	if (!kbm_info.keys_active)
+		return;
+	if (has_op(head, OP_TOGGLE)) {
+		if (!kbm_info.keys_toggled)
+			return;
+		other = actions;
+	} else {
+		other = toggles;
+	}
+
+	/* the active layer's grabs may overlap those of the toggles */
+	if (other == actions)
+		grab_layer(ACTIVE_LAYER, 1);
+
+	for (; other; other = other->next) {
+		if (other->layer || find_remap(other))
+			continue;
+		/* the keys of a chord may be shared with any binding */
+		if (other->key_flags & KBM_CHORD) {
+			grab_hotkey(other);
+			continue;
+		}
+		if (X11_ISBUTTON(other->os_code)) {
+			for (hk = head; hk; hk = hk->next) {
+				if (hk->os_code == other->os_code)
+					break;
+			}
+		} else {
+			if (!(kc = get_keycode(other->os_code)))
+				continue;
+			for (hk = head; hk; hk = hk->next) {
+				if (uses_keycode(hk, kc))
+					break;
+			}
+		}
+		if (hk)
+			grab_hotkey(other);
+	}
+}
+
+/* uses_keycode: check if any key of hotkey hk is on keycode kc */
+static int uses_keycode(const struct hotkey *hk, xcb_keycode_t kc)
+{
+	size_t i;
+
+	if (X11_ISBUTTON(hk->os_code))
+		return 0;
+	if (get_keycode(hk->os_code) == kc)
+		return 1;
+	if (hk->key_flags & KBM_CHORD) {
+		for (i = 0; i < hk->seq->len; ++i) {
+			if (get_keycode(hk->seq->keys[i].os_code) == kc)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* grab_button: grab the mouse button of hotkey hk */
+static void grab_button(const struct hotkey *hk)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+	uint16_t mask, masks[MAX_WILDCARD_MASKS];
+	size_t i, j, n;
+
+	n = button_masks(hk, masks);
+	mask = XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE;
+	cookie = xcb_grab_button_checked(conn, 1, root, mask,
+	                                 XCB_GRAB_MODE_ASYNC,
+	                                 XCB_GRAB_MODE_ASYNC, XCB_NONE,
+	                                 XCB_NONE, hk->os_code & 0xFF,
+	                                 masks[0]);
+	if ((err = xcb_request_check(conn, cookie))) {
+		fprintf(stderr, "error: the button `%s' is already "
+		        "mapped by another program\n",
+		        keystr(hk->kbm_code, hk->kbm_modmask));
+		free(err);
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (i)
+			xcb_grab_button(conn, 1, root, mask,
+			                XCB_GRAB_MODE_ASYNC,
+			                XCB_GRAB_MODE_ASYNC, XCB_NONE,
+			                XCB_NONE, hk->os_code & 0xFF,
+			                masks[i]);
+		if (masks[i] == XCB_MOD_MASK_ANY)
+			continue;
+
+		/* as with keys, ignore the state of Num Lock and Caps Lock */
+		for (j = 0; j < NUM_LOCK_MASKS; ++j)
+			xcb_grab_button(conn, 1, root, mask,
+			                XCB_GRAB_MODE_ASYNC,
+			                XCB_GRAB_MODE_ASYNC, XCB_NONE,
+			                XCB_NONE, hk->os_code & 0xFF,
+			                masks[i] | lock_masks[j]);
+	}
+}
+
+/* ungrab_button: release the grabs of the mouse button of hotkey hk */
+static void ungrab_button(const struct hotkey *hk)
+{
+	uint16_t masks[MAX_WILDCARD_MASKS];
+	size_t i, j, n;
+
+	n = button_masks(hk, masks);
+	for (i = 0; i < n; ++i) {
+		xcb_ungrab_button(conn, hk->os_code & 0xFF, root, masks[i]);
+		if (masks[i] == XCB_MOD_MASK_ANY)
+			continue;
+		for (j = 0; j < NUM_LOCK_MASKS; ++j)
+			xcb_ungrab_button(conn, hk->os_code & 0xFF, root,
+			                  masks[i] | lock_masks[j]);
+	}
+}
+
+/* dispatch_hash: return the home slot of a code and modifier mask */
+static size_t dispatch_hash(uint16_t state, uint32_t code, uint32_t mask)
+{
+	return ((code * 0x9E3779B1u) ^ (mask * 0x85EBCA6Bu)
+	        ^ (state * 0xC2B2AE35u)) & dispatch_mask;
+}
+
+#define ENTRY_USED(e) ((e)->hk || (e)->next)
+
+/* check if an entry continues a key sequence */
+#define IN_SEQUENCE(e) \
+	(ENTRY_USED(e) && (e)->state > nlayers && (e)->state != CHORD_STATE)
+
+/*
+ * dispatch_insert:
+ * Enter hk, or the prefix leading to state next, under code and mask in
+ * state. Return the new entry, or the one which already took its place.
+ */
+static struct dispatch_entry *dispatch_insert(uint16_t state, uint32_t code,
+                                              uint32_t mask,
+                                              struct hotkey *hk,
+                                              uint16_t next)
+{
+	struct dispatch_entry *ent;
+	size_t slot;
+
+	slot = dispatch_hash(state, code, mask);
+	while (ENTRY_USED(ent = &dispatch[slot])) {
+		if (ent->state == state && ent->code == code
+		    && ent->mask == mask)
+			return ent;
+		slot = (slot + 1) & dispatch_mask;
+	}
+	ent->code = code;
+	ent->mask = mask;
+	ent->state = state;
+	ent->next = next;
+	ent->hk = hk;
+	return ent;
+}
+
+/* count_mods: return the number of modifiers set in mask */
+static unsigned int count_mods(uint32_t mask)
+{
+	unsigned int n;
+
+	for (n = 0; mask; mask &= mask - 1)
+		n++;
+	return n;
+}
+
+/*
+ * insert_sequence:
+ * Add the keys of sequence binding hk to the trie. A sequence which runs
+ * into a binding of one of its prefixes, or whose last key is already
+ * a prefix, is left out.
+ */
+static void insert_sequence(struct hotkey *hk)
+{
+	struct dispatch_entry *ent;
+	uint32_t code, mask;
+	uint16_t state;
+	size_t i;
+
+	state = 0;
+	code = hk->os_code;
+	mask = hk->os_modmask;
+	for (i = 0; i < hk->seq->len; ++i) {
+		if (nstates == UINT16_MAX)
+			return;
+		ent = dispatch_insert(state, code, mask, NULL, nstates);
+		if (ent->hk)
+			return;
+		if (ent->next == nstates)
+			nstates++;
+
+		state = ent->next;
+		code = hk->seq->keys[i].os_code;
+		mask = hk->seq->keys[i].os_modmask;
+	}
+	dispatch_insert(state, code, mask, hk, 0);
+}
+
+/* index_states: list the entries of each sequence state */
+static void index_states(void)
+{
+	size_t *fill, slot;
+	uint16_t i;
+
+	free(state_slots);
+	free(state_start);
+	state_start = calloc(nstates + 1, sizeof *state_start);
+	for (slot = 0; slot <= dispatch_mask; ++slot) {
+		if (IN_SEQUENCE(&dispatch[slot]))
+			state_start[dispatch[slot].state + 1]++;
+	}
+	for (i = 0; i < nstates; ++i)
+		state_start[i + 1] += state_start[i];
+
+	state_slots = malloc((state_start[nstates] + 1) * sizeof *state_slots);
+	fill = malloc(nstates * sizeof *fill);
+	memcpy(fill, state_start, nstates * sizeof *fill);
+	for (slot = 0; slot <= dispatch_mask; ++slot) {
+		if (IN_SEQUENCE(&dispatch[slot]))
+			state_slots[fill[dispatch[slot].state]++] = slot;
+	}
+	free(fill);
+}
+
+/*
+ * build_dispatch:
+ * Index the loaded actions and toggles by OS code and modifiers.
+ * The table is kept at most half full to keep probe sequences short.
+ */
+static void build_dispatch(void)
+{
+	struct hotkey *lists[] = { actions, toggles }, *hk;
+	struct dispatch_entry *ent;
+	const struct seq_key *k;
+	struct gesture *g;
+	size_t i, j, n, size, ngest;
+	uint32_t free_mods, sub;
+	unsigned int bits;
+
+	/* a sequence or chord in progress refers to the old table */
+	end_sequence();
+	reset_chords();
+	reset_dual();
+	reset_gestures();
+	memset(seq_down, 0, sizeof seq_down);
+	free(dispatch);
+	dispatch = NULL;
+	free(state_slots);
+	free(state_start);
+	state_slots = NULL;
+	state_start = NULL;
+	free(layer_grabs);
+	free(layer_start);
+	layer_grabs = NULL;
+	layer_start = NULL;
+	layer_depth = 0;
+	free(base_grabs);
+	free(toggle_grabs);
+	free(remap_keys);
+	base_grabs = toggle_grabs = NULL;
+	nbase_grabs = ntoggle_grabs = 0;
+	remap_keys = NULL;
+	nremap_keys = 0;
+	nlayers = kbm_info.map.nlayers;
+	nstates = nlayers + 1;
+	free(chords);
+	chords = NULL;
+	nchords = 0;
+	free(gestures);
+	gestures = NULL;
+
+	n = ngest = 0;
+	for (i = 0; i < 2; ++i) {
+		for (hk = lists[i]; hk; hk = hk->next) {
+			hk->gest = NULL;
+			if (hk->key_flags & (KBM_DOUBLE | KBM_LONG))
+				ngest++;
+			if (hk->key_flags & KBM_WILDCARD)
+				n += 1 << count_mods(INJECT_MODS
+				                     & ~hk->os_modmask);
+			else if (hk->seq)
+				n += hk->seq->len + 1;
+			else
+				n++;
+			if (hk->key_flags & KBM_CHORD)
+				nchords++;
+		}
+	}
+	if (!n)
+		return;
+	if (nchords)
+		chords = malloc(nchords * sizeof *chords);
+	if (ngest)
+		gestures = malloc(ngest * sizeof *gestures);
+
+	for (size = 16; size < 2 * n; size <<= 1)
+		;
+	dispatch = calloc(size, sizeof *dispatch);
+	dispatch_mask = size - 1;
+
+	/* the first binding of a key is the one used */
+	for (i = 0; i < 2; ++i) {
+		for (hk = lists[i]; hk; hk = hk->next) {
+			if (!(hk->key_flags & (KBM_WILDCARD | KBM_SEQUENCE
+			                       | KBM_CHORD | KBM_DOUBLE
+			                       | KBM_LONG)))
+				dispatch_insert(hk->layer, hk->os_code,
+				                hk->os_modmask, hk, 0);
+		}
+	}
+
+	/*
+	 * Double taps and long presses join the binding of their key,
+	 * or take its place if it has none, leaving single taps unbound.
+	 */
+	ngest = 0;
+	for (i = 0; i < 2; ++i) {
+		for (hk = lists[i]; hk; hk = hk->next) {
+			if (!(hk->key_flags & (KBM_DOUBLE | KBM_LONG)))
+				continue;
+			ent = dispatch_insert(hk->layer, hk->os_code,
+			                      hk->os_modmask, hk, 0);
+			if (ent->hk->key_flags & KBM_HOLD)
+				continue;
+			if (!(g = ent->hk->gest)) {
+				g = &gestures[ngest++];
+				g->tap = ent->hk == hk ? NULL : ent->hk;
+				g->dbl = g->lng = NULL;
+				ent->hk->gest = g;
+			}
+			if (hk->key_flags & KBM_DOUBLE && !g->dbl)
+				g->dbl = hk;
+			if (hk->key_flags & KBM_LONG && !g->lng)
+				g->lng = hk;
+		}
+	}
+
+	/* the keys of chords are marked in a state of their own */
+	nchords = 0;
+	for (i = 0; i < 2; ++i) {
+		for (hk = lists[i]; hk; hk = hk->next) {
+			if (!(hk->key_flags & KBM_CHORD))
+				continue;
+			chords[nchords++] = hk;
+			dispatch_insert(CHORD_STATE, hk->os_code,
+			                X11_MODS(hk->os_modmask), hk, 0);
+			for (j = 0; j < hk->seq->len; ++j) {
+				k = &hk->seq->keys[j];
+				dispatch_insert(CHORD_STATE, k->os_code,
+				                X11_MODS(k->os_modmask), hk, 0);
+			}
+		}
+	}
+
+	/* key sequences branch off into further states */
+	for (i = 0; i < 2; ++i) {
+		for (hk = lists[i]; hk; hk = hk->next) {
+			if (hk->key_flags & KBM_SEQUENCE)
+				insert_sequence(hk);
+		}
+	}
+
+	/* wildcards fill in what remains, the most specific first */
+	for (bits = 32; bits-- > 0; ) {
+		for (i = 0; i < 2; ++i) {
+			for (hk = lists[i]; hk; hk = hk->next) {
+				if (!(hk->key_flags & KBM_WILDCARD)
+				    || count_mods(hk->os_modmask) != bits)
+					continue;
+				free_mods = INJECT_MODS & ~hk->os_modmask;
+				sub = free_mods;
+				do {
+					dispatch_insert(hk->layer, hk->os_code,
+					                hk->os_modmask | sub,
+					                hk, 0);
+					sub = (sub - 1) & free_mods;
+				} while (sub != free_mods);
+			}
+		}
+	}
+	index_states();
+	build_grabs();
+}
+
+/* push_grab: append the grab of code with mods to the array *v of n */
+static void push_grab(uint32_t **v, size_t *n, size_t *size,
+                      uint32_t code, uint16_t mods)
+{
+	if (*n == *size) {
+		*size = *size ? *size * 2 : 32;
+		*v = realloc(*v, *size * sizeof **v);
+	}
+	(*v)[(*n)++] = code << 16 | mods;
+}
+
+static int cmp_grab(const void *a, const void *b)
+{
+	uint32_t x, y;
+
+	x = *(const uint32_t *)a;
+	y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* sort_grabs: sort the n grabs in v and drop repeats, returning those left */
+static size_t sort_grabs(uint32_t *v, size_t n)
+{
+	size_t i, j;
+
+	if (!n)
+		return 0;
+	qsort(v, n, sizeof *v, cmp_grab);
+	for (i = j = 1; i < n; ++i) {
+		if (v[i] != v[j - 1])
+			v[j++] = v[i];
+	}
+	return j;
+}
+
+/*
+ * add_grabs:
+ * Append the grabs made by map_keys for the bindings in list head outside
+ * layers to the array *v of n. Lock modifiers are left out, and buttons
+ * are told apart from keycodes by GRAB_BUTTON.
+ */
+static void add_grabs(struct hotkey *head, uint32_t **v, size_t *n,
+                      size_t *size)
+{
+	uint16_t masks[MAX_WILDCARD_MASKS];
+	size_t i, nmasks;
+	xcb_keycode_t kc;
+
+	for (; head; head = head->next) {
+		if (head->layer || is_remap(head))
+			continue;
+		if (X11_ISBUTTON(head->os_code)) {
+			nmasks = button_masks(head, masks);
+			for (i = 0; i < nmasks; ++i)
+				push_grab(v, n, size, GRAB_BUTTON
+				          | (head->os_code & 0xFF), masks[i]);
+			continue;
+		}
+		for (i = 0; head->key_flags & KBM_CHORD
+		            && i < head->seq->len; ++i) {
+			if ((kc = get_keycode(head->seq->keys[i].os_code)))
+				push_grab(v, n, size, kc,
+				          X11_MODS(head->seq->keys[i]
+				                   .os_modmask));
+		}
+		if (!(kc = get_keycode(head->os_code)))
+			continue;
+		if (!(head->key_flags & KBM_WILDCARD)) {
+			push_grab(v, n, size, kc, X11_MODS(head->os_modmask));
+			continue;
+		}
+		nmasks = wildcard_masks(head, masks);
+		for (i = 0; i < nmasks; ++i)
+			push_grab(v, n, size, kc, masks[i]);
+	}
+}
+
+/*
+ * build_grabs:
+ * Work out the grabs of the loaded bindings, and list the actions which
+ * are applied as remaps rather than grabbed.
+ */
+static void build_grabs(void)
+{
+	struct hotkey *hk;
+	size_t size;
+
+	size = 0;
+	add_grabs(toggles, &toggle_grabs, &ntoggle_grabs, &size);
+	ntoggle_grabs = sort_grabs(toggle_grabs, ntoggle_grabs);
+	size = 0;
+	add_grabs(actions, &base_grabs, &nbase_grabs, &size);
+	add_grabs(toggles, &base_grabs, &nbase_grabs, &size);
+	nbase_grabs = sort_grabs(base_grabs, nbase_grabs);
+
+	size = 0;
+	for (hk = actions; hk; hk = hk->next) {
+		if (!is_remap(hk))
+			continue;
+		if (nremap_keys == size) {
+			size = size ? size * 2 : 8;
+			remap_keys = realloc(remap_keys,
+			                     size * sizeof *remap_keys);
+		}
+		remap_keys[nremap_keys++] = hk;
+	}
+	build_layer_grabs();
+}
+
+/*
+ * build_layer_grabs:
+ * Work out the grabs of the bindings of each layer. Wildcards are grabbed
+ * with every combination of modifiers rather than AnyModifier, as
+ * ungrabbing that would release the other grabs of the key.
+ */
+static void build_layer_grabs(void)
+{
+	struct hotkey *lists[] = { actions, toggles }, *hk;
+	uint16_t mods, free_mods, sub;
+	uint32_t any;
+	size_t n, size, i, j;
+	unsigned int layer;
+	xcb_keycode_t kc;
+
+	if (!nlayers)
+		return;
+
+	layer_start = calloc(nlayers + 2, sizeof *layer_start);
+	n = size = 0;
+	for (layer = 1; layer <= nlayers; ++layer) {
+		layer_start[layer] = n;
+		for (i = 0; i < 2; ++i) {
+			for (hk = lists[i]; hk; hk = hk->next) {
+				if (hk->layer != layer
+				    || !(kc = get_keycode(hk->os_code)))
+					continue;
+				mods = X11_MODS(hk->os_modmask);
+				free_mods = hk->key_flags & KBM_WILDCARD
+				            ? INJECT_MODS & ~mods : 0;
+				sub = free_mods;
+				do {
+					push_grab(&layer_grabs, &n, &size,
+					          kc, mods | sub);
+					sub = (sub - 1) & free_mods;
+				} while (sub != free_mods);
+			}
+		}
+		if (n == layer_start[layer])
+			continue;
+		n = layer_start[layer]
+		    + sort_grabs(layer_grabs + layer_start[layer],
+		                 n - layer_start[layer]);
+
+		/* drop the grabs made outside layers */
+		j = layer_start[layer];
+		for (i = j; i < n; ++i) {
+			any = (layer_grabs[i] & 0xFFFF0000) | XCB_MOD_MASK_ANY;
+			if (nbase_grabs
+			    && (bsearch(&layer_grabs[i], base_grabs,
+			                nbase_grabs, sizeof *base_grabs,
+			                cmp_grab)
+			        || bsearch(&any, base_grabs, nbase_grabs,
+			                   sizeof *base_grabs, cmp_grab)))
+				continue;
+			layer_grabs[j++] = layer_grabs[i];
+		}
+		n = j;
+	}
+	layer_start[nlayers + 1] = n;
+}
+
+/* grab_layer: grab or ungrab the keys bound in layer */
+static void grab_layer(unsigned int layer, int grab)
+{
+	size_t i;
+
+	if (!layer || !layer_start)
+		return;
+	for (i = layer_start[layer]; i < layer_start[layer + 1]; ++i)
+		grab_keycode(layer_grabs[i] >> 16, layer_grabs[i] & 0xFFFF,
+		             grab);
+}
+
+/*
+ * switch_layer:
+ * Push, pop or set the active layer. While the actions are grabbed, the
+ * grabs of the layer left and the layer entered are compared, and only
+ * those which differ are changed.
+ */
+void switch_layer(unsigned int action, unsigned int layer)
+{
+	unsigned int from, to;
+
+	from = ACTIVE_LAYER;
+	switch (action) {
+	case LAYER_PUSH:
+		if (layer_depth == KBM_MAX_LAYER_DEPTH) {
+			fprintf(stderr, "warning: more than "
+			        KBM_STR(KBM_MAX_LAYER_DEPTH)
+			        " layers pushed\n");
+			return;
+		}
+		layer_stack[layer_depth++] = layer;
+		break;
+	case LAYER_POP:
+		if (layer_depth)
+			layer_depth--;
+		break;
+	case LAYER_SET:
+		layer_stack[0] = layer;
+		layer_depth = 1;
+		break;
+	}
+	to = ACTIVE_LAYER;
+	if (from == to || !layer_start || !kbm_info.keys_active
+	    || !kbm_info.keys_toggled)
+		return;
+
+	diff_grabs(layer_grabs + layer_start[from],
+	           layer_start[from + 1] - layer_start[from],
+	           layer_grabs + layer_start[to],
+	           layer_start[to + 1] - layer_start[to]);
+	xcb_flush(conn);
+}
+
+/* grab_entry: grab or ungrab the key or button of grab set entry e */
+static void grab_entry(uint32_t e, int grab)
+{
+	uint16_t mods, mask, events;
+	uint8_t code;
+	size_t i;
+
+	mods = e & 0xFFFF;
+	code = e >> 16 & 0xFF;
+	events = XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE;
+	mask = mods;
+	for (i = 0; i <= NUM_LOCK_MASKS; ++i) {
+		if (!(e >> 16 & GRAB_BUTTON) && grab)
+			xcb_grab_key(conn, 1, root, mask, code,
+			             XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+		else if (!(e >> 16 & GRAB_BUTTON))
+			xcb_ungrab_key(conn, code, root, mask);
+		else if (grab)
+			xcb_grab_button(conn, 1, root, events,
+			                XCB_GRAB_MODE_ASYNC,
+			                XCB_GRAB_MODE_ASYNC, XCB_NONE,
+			                XCB_NONE, code, mask);
+		else
+			xcb_ungrab_button(conn, code, root, mask);
+
+		/* AnyModifier already covers the lock modifiers */
+		if (mods == XCB_MOD_MASK_ANY || i == NUM_LOCK_MASKS)
+			break;
+		mask = mods | lock_masks[i];
+	}
+}
+
+/*
+ * diff_grabs:
+ * Change the grabs of sorted set a, of na entries, into those of b, of nb,
+ * touching only the keys and buttons whose grabs differ. Releasing an
+ * AnyModifier grab releases all of a key's grabs, so a key changed with
+ * one on either side is released whole and the grabs of b made again.
+ */
+static void diff_grabs(const uint32_t *a, size_t na,
+                       const uint32_t *b, size_t nb)
+{
+	size_t i, j, ie, je;
+	uint32_t code;
+
+	i = j = 0;
+	while (i < na || j < nb) {
+		/* the grabs of the next key or button in either set */
+		if (j == nb || (i < na && a[i] >> 16 <= b[j] >> 16))
+			code = a[i] >> 16;
+		else
+			code = b[j] >> 16;
+		for (ie = i; ie < na && a[ie] >> 16 == code; ++ie)
+			;
+		for (je = j; je < nb && b[je] >> 16 == code; ++je)
+			;
+
+		if (ie - i == je - j
+		    && memcmp(a + i, b + j, (ie - i) * sizeof *a) == 0) {
+			i = ie;
+			j = je;
+			continue;
+		}
+		if ((ie > i && (a[ie - 1] & 0xFFFF) == XCB_MOD_MASK_ANY)
+		    || (je > j && (b[je - 1] & 0xFFFF) == XCB_MOD_MASK_ANY)) {
+			if (ie > i)
+				grab_entry(code << 16 | XCB_MOD_MASK_ANY, 0);
+			for (; j < je; ++j)
+				grab_entry(b[j], 1);
+			i = ie;
+			continue;
+		}
+		while (i < ie || j < je) {
+			if (j == je || (i < ie && a[i] < b[j])) {
+				grab_entry(a[i++], 0);
+			} else if (i == ie || b[j] < a[i]) {
+				grab_entry(b[j++], 1);
+			} else {
+				i++;
+				j++;
+			}
+		}
+	}
+}
+
+/* save_profile: store the tables in use into profile p */
+static void save_profile(struct profile *p)
+{
+	p->actions = actions;
+	p->toggles = toggles;
+	p->dispatch = dispatch;
+	p->dispatch_mask = dispatch_mask;
+	p->nstates = nstates;
+	p->state_slots = state_slots;
+	p->state_start = state_start;
+	p->chords = chords;
+	p->nchords = nchords;
+	p->gestures = gestures;
+	p->nlayers = nlayers;
+	p->layer_grabs = layer_grabs;
+	p->layer_start = layer_start;
+	p->base_grabs = base_grabs;
+	p->nbase_grabs = nbase_grabs;
+	p->toggle_grabs = toggle_grabs;
+	p->ntoggle_grabs = ntoggle_grabs;
+	p->remap_keys = remap_keys;
+	p->nremap_keys = nremap_keys;
+}
+
+/* use_profile: make the tables of profile p those in use */
+static void use_profile(const struct profile *p)
+{
+	kbm_info.map = p->map;
+	actions = p->actions;
+	toggles = p->toggles;
+	dispatch = p->dispatch;
+	dispatch_mask = p->dispatch_mask;
+	nstates = p->nstates;
+	state_slots = p->state_slots;
+	state_start = p->state_start;
+	chords = p->chords;
+	nchords = p->nchords;
+	gestures = p->gestures;
+	nlayers = p->nlayers;
+	layer_grabs = p->layer_grabs;
+	layer_start = p->layer_start;
+	base_grabs = p->base_grabs;
+	nbase_grabs = p->nbase_grabs;
+	toggle_grabs = p->toggle_grabs;
+	ntoggle_grabs = p->ntoggle_grabs;
+	remap_keys = p->remap_keys;
+	nremap_keys = p->nremap_keys;
+}
+
+/* next_profile: switch to the next profile on SIGUSR2 */
+static void next_profile(int sig)
+{
+	KBM_UNUSED(sig);
+	switch_profile(-1);
+}
+
+/*
+ * load_profiles:
+ * Load each of the n keymaps in maps, named by names, into a profile,
+ * and use the first. Only the profile in use is grabbed.
+ */
+void load_profiles(struct keymap *maps, const char **names, size_t n)
+{
+	static const struct profile empty;
+	size_t i;
+
+	if (!n)
+		return;
+
+	profiles = calloc(n, sizeof *profiles);
+	nprofiles = n;
+	for (i = 0; i < n; ++i) {
+		profiles[i].name = names[i];
+		profiles[i].map = maps[i];
+	}
+
+	/* the tables of each profile are built in turn from none */
+	for (i = 1; i < n; ++i) {
+		use_profile(&profiles[i]);
+		split_keys(maps[i].keys);
+		build_dispatch();
+		save_profile(&profiles[i]);
+		use_profile(&empty);
+	}
+	curr_profile = 0;
+	kbm_info.map = maps[0];
+	kbm_info.curr_file = names[0];
+	load_keys(maps[0].keys);
+	loop_signal(SIGUSR2, next_profile);
+}
+
+/*
+ * switch_profile:
+ * Use profile i, or the one after the profile in use if i is negative.
+ * Anything pending belongs to the profile left, and is dropped, along
+ * with its active layer. Keys already held keep their bindings until
+ * released, as those stay loaded. The grabs of the two profiles are
+ * compared and only those which differ are changed.
+ */
+void switch_profile(int i)
+{
+	struct profile *from, *to;
+	const uint32_t *a, *b;
+	size_t na, nb;
+	int mapped;
+
+	if (nprofiles < 2)
+		return;
+	if (i < 0)
+		i = (curr_profile + 1) % nprofiles;
+	if ((size_t)i >= nprofiles) {
+		fprintf(stderr, "warning: no profile %d\n", i + 1);
+		return;
+	}
+	if ((size_t)i == curr_profile)
+		return;
+
+	from = &profiles[curr_profile];
+	to = &profiles[i];
+	mapped = kbm_info.keys_active;
+
+	end_sequence();
+	reset_chords();
+	reset_dual();
+	reset_gestures();
+	if (mapped && kbm_info.keys_toggled)
+		grab_layer(ACTIVE_LAYER, 0);
+	layer_depth = 0;
+	while (nremaps)
+		undo_remap(remaps);
+
+	save_profile(from);
+	use_profile(to);
+	curr_profile = i;
+	kbm_info.curr_file = to->name;
+
+	if (mapped) {
+		if (kbm_info.keys_toggled) {
+			a = from->base_grabs;
+			na = from->nbase_grabs;
+			b = to->base_grabs;
+			nb = to->nbase_grabs;
+		} else {
+			a = from->toggle_grabs;
+			na = from->ntoggle_grabs;
+			b = to->toggle_grabs;
+			nb = to->ntoggle_grabs;
+		}
+		diff_grabs(a, na, b, nb);
+		if (kbm_info.keys_toggled)
+			apply_remaps();
+		xcb_flush(conn);
+	}
+	PRINT_DEBUG("switched to profile %s\n", to->name);
+	if (kbm_info.notifications)
+		send_notification(to->name);
+}
+
+/* free_profiles: free the tables of every profile not in use */
+static void free_profiles(void)
+{
+	static const struct profile empty;
+	size_t i;
+
+	if (!nprofiles)
+		return;
+	for (i = 0; i < nprofiles; ++i) {
+		if (i == curr_profile)
+			continue;
+		use_profile(&profiles[i]);
+		free_keys(actions);
+		free_keys(toggles);
+		actions = toggles = NULL;
+		build_dispatch();
+	}
+	use_profile(&empty);
+	free(profiles);
+	profiles = NULL;
+	nprofiles = 0;
+}
+
+/* find_entry: return the entry of code and modifiers mask in state */
+static struct dispatch_entry *find_entry(uint16_t state, uint32_t code,
+                                         uint32_t mask)
+{
+	struct dispatch_entry *ent;
+	size_t slot;
+
+	if (!dispatch)
+		return NULL;
+
+	slot = dispatch_hash(state, code, mask);
+	while (ENTRY_USED(ent = &dispatch[slot])) {
+		if (ent->state == state && ent->code == code
+		    && ent->mask == mask)
+			return ent;
+		slot = (slot + 1) & dispatch_mask;
+	}
+	return NULL;
+}
+
+/*
+ * match_entry:
+ * Return the entry of code under the modifiers in mask in state.
+ * Bindings to the right-hand sides of the held modifiers are preferred
+ * over those matching either side of them. Wildcards also match when
+ * modifiers kbm does not bind, such as Mod5, are held.
+ */
+static struct dispatch_entry *match_entry(uint16_t state, uint32_t code,
+                                          uint32_t mask)
+{
+	struct dispatch_entry *ent;
+	uint32_t sides, sub, known;
+
+	sides = X11_RIGHT(right_mods & mask);
+	for (sub = sides; sub; sub = (sub - 1) & sides) {
+		if ((ent = find_entry(state, code, mask | sub)))
+			return ent;
+	}
+	if ((ent = find_entry(state, code, mask)))
+		return ent;
+
+	known = INJECT_MODS | XCB_MOD_MASK_2;
+	if (mask & ~known && (ent = match_entry(state, code, mask & known))
+	    && ent->hk && ent->hk->key_flags & KBM_WILDCARD)
+		return ent;
+	return NULL;
+}
+
+/* match_root: return the entry at rest of code under mask */
+static struct dispatch_entry *match_root(uint32_t code, uint32_t mask)
+{
+	struct dispatch_entry *ent;
+
+	if (layer_depth && (ent = match_entry(ACTIVE_LAYER, code, mask)))
+		return ent;
+	return match_entry(0, code, mask);
+}
+
+/* match_hotkey: return the binding at rest of code under mask */
+static struct hotkey *match_hotkey(uint32_t code, uint32_t mask)
+{
+	struct dispatch_entry *ent;
+
+	ent = match_root(code, mask);
+	return ent ? ent->hk : NULL;
+}
+
+/* grab_state: grab or ungrab the keys continuing the sequences at state */
+static void grab_state(uint16_t state, int grab)
+{
+	const struct dispatch_entry *ent;
+	xcb_keycode_t kc;
+	size_t i;
+
+	for (i = state_start[state]; i < state_start[state + 1]; ++i) {
+		ent = &dispatch[state_slots[i]];
+
+		/*
+		 * Keys bound at rest or in the active layer, including by
+		 * wildcard bindings, are grabbed already and stay grabbed.
+		 */
+		if (match_root(ent->code, ent->mask)
+		    || !(kc = get_keycode(ent->code)))
+			continue;
+
+		grab_keycode(kc, X11_MODS(ent->mask), grab);
+	}
+}
+
+/* seq_expire: abandon a sequence whose next key did not come in time */
+static void seq_expire(struct timer *t)
+{
+	KBM_UNUSED(t);
+	PRINT_DEBUG("key sequence timed out\n");
+	end_sequence();
+}
+
+static struct timer seq_timer = { 0, 0, TIMER_IDLE, seq_expire, NULL };
+
+/*
+ * enter_state:
+ * Wait for the next key of the sequences at state, grabbing the keys
+ * which continue them in place of those of the previous state.
+ */
+static void enter_state(uint16_t state)
+{
+	uint64_t ms;
+
+	if (seq_state)
+		grab_state(seq_state, 0);
+	grab_state(state, 1);
+	seq_state = state;
+
+	ms = kbm_info.map.seq_timeout ? kbm_info.map.seq_timeout
+	                              : KBM_SEQ_TIMEOUT;
+	timer_start(&seq_timer, loop_now() + ms * 1000000);
+}
+
+/* end_sequence: return to the bindings at rest */
+static void end_sequence(void)
+{
+	if (!seq_state)
+		return;
+
+	grab_state(seq_state, 0);
+	seq_state = 0;
+	timer_stop(&seq_timer);
+}
+
+/*
+ * sequence_key:
+ * Process a key pressed after a sequence prefix. Return 1 if the key
+ * continued a sequence, or 0 if it ended it and is to be looked up
+ * among the bindings at rest.
+ */
+static int sequence_key(const xcb_key_press_event_t *evt, xcb_keysym_t ks)
+{
+	struct dispatch_entry *ent;
+
+	if (!(ent = match_entry(seq_state, ks, evt->state))
+	    && !(ent = match_entry(seq_state, X11_KEYCODE(evt->detail),
+	                           evt->state))) {
+		end_sequence();
+		return 0;
+	}
+	if (ent->next) {
+		enter_state(ent->next);
+		return 1;
+	}
+
+	end_sequence();
+	seq_down[evt->detail] = ent->hk;
+	if (process_hotkey(ent->hk, KBM_PRESS) == -1)
+		running = 0;
+	return 1;
+}
+
+/* chord_has: check if chord hk contains the pressed key p */
+static int chord_has(const struct hotkey *hk, const struct chord_key *p)
+{
+	const struct seq_key *k;
+	size_t i;
+
+	if ((hk->os_code == p->ks || hk->os_code == X11_KEYCODE(p->kc))
+	    && X11_MODS(hk->os_modmask) == p->mods)
+		return 1;
+
+	for (i = 0; i < hk->seq->len; ++i) {
+		k = &hk->seq->keys[i];
+		if ((k->os_code == p->ks || k->os_code == X11_KEYCODE(p->kc))
+		    && X11_MODS(k->os_modmask) == p->mods)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * match_chord:
+ * Return the first chord formed by exactly the held back keys, if any.
+ * Set more if a chord of further keys could still be completed.
+ */
+static struct hotkey *match_chord(int *more)
+{
+	struct hotkey *hk;
+	size_t i, j;
+
+	hk = NULL;
+	*more = 0;
+	for (i = 0; i < nchords; ++i) {
+		for (j = 0; j < npend; ++j) {
+			if (!chord_has(chords[i], &chord_pend[j]))
+				break;
+		}
+		if (j < npend)
+			continue;
+		if ((size_t)chords[i]->seq->len + 1 > npend)
+			*more = 1;
+		else if (!hk)
+			hk = chords[i];
+	}
+	return hk;
+}
+
+/* chord_expire: settle the held back keys at the end of the window */
+static void chord_expire(struct timer *t);
+
+static struct timer chord_timer = { 0, 0, TIMER_IDLE, chord_expire, NULL };
+
+/* hold_key: hold back the key pressed in evt, grabbed under mods */
+static void hold_key(const xcb_key_press_event_t *evt, xcb_keysym_t ks,
+                     uint16_t mods)
+{
+	struct dispatch_entry *ent;
+	struct chord_key *p;
+	uint64_t ms;
+
+	p = &chord_pend[npend++];
+	p->kc = evt->detail;
+	p->ks = ks;
+	p->mods = mods;
+	if (!(ent = match_root(ks, evt->state)))
+		ent = match_root(X11_KEYCODE(evt->detail), evt->state);
+	p->own = ent && !ent->next ? ent->hk : NULL;
+	KC_SET(chord_held, p->kc);
+
+	if (npend == 1) {
+		ms = kbm_info.map.chord_window ? kbm_info.map.chord_window
+		                               : KBM_CHORD_WINDOW;
+		timer_start(&chord_timer, loop_now() + ms * 1000000);
+	}
+}
+
+/* fire_chord: run chord hk, formed by the held back keys */
+static void fire_chord(struct hotkey *hk)
+{
+	size_t i;
+
+	/* a chord still held from before is let go */
+	if (chord_nheld) {
+		memset(chord_down, 0, sizeof chord_down);
+		chord_nheld = 0;
+		process_hotkey(chord_fired, KBM_RELEASE);
+	}
+
+	for (i = 0; i < npend; ++i) {
+		KC_CLEAR(chord_held, chord_pend[i].kc);
+		KC_SET(chord_down, chord_pend[i].kc);
+	}
+	chord_fired = hk;
+	chord_nheld = npend;
+	npend = 0;
+	timer_stop(&chord_timer);
+
+	if (process_hotkey(hk, KBM_PRESS) == -1)
+		running = 0;
+}
+
+/*
+ * flush_chord:
+ * Replay the held back keys in the order they were pressed. A key still
+ * held keeps the keyboard grabbed, so the whole replay is sent with the
+ * grab lifted. Replayed keys are ungrabbed until released, letting their
+ * repeats and releases be sent on like any other forwarded key's.
+ */
+static void flush_chord(void)
+{
+	struct chord_key *p;
+	size_t i;
+
+	timer_stop(&chord_timer);
+	lift_grab();
+	for (i = 0; i < npend; ++i) {
+		p = &chord_pend[i];
+		KC_CLEAR(chord_held, p->kc);
+		if (p->own) {
+			if (process_hotkey(p->own, KBM_PRESS) == -1)
+				running = 0;
+			continue;
+		}
+
+		grab_keycode(p->kc, p->mods, 0);
+		forward_press(p->kc);
+		KC_SET(chord_replayed, p->kc);
+		replay_mods[p->kc] = p->mods;
+	}
+	restore_grab();
+	npend = 0;
+}
+
+static void chord_expire(struct timer *t)
+{
+	struct hotkey *hk;
+	int more;
+
+	KBM_UNUSED(t);
+	if ((hk = match_chord(&more)))
+		fire_chord(hk);
+	else
+		flush_chord();
+}
+
+/*
+ * chord_key:
+ * Process a key press which may be part of a chord. Return 1 if the key
+ * was held back or is part of a chord already settled, or 0 if it is to
+ * be dispatched normally.
+ */
+static int chord_key(const xcb_key_press_event_t *evt, xcb_keysym_t ks)
+{
+	struct dispatch_entry *ent;
+	struct hotkey *hk;
+	uint16_t mods;
+	int more;
+
+	/* repeats of keys already taken */
+	if (KC_TEST(chord_held, evt->detail)
+	    || KC_TEST(chord_down, evt->detail))
+		return 1;
+	if (KC_TEST(chord_replayed, evt->detail)) {
+		forward_press(evt->detail);
+		return 1;
+	}
+
+	if (!(ent = find_entry(CHORD_STATE, ks, evt->state))
+	    && !(ent = find_entry(CHORD_STATE, X11_KEYCODE(evt->detail),
+	                          evt->state))) {
+		if (npend)
+			flush_chord();
+		return 0;
+	}
+	/* the key is ungrabbed when replayed as it was grabbed */
+	mods = X11_MODS(ent->mask) & 0xFF & ~XCB_MOD_MASK_LOCK;
+	if (npend == KBM_MAX_CHORD)
+		flush_chord();
+
+	hold_key(evt, ks, mods);
+	hk = match_chord(&more);
+	if (!hk && !more) {
+		/* the key starts over after the keys before it */
+		KC_CLEAR(chord_held, evt->detail);
+		npend--;
+		flush_chord();
+		hold_key(evt, ks, mods);
+	} else if (hk && !more) {
+		fire_chord(hk);
+	}
+	return 1;
+}
+
+/*
+ * chord_release:
+ * Process the release of a key which may be part of a chord. Return 1
+ * if the release was consumed.
+ */
+static int chord_release(const xcb_key_press_event_t *evt)
+{
+	struct hotkey *hk;
+	int more;
+
+	/* letting go of a held back key settles the chord early */
+	if (KC_TEST(chord_held, evt->detail)) {
+		if ((hk = match_chord(&more)))
+			fire_chord(hk);
+		else
+			flush_chord();
+	}
+
+	if (KC_TEST(chord_replayed, evt->detail)) {
+		KC_CLEAR(chord_replayed, evt->detail);
+		forward_release(evt->detail);
+		grab_keycode(evt->detail, replay_mods[evt->detail], 1);
+		return 1;
+	}
+	if (KC_TEST(chord_down, evt->detail)) {
+		KC_CLEAR(chord_down, evt->detail);
+		if (!--chord_nheld
+		    && process_hotkey(chord_fired, KBM_RELEASE) == -1)
+			running = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* reset_chords: let go of all keys taken by chords */
+static void reset_chords(void)
+{
+	unsigned int kc;
+
+	timer_stop(&chord_timer);
+	npend = 0;
+	memset(chord_held, 0, sizeof chord_held);
+	for (kc = 0; kc < 256; ++kc) {
+		if (!KC_TEST(chord_replayed, kc))
+			continue;
+		forward_release(kc);
+		grab_keycode(kc, replay_mods[kc], 1);
+	}
+	memset(chord_replayed, 0, sizeof chord_replayed);
+
+	if (chord_nheld) {
+		memset(chord_down, 0, sizeof chord_down);
+		chord_nheld = 0;
+		process_hotkey(chord_fired, KBM_RELEASE);
+	}
+}
 
-	actions = toggles = NULL;
+/* dual_expire: make the pending tap and hold key held */
+static void dual_expire(struct timer *t);
 
-	if (kbm_info.notifications)
-		notify_init(PROGRAM_NAME);
+static struct timer dual_timer = { 0, 0, TIMER_IDLE, dual_expire, NULL };
 
-	return 0;
+/* dual_press: start waiting to tell whether key hk is tapped or held */
+static void dual_press(struct hotkey *hk, const xcb_key_press_event_t *evt)
+{
+	if (dual_pending)
+		dual_hold();
+
+	dual_pending = hk;
+	dual_kc = evt->detail;
+	dual_time = evt->time;
+	timer_start(&dual_timer, loop_now() + (uint64_t)hk->hold_ms * 1000000);
 }
 
-/* close_display: disconnect from X server and clean up */
-void close_display(void)
+/*
+ * dual_hold:
+ * Run the held operations of the pending tap and hold key. Return the
+ * modifiers it holds down, if it is held as a modifier.
+ */
+static uint32_t dual_hold(void)
 {
-	xcb_key_symbols_free(keysyms);
-	xcb_disconnect(conn);
+	struct hotkey *hold;
+	uint32_t mods;
+
+	hold = dual_pending->hold;
+	dual_pending = NULL;
+	timer_stop(&dual_timer);
+	dual_held[dual_kc] = hold;
+	dual_nheld++;
+	lift_grab();
+	if (process_hotkey(hold, KBM_PRESS) == -1)
+		running = 0;
+	restore_grab();
+
+	mods = 0;
+	if (hold->nops == 1 && hold->ops[0].op == OP_KEY)
+		mods = OSMASK((hold->ops[0].args >> 32) & 0xFFFFFFFF);
+	return X11_MODS(mods);
+}
 
-	if (kbm_info.notifications)
-		notify_uninit();
+static void dual_expire(struct timer *t)
+{
+	KBM_UNUSED(t);
+	dual_hold();
 }
 
 /*
- * A key press event that occurs at the same time as a previous
- * key release with the same key is an automatically repeated key.
+ * dual_release:
+ * Process the release of a tap and hold key. Return 1 if the key was one.
+ * The release time is checked against the hold time as well, in case it
+ * arrived before the timer could run.
  */
-#define DETECT_AUTOREPEAT(last, evt, last_ks, ks) \
-	((last) && ((last)->response_type & ~0x80) == XCB_KEY_RELEASE \
-	 && (last_ks) == (ks) && (last)->time == (evt)->time)
-
-/* start_listening: map all hotkeys and start listening for keypresses */
-void start_listening(void)
+static int dual_release(const xcb_key_press_event_t *evt)
 {
-	xcb_generic_event_t *e;
-	xcb_key_press_event_t *evt, *last;
-	xcb_keysym_t ks, last_ks;
 	struct hotkey *hk;
-	unsigned int running = 1;
 
-	last = NULL;
-	while (running && (e = xcb_wait_for_event(conn))) {
-		switch (e->response_type & ~0x80) {
-		case XCB_KEY_PRESS:
-			evt = (xcb_key_press_event_t *)e;
-			ks = xcb_key_press_lookup_keysym(keysyms, evt, 0);
+	if (dual_pending && evt->detail == dual_kc) {
+		if (evt->time - dual_time < dual_pending->hold_ms) {
+			hk = dual_pending;
+			dual_pending = NULL;
+			timer_stop(&dual_timer);
+			lift_grab();
+			if (process_hotkey(hk, KBM_PRESS) == -1
+			    || process_hotkey(hk, KBM_RELEASE) == -1)
+				running = 0;
+			restore_grab();
+			return 1;
+		}
+		dual_hold();
+	}
+	if ((hk = dual_held[evt->detail])) {
+		dual_held[evt->detail] = NULL;
+		dual_nheld--;
+		lift_grab();
+		process_hotkey(hk, KBM_RELEASE);
+		restore_grab();
+		return 1;
+	}
+	return 0;
+}
 
-			/*
-			 * If the key is not a numpad key, unset the Num Lock
-			 * bit as it is irrelevant. If it is a numpad key, the
-			 * Num Lock bit differentiates between the key's two
-			 * functions.
-			 */
-			if (!isnummod(ks))
-				evt->state &= ~XCB_MOD_MASK_2;
-			/* unset the caps lock bit for every key */
-			evt->state &= ~XCB_MOD_MASK_LOCK;
+/* reset_dual: forget the pending key and let go of held ones */
+static void reset_dual(void)
+{
+	unsigned int kc;
+
+	dual_pending = NULL;
+	timer_stop(&dual_timer);
+	lift_grab();
+	for (kc = 0; kc < 256; ++kc) {
+		if (dual_held[kc]) {
+			process_hotkey(dual_held[kc], KBM_RELEASE);
+			dual_held[kc] = NULL;
+		}
+	}
+	dual_nheld = 0;
+	restore_grab();
+}
 
-			if (!(hk = find_by_os_code(actions, ks, evt->state))
-			    && !(hk = find_by_os_code(toggles, ks, evt->state))) {
-				/*
-				 * This sometimes happens when keys are
-				 * pressed in quick succession.
-				 * The event should be sent back out.
-				 */
-				break;
-			}
+static void gesture_expire(struct timer *t);
 
-			/* don't send an autorepeated key if norepeat flag */
-			if (DETECT_AUTOREPEAT(last, evt, last_ks, ks) &&
-			    (hk->key_flags & KBM_NOREPEAT))
-				break;
+/* gesture_init: prepare the timers of the gesture slots */
+static void gesture_init(void)
+{
+	size_t kc;
 
-			if (process_hotkey(hk, KBM_PRESS) == -1)
-				running = 0;
-			break;
-		case XCB_KEY_RELEASE:
-			evt = (xcb_key_press_event_t *)e;
-			ks = xcb_key_press_lookup_keysym(keysyms, evt, 0);
+	for (kc = 0; kc < 256; ++kc)
+		timer_init(&gest_slots[kc].timer, gesture_expire,
+		           &gest_slots[kc]);
+}
+
+/* gesture_run: press and release binding hk, if there is one */
+static void gesture_run(struct hotkey *hk)
+{
+	if (hk && (process_hotkey(hk, KBM_PRESS) == -1
+	           || process_hotkey(hk, KBM_RELEASE) == -1))
+		running = 0;
+}
 
-			if (!isnummod(ks))
-				evt->state &= ~XCB_MOD_MASK_2;
-			evt->state &= ~XCB_MOD_MASK_LOCK;
+/* gesture_tap: run the tap binding of the key of slot s */
+static void gesture_tap(struct gesture_slot *s)
+{
+	timer_stop(&s->timer);
+	if (s->state == GEST_WAIT)
+		gest_wait = 0;
+	s->state = GEST_IDLE;
+	gesture_run(s->g->tap);
+}
 
-			if (!(hk = find_by_os_code(actions, ks, evt->state))
-			    && !(hk = find_by_os_code(toggles, ks, evt->state)))
-				break;
+/* gesture_hold: run binding hk of the key of slot s until it is released */
+static void gesture_hold(struct gesture_slot *s, struct hotkey *hk)
+{
+	timer_stop(&s->timer);
+	if (s->state == GEST_WAIT)
+		gest_wait = 0;
+	s->state = GEST_HELD;
+	s->held = hk;
+	if (process_hotkey(hk, KBM_PRESS) == -1)
+		running = 0;
+}
 
-			process_hotkey(hk, KBM_RELEASE);
-			break;
-		default:
-			continue;
+/*
+ * gesture_press:
+ * Process a press of a key with gesture bindings g. A second press
+ * while waiting for one is a double tap, and a first press starts timing
+ * a long press. Autorepeat only reaches a binding run while held.
+ */
+static void gesture_press(struct gesture *g, const xcb_key_press_event_t *evt)
+{
+	struct gesture_slot *s;
+
+	s = &gest_slots[evt->detail];
+	switch (s->state) {
+	case GEST_HELD:
+		if (!(s->held->key_flags & KBM_NOREPEAT)
+		    && process_hotkey(s->held, KBM_AUTOREPEAT) == -1)
+			running = 0;
+		return;
+	case GEST_DOWN:
+		return;
+	case GEST_WAIT:
+		if (s->g == g) {
+			gesture_hold(s, g->dbl);
+			return;
 		}
-		free(last);
-		last = evt;
-		last_ks = ks;
+		/* pressed with other modifiers, the key starts anew */
+		gesture_tap(s);
+		break;
 	}
-	free(e);
+
+	s->g = g;
+	s->down = evt->time;
+	s->state = GEST_DOWN;
+	if (g->lng)
+		timer_start(&s->timer,
+		            loop_now() + (uint64_t)g->lng->hold_ms * 1000000);
 }
 
-/* send_button: send a button event */
-void send_button(unsigned int button)
+/* gesture_expire: make a pressed key a long press, or a tapped one a tap */
+static void gesture_expire(struct timer *t)
 {
-	xcb_test_fake_input(conn, XCB_BUTTON_PRESS, button,
-	                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-	xcb_test_fake_input(conn, XCB_BUTTON_RELEASE, button,
-	                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-	xcb_flush(conn);
+	struct gesture_slot *s;
+
+	s = t->data;
+	if (s->state == GEST_DOWN)
+		gesture_hold(s, s->g->lng);
+	else if (s->state == GEST_WAIT)
+		gesture_tap(s);
 }
 
-/* send_key: send a key event */
-void send_key(unsigned int keycode, unsigned int modmask, unsigned int type)
+/*
+ * gesture_release:
+ * Process the release of a key with gesture bindings. Return 1 if the key
+ * is one. As with tap and hold keys, the release time is checked against
+ * the long press time in case the timer has not run yet.
+ */
+static int gesture_release(const xcb_key_press_event_t *evt)
 {
-	xcb_keycode_t *kc, *mod;
+	struct gesture_slot *s;
+	struct hotkey *hk;
 
-	kc = xcb_key_symbols_get_keycode(keysyms, keycode);
-	mod = NULL;
-	if (type == KBM_PRESS) {
-		/* press all required modifier keys */
-		if (modmask & XCB_MOD_MASK_SHIFT) {
-			mod = xcb_key_symbols_get_keycode(keysyms, XK_Shift_L);
-			xcb_test_fake_input(conn, XCB_KEY_PRESS, mod[0],
-			                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-		}
-		if (modmask & XCB_MOD_MASK_CONTROL) {
-			mod = xcb_key_symbols_get_keycode(keysyms, XK_Control_L);
-			xcb_test_fake_input(conn, XCB_KEY_PRESS, mod[0],
-			                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-		}
-		if (modmask & XCB_MOD_MASK_4) {
-			mod = xcb_key_symbols_get_keycode(keysyms, XK_Super_L);
-			xcb_test_fake_input(conn, XCB_KEY_PRESS, mod[0],
-			                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-		}
-		if (modmask & XCB_MOD_MASK_1) {
-			mod = xcb_key_symbols_get_keycode(keysyms, XK_Alt_L);
-			xcb_test_fake_input(conn, XCB_KEY_PRESS, mod[0],
-			                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-		}
-		/* press the requested key */
-		xcb_test_fake_input(conn, XCB_KEY_PRESS, kc[0],
-		                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-	} else {
-		/* release the requested keys and then all modifiers */
-		xcb_test_fake_input(conn, XCB_KEY_RELEASE, kc[0],
-		                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-		if (modmask & XCB_MOD_MASK_SHIFT) {
-			mod = xcb_key_symbols_get_keycode(keysyms, XK_Shift_L);
-			xcb_test_fake_input(conn, XCB_KEY_RELEASE, mod[0],
-			                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-		}
-		if (modmask & XCB_MOD_MASK_CONTROL) {
-			mod = xcb_key_symbols_get_keycode(keysyms, XK_Control_L);
-			xcb_test_fake_input(conn, XCB_KEY_RELEASE, mod[0],
-			                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+	s = &gest_slots[evt->detail];
+	switch (s->state) {
+	case GEST_DOWN:
+		timer_stop(&s->timer);
+		if (s->g->lng && evt->time - s->down >= s->g->lng->hold_ms) {
+			s->state = GEST_IDLE;
+			gesture_run(s->g->lng);
+		} else if (s->g->dbl) {
+			s->state = GEST_WAIT;
+			gest_wait = evt->detail;
+			timer_start(&s->timer, loop_now()
+			            + (uint64_t)KBM_DOUBLE_TIME * 1000000);
+		} else {
+			gesture_tap(s);
 		}
-		if (modmask & XCB_MOD_MASK_4) {
-			mod = xcb_key_symbols_get_keycode(keysyms, XK_Super_L);
-			xcb_test_fake_input(conn, XCB_KEY_RELEASE, mod[0],
-			                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-		}
-		if (modmask & XCB_MOD_MASK_1) {
-			mod = xcb_key_symbols_get_keycode(keysyms, XK_Alt_L);
-			xcb_test_fake_input(conn, XCB_KEY_RELEASE, mod[0],
-			                    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
-		}
-		xcb_flush(conn);
+		return 1;
+	case GEST_HELD:
+		hk = s->held;
+		s->state = GEST_IDLE;
+		process_hotkey(hk, KBM_RELEASE);
+		return 1;
+	default:
+		return 0;
 	}
-	free(kc);
-	if (mod)
-		free(mod);
 }
 
-/* move_cursor: move cursor along vector x,y from current position */
-void move_cursor(int x, int y)
+/* reset_gestures: stop timing keys and let go of held bindings */
+static void reset_gestures(void)
 {
-	xcb_warp_pointer(conn, XCB_NONE, XCB_NONE, 0, 0, 0, 0, x, y);
-	xcb_flush(conn);
+	struct gesture_slot *s;
+
+	for (s = gest_slots; s < gest_slots + 256; ++s) {
+		timer_stop(&s->timer);
+		if (s->state == GEST_HELD)
+			process_hotkey(s->held, KBM_RELEASE);
+		s->state = GEST_IDLE;
+	}
+	gest_wait = 0;
 }
 
-/* map_keys: grab all provided hotkeys */
-static void map_keys(struct hotkey *head, int set_state)
+/*
+ * lift_grab:
+ * End kbm's grab of the keyboard, so that the key events it sends reach
+ * the focused window. Each call is paired with one of restore_grab.
+ */
+static void lift_grab(void)
 {
-	xcb_keycode_t *kc;
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
+	if (grab_lifted++)
+		return;
 
-	if (!head)
+	xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+	kbd_grabbed = 0;
+}
+
+/* restore_grab: grab the keyboard again if any key is still held */
+static void restore_grab(void)
+{
+	xcb_grab_keyboard_cookie_t cookie;
+
+	if (--grab_lifted || !nkeys_down)
 		return;
 
-	if (set_state && head->op != OP_TOGGLE)
-		kbm_info.keys_toggled = 1;
+	cookie = xcb_grab_keyboard(conn, 1, root, XCB_CURRENT_TIME,
+	                           XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+	xcb_discard_reply(conn, cookie.sequence);
+	kbd_grabbed = 1;
+}
 
-	for (; head; head = head->next) {
-		kc = xcb_key_symbols_get_keycode(keysyms, head->os_code);
-		cookie = xcb_grab_key_checked(conn, 1, root,
-		                              head->os_modmask, kc[0],
-		                              XCB_GRAB_MODE_ASYNC,
-		                              XCB_GRAB_MODE_ASYNC);
-
-		/* key grab will fail if the key is already grabbed */
-		if ((err = xcb_request_check(conn, cookie))) {
-			fprintf(stderr, "error: the key `%s' is already "
-			        "mapped by another program\n",
-			        keystr(head->kbm_code, head->kbm_modmask));
-			free(err);
-		}
+/* forward_press: send on the press of key kc to the focused window */
+static void forward_press(xcb_keycode_t kc)
+{
+	lift_grab();
+	fake_input(XCB_KEY_PRESS, kc);
+	restore_grab();
+	KC_SET(forwarded, kc);
+}
 
-		/*
-		 * In X11, Caps Lock and Num Lock are defined as modifiers and
-		 * events involving these keys held down are treated as
-		 * different events to those occurring without them.
-		 *
-		 * We don't want to distinguish between these events, so we
-		 * also grab the key with the Caps and Num Lock masks.
-		 */
+/* forward_release: send on the release of kc if its press was forwarded */
+static int forward_release(xcb_keycode_t kc)
+{
+	if (!KC_TEST(forwarded, kc))
+		return 0;
 
-		/* num lock */
-		xcb_grab_key(conn, 1, root, head->os_modmask | XCB_MOD_MASK_2,
-		             kc[0], XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
-		/* caps lock */
-		xcb_grab_key(conn, 1, root, head->os_modmask | XCB_MOD_MASK_LOCK,
-		             kc[0], XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
-		/* both */
-		xcb_grab_key(conn, 1, root, head->os_modmask | XCB_MOD_MASK_LOCK
-		             | XCB_MOD_MASK_2, kc[0], XCB_GRAB_MODE_ASYNC,
-		             XCB_GRAB_MODE_ASYNC);
-		free(kc);
-	}
-	xcb_flush(conn);
+	KC_CLEAR(forwarded, kc);
+	lift_grab();
+	fake_input(XCB_KEY_RELEASE, kc);
+	restore_grab();
+	return 1;
 }
 
 /* unmap_keys: ungrab all assigned hotkeys */
 static void unmap_keys(struct hotkey *head, int set_state)
 {
-	xcb_keycode_t *kc;
+	struct hotkey *list;
+	xcb_keycode_t kc;
+	struct remap *rm;
 
 	if (!head)
 		return;
-
-	if (set_state && head->op != OP_TOGGLE)
+	list = head;
+
+	/* a pending sequence, chord or hold may belong to the unmapped keys */
+	end_sequence();
+	reset_chords();
+	reset_dual();
+	reset_gestures();
+	if (set_state && !has_op(head, OP_TOGGLE))
 		kbm_info.keys_toggled = 0;
+	if (!has_op(head, OP_TOGGLE))
+		grab_layer(ACTIVE_LAYER, 0);
 
 	for (; head; head = head->next) {
+		if (head->layer)
+			continue;
+		if ((rm = find_remap(head))) {
+			undo_remap(rm);
+			continue;
+		}
+		if (X11_ISBUTTON(head->os_code)) {
+			ungrab_button(head);
+			continue;
+		}
+		if (head->key_flags & KBM_CHORD) {
+			grab_chord(head, 0);
+			continue;
+		}
 
-		kc = xcb_key_symbols_get_keycode(keysyms, head->os_code);
-		xcb_ungrab_key(conn, kc[0], root, head->os_modmask);
+		if (!(kc = get_keycode(head->os_code)))
+			continue;
+		if (head->key_flags & KBM_WILDCARD) {
+			ungrab_wildcard(head, kc);
+			continue;
+		}
+		xcb_ungrab_key(conn, kc, root, X11_MODS(head->os_modmask));
 
 		/* account for num lock and caps lock modifiers */
-		xcb_ungrab_key(conn, kc[0], root, head->os_modmask
+		xcb_ungrab_key(conn, kc, root, X11_MODS(head->os_modmask)
 		               | XCB_MOD_MASK_2);
-		xcb_ungrab_key(conn, kc[0], root, head->os_modmask
+		xcb_ungrab_key(conn, kc, root, X11_MODS(head->os_modmask)
 		               | XCB_MOD_MASK_LOCK);
-		xcb_ungrab_key(conn, kc[0], root, head->os_modmask
+		xcb_ungrab_key(conn, kc, root, X11_MODS(head->os_modmask)
 		               | XCB_MOD_MASK_2 | XCB_MOD_MASK_LOCK);
 	}
+	restore_grabs(list);
 	xcb_flush(conn);
 }
 
@@ -489,35 +3466,79 @@ void start_listening(void)
 	}
 }
 
+/* button_flags: get the SendInput flags for pressing and releasing button */
+static int button_flags(unsigned int button, DWORD *dnflags, DWORD *upflags)
+{
+	switch (button) {
+	case KBM_BUTTON_LEFT:
+		*dnflags = MOUSEEVENTF_LEFTDOWN;
+		*upflags = MOUSEEVENTF_LEFTUP;
+		return 0;
+	case KBM_BUTTON_MIDDLE:
+		*dnflags = MOUSEEVENTF_MIDDLEDOWN;
+		*upflags = MOUSEEVENTF_MIDDLEUP;
+		return 0;
+	case KBM_BUTTON_RIGHT:
+		*dnflags = MOUSEEVENTF_RIGHTDOWN;
+		*upflags = MOUSEEVENTF_RIGHTUP;
+		return 0;
+	default:
+		return 1;
+	}
+}
+
 /* send_button: send a mouse button press followed by an immediate release */
 void send_button(unsigned int button)
+{
+	INPUT ip[2];
+	DWORD dnflags, upflags;
+
+	if (button_flags(button, &dnflags, &upflags) != 0)
+		return;
+
+	memset(ip, 0, sizeof ip);
+	ip[0].type = ip[1].type = INPUT_MOUSE;
+	ip[0].mi.dwFlags = dnflags;
+	ip[1].mi.dwFlags = upflags;
+	SendInput(2, ip, sizeof *ip);
+}
+
+/* send_button_event: send a press or release of a mouse button */
+void send_button_event(unsigned int button, unsigned int type)
 {
 	INPUT ip;
-	unsigned int dnflags, upflags;
+	DWORD dnflags, upflags;
+
+	if (button_flags(button, &dnflags, &upflags) != 0)
+		return;
 
 	ip.type = INPUT_MOUSE;
 	memset(&ip.mi, 0, sizeof ip.mi);
+	ip.mi.dwFlags = type == KBM_PRESS ? dnflags : upflags;
+	SendInput(1, &ip, sizeof ip);
+}
 
-	switch (button) {
-	case KBM_BUTTON_LEFT:
-		dnflags = MOUSEEVENTF_LEFTDOWN;
-		upflags = MOUSEEVENTF_LEFTUP;
-		break;
-	case KBM_BUTTON_MIDDLE:
-		dnflags = MOUSEEVENTF_MIDDLEDOWN;
-		upflags = MOUSEEVENTF_MIDDLEUP;
-		break;
-	case KBM_BUTTON_RIGHT:
-		dnflags = MOUSEEVENTF_RIGHTDOWN;
-		upflags = MOUSEEVENTF_RIGHTUP;
+/* send_scroll: scroll count notches in direction dir */
+void send_scroll(unsigned int dir, unsigned int count)
+{
+	INPUT ip;
+
+	ip.type = INPUT_MOUSE;
+	memset(&ip.mi, 0, sizeof ip.mi);
+
+	/* all notches are sent in a single wheel event */
+	switch (dir) {
+	case KBM_SCROLL_UP:
+	case KBM_SCROLL_DOWN:
+		ip.mi.dwFlags = MOUSEEVENTF_WHEEL;
 		break;
 	default:
-		return;
+		ip.mi.dwFlags = MOUSEEVENTF_HWHEEL;
+		break;
 	}
-
-	ip.mi.dwFlags = dnflags;
-	SendInput(1, &ip, sizeof ip);
-	ip.mi.dwFlags = upflags;
+	ip.mi.mouseData = count * WHEEL_DELTA;
+	if (dir == KBM_SCROLL_DOWN || dir == KBM_SCROLL_LEFT)
+		ip.mi.mouseData = -ip.mi.mouseData;
 	SendInput(1, &ip, sizeof ip);
 }
 
@@ -568,8 +3589,16 @@ void move_cursor(int x, int y)
 	SetCursorPos(pt.x + x, pt.y + y);
 }
 
+/* drag_cursor: drag with the left button along vector x,y */
+void drag_cursor(int x, int y)
+{
+	send_button_event(KBM_BUTTON_LEFT, KBM_PRESS);
+	move_cursor(x, y);
+	send_button_event(KBM_BUTTON_LEFT, KBM_RELEASE);
+}
+
 /* kbm_exec: execute the specified program */
-void kbm_exec(void *args)
+void kbm_exec(struct exec_cmd *args)
 {
 	char *cmd;
 	char err[256];
@@ -583,7 +3612,7 @@ void kbm_exec(void *args)
 	 * The CreateProcess function can modify the string
 	 * passed to it, so we create a copy of args to use.
 	 */
-	cmd = strdup(args);
+	cmd = strdup(args->cmd);
 	if (!CreateProcess(NULL, cmd, NULL, NULL, FALSE,
 	                   0, NULL, NULL, &si, &pi)) {
 		FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(),
@@ -826,13 +3855,13 @@ static void kill_fake_mods(void)
 
 static void map_keys(struct hotkey *head, int set_state)
 {
-	if (set_state && head->op != OP_TOGGLE)
+	if (set_state && !has_op(head, OP_TOGGLE))
 		kbm_info.keys_toggled = 1;
 }
 
 static void unmap_keys(struct hotkey *head, int set_state)
 {
-	if (set_state && head->op != OP_TOGGLE)
+	if (set_state && !has_op(head, OP_TOGGLE))
 		kbm_info.keys_toggled = 0;
 }
 
@@ -896,6 +3925,7 @@ static void load_hotkey_file(void)
 	if (open_file_dialog(buf, MAX_FILE_PATH) == 0) {
 		f = fopen("errdump.log", "a");
 		free_windows(&kbm_info.map);
+		free_layers(&kbm_info.map);
 		if (parse_file(buf, &kbm_info.map, f) != 0) {
 			snprintf(err, MAX_FILE_PATH, "Could not read key "
 			         "bindings from file %s.\nErrors "
@@ -990,46 +4020,85 @@ void start_listening(void)
 	CFRunLoopRun();
 }
 
+/* button_types: get the event types and button for pressing a button */
+static int button_types(unsigned int button, CGEventType *dtype,
+                        CGEventType *utype, CGMouseButton *mb)
+{
+	switch (button) {
+	case KBM_BUTTON_LEFT:
+		*dtype = kCGEventLeftMouseDown;
+		*utype = kCGEventLeftMouseUp;
+		*mb = kCGMouseButtonLeft;
+		return 0;
+	case KBM_BUTTON_MIDDLE:
+		*dtype = kCGEventOtherMouseDown;
+		*utype = kCGEventOtherMouseUp;
+		*mb = kCGMouseButtonCenter;
+		return 0;
+	case KBM_BUTTON_RIGHT:
+		*dtype = kCGEventRightMouseDown;
+		*utype = kCGEventRightMouseUp;
+		*mb = kCGMouseButtonRight;
+		return 0;
+	default:
+		return 1;
+	}
+}
+
 void send_button(unsigned int button)
 {
-	CGEventRef posevent, downevent, upevent;
+	send_button_event(button, KBM_PRESS);
+	send_button_event(button, KBM_RELEASE);
+}
+
+void send_button_event(unsigned int button, unsigned int type)
+{
+	CGEventRef posevent, event;
 	CGPoint pos;
 	CGEventType dtype, utype;
 	CGMouseButton mb;
 
+	if (button_types(button, &dtype, &utype, &mb) != 0)
+		return;
+
 	/* get the current position of the cursor by making an empty event */
 	posevent = CGEventCreate(NULL);
 	pos = CGEventGetLocation(posevent);
 
-	switch (button) {
-	case KBM_BUTTON_LEFT:
-		dtype = kCGEventLeftMouseDown;
-		utype = kCGEventLeftMouseUp;
-		mb = kCGMouseButtonLeft;
+	event = CGEventCreateMouseEvent(NULL, type == KBM_PRESS
+	                                ? dtype : utype, pos, mb);
+	CGEventPost(kCGHIDEventTap, event);
+
+	CFRelease(posevent);
+	CFRelease(event);
+}
+
+void send_scroll(unsigned int dir, unsigned int count)
+{
+	CGEventRef event;
+	int32_t dy, dx;
+
+	dy = dx = 0;
+	switch (dir) {
+	case KBM_SCROLL_UP:
+		dy = count;
 		break;
-	case KBM_BUTTON_MIDDLE:
-		dtype = kCGEventOtherMouseDown;
-		utype = kCGEventOtherMouseUp;
-		mb = kCGMouseButtonCenter;
+	case KBM_SCROLL_DOWN:
+		dy = -(int32_t)count;
 		break;
-	case KBM_BUTTON_RIGHT:
-		dtype = kCGEventRightMouseDown;
-		utype = kCGEventRightMouseUp;
-		mb = kCGMouseButtonRight;
+	case KBM_SCROLL_LEFT:
+		dx = count;
+		break;
+	case KBM_SCROLL_RIGHT:
+		dx = -(int32_t)count;
 		break;
-	default:
-		return;
 	}
 
-	downevent = CGEventCreateMouseEvent(NULL, dtype, pos, mb);
-	upevent = CGEventCreateMouseEvent(NULL, utype, pos, mb);
-
-	CGEventPost(kCGHIDEventTap, downevent);
-	CGEventPost(kCGHIDEventTap, upevent);
-
-	CFRelease(posevent);
-	CFRelease(downevent);
-	CFRelease(upevent);
+	/* all notches are sent in a single wheel event */
+	event = CGEventCreateScrollWheelEvent(NULL, kCGScrollEventUnitLine,
+	                                      2, dy, dx);
+	CGEventPost(kCGHIDEventTap, event);
+	CFRelease(event);
 }
 
 /* send_key: send a key event */
@@ -1069,15 +4138,43 @@ void move_cursor(int x, int y)
 	CFRelease(moveevent);
 }
 
+void drag_cursor(int x, int y)
+{
+	CGEventRef posevent, event;
+	CGPoint pos;
+
+	posevent = CGEventCreate(NULL);
+	pos = CGEventGetLocation(posevent);
+
+	event = CGEventCreateMouseEvent(NULL, kCGEventLeftMouseDown, pos,
+	                                kCGMouseButtonLeft);
+	CGEventPost(kCGHIDEventTap, event);
+	CFRelease(event);
+
+	pos.x += x;
+	pos.y += y;
+	event = CGEventCreateMouseEvent(NULL, kCGEventLeftMouseDragged, pos,
+	                                kCGMouseButtonLeft);
+	CGEventPost(kCGHIDEventTap, event);
+	CFRelease(event);
+
+	event = CGEventCreateMouseEvent(NULL, kCGEventLeftMouseUp, pos,
+	                                kCGMouseButtonLeft);
+	CGEventPost(kCGHIDEventTap, event);
+	CFRelease(event);
+
+	CFRelease(posevent);
+}
+
 static void map_keys(struct hotkey *head, int set_state)
 {
-	if (set_state && head->op != OP_TOGGLE)
+	if (set_state && !has_op(head, OP_TOGGLE))
 		kbm_info.keys_toggled = 1;
 }
 
 static void unmap_keys(struct hotkey *head, int set_state)
 {
-	if (set_state && head->op != OP_TOGGLE)
+	if (set_state && !has_op(head, OP_TOGGLE))
 		kbm_info.keys_toggled = 0;
 }
 
@@ -1191,13 +4288,16 @@ static void send_notification(const char *msg)
 
 #if defined(__linux__) || defined(__APPLE__)
 /* kbm_exec: execute the specified program */
-void kbm_exec(void *args)
+void kbm_exec(struct exec_cmd *cmd)
 {
+#ifdef __linux__
+	proc_spawn(cmd);
+#endif
+#ifdef __APPLE__
 	char **argv;
 
-	argv = args;
+	argv = cmd->argv;
 
-#ifdef __APPLE__
 	/*
 	 * Try to open the program as an app first.
 	 * If not found, treat it as a regular program.
@@ -1207,7 +4307,6 @@ void kbm_exec(void *args)
 
 	/* jump over the 'open -a' */
 	argv += 2;
-#endif
 
 	switch (fork()) {
 	case -1:
@@ -1220,26 +4319,36 @@ void kbm_exec(void *args)
 	default:
 		break;
 	}
+#endif
 }
 #endif /* __linux__ || __APPLE__ */
 
-/* load_keys: split the keys in list head into actions and toggles */
-void load_keys(struct hotkey *head)
+/* split_keys: split the keys in list head into actions and toggles */
+static void split_keys(struct hotkey *head)
 {
 	struct hotkey *tmp;
 
-	if (!head)
-		return;
-
 	while (head) {
 		tmp = head;
 		head = head->next;
 		tmp->next = NULL;
-		if (tmp->op == OP_TOGGLE)
+		if (has_op(tmp, OP_TOGGLE))
 			add_hotkey(&toggles, tmp);
 		else
 			add_hotkey(&actions, tmp);
 	}
+}
+
+/* load_keys: store the keys in list head as the actions and toggles */
+void load_keys(struct hotkey *head)
+{
+	if (!head)
+		return;
+
+	split_keys(head);
+#ifdef __linux__
+	build_dispatch();
+#endif
 
 	if (kbm_info.keys_active) {
 		if (kbm_info.keys_toggled)
@@ -1250,15 +4359,33 @@ void load_keys(struct hotkey *head)
 
 void unload_keys(void)
 {
-	if (actions) {
+	int active;
+
+#ifdef __linux__
+	/* queued text belongs to the hotkeys */
+	stop_typing();
+#endif
+	/*
+	 * Both lists are unmapped before either is freed, as unmapping one
+	 * restores the grabs of the other, which nothing should be while
+	 * the keys are removed.
+	 */
+	active = kbm_info.keys_active;
+	kbm_info.keys_active = 0;
+	if (actions)
 		unmap_keys(actions, 0);
-		free_keys(actions);
-	}
-	if (toggles) {
+	if (toggles)
 		unmap_keys(toggles, 0);
+	if (actions)
+		free_keys(actions);
+	if (toggles)
 		free_keys(toggles);
-	}
 	actions = toggles = NULL;
+	kbm_info.keys_active = active;
+#ifdef __linux__
+	build_dispatch();
+	free_profiles();
+#endif
 }
 
 void enable_keys(void) {
@@ -1290,6 +4417,7 @@ void toggle_keys(void)
 	}
 }
 
+#ifndef __linux__
 /* find_by_os_code: return the hotkey in head with os_code code */
 static struct hotkey *find_by_os_code(struct hotkey *head,
                                       uint32_t code, uint32_t mask)
@@ -1300,3 +4428,4 @@ static struct hotkey *find_by_os_code(struct hotkey *head,
 	}
 	return NULL;
 }
+#endif
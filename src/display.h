@@ -25,7 +25,11 @@
 enum {
 	KBM_BUTTON_LEFT         = 1,
 	KBM_BUTTON_MIDDLE       = 2,
-	KBM_BUTTON_RIGHT        = 3
+	KBM_BUTTON_RIGHT        = 3,
+	KBM_SCROLL_UP           = 4,
+	KBM_SCROLL_DOWN         = 5,
+	KBM_SCROLL_LEFT         = 6,
+	KBM_SCROLL_RIGHT        = 7
 };
 
 /*
@@ -40,6 +44,30 @@ void close_display(void);
 /* start_listening: map the provided hotkeys and begin an event loop */
 void start_listening(void);
 
+#ifdef __linux__
+/* stop_listening: end the event loop once the current event is handled */
+void stop_listening(void);
+
+/* send_text: type the keysyms in the zero-terminated array text */
+void send_text(const uint32_t *text);
+
+/* coordinates of warp_cursor given as percentages */
+#define KBM_WARP_XPCT	0x1
+#define KBM_WARP_YPCT	0x2
+
+/* warp_cursor: move the cursor to x,y on a monitor, or the screen if 0 */
+void warp_cursor(unsigned int monitor, int x, int y, unsigned int flags);
+
+/* switch_layer: push, pop or set the active layer, a LAYER_* action */
+void switch_layer(unsigned int action, unsigned int layer);
+
+/* load_profiles: load the n keymaps in maps as profiles and use the first */
+void load_profiles(struct keymap *maps, const char **names, size_t n);
+
+/* switch_profile: use profile i, or the next profile if i is negative */
+void switch_profile(int i);
+#endif
+
 /* load_keys: store list of keys starting at head */
 void load_keys(struct hotkey *head);
 
@@ -49,12 +77,21 @@ void unload_keys(void);
 /* send_button: send a button event */
 void send_button(unsigned int button);
 
+/* send_button_event: send a press or release of a mouse button */
+void send_button_event(unsigned int button, unsigned int type);
+
+/* send_scroll: scroll count notches in direction dir */
+void send_scroll(unsigned int dir, unsigned int count);
+
 /* send_key: send a key event */
 void send_key(unsigned int keycode, unsigned int modmask, unsigned int type);
 
 /* move_cursor: move cursor along vector x,y from current position */
 void move_cursor(int x, int y);
 
+/* drag_cursor: drag with the left button along vector x,y */
+void drag_cursor(int x, int y);
+
 /* enable_keys: enable all hotkeys */
 void enable_keys(void);
 
@@ -64,7 +101,13 @@ void disable_keys(void);
 /* toggle_keys: disable action hotkeys if active; enable otherwise */
 void toggle_keys(void);
 
+/* active_window: return the id of the active window */
+unsigned long active_window(void);
+
+/* cursor_position: get the position of the cursor at the last key event */
+void cursor_position(int *x, int *y);
+
 /* kbm_exec: execute the specified program */
-void kbm_exec(void *args);
+void kbm_exec(struct exec_cmd *cmd);
 
 #endif /* KBM_DISPLAY_H */
@@ -188,6 +188,13 @@ void warn_literal(struct lexer *lex, size_t lim, int quote)
 	print_caret(lex, CURR_IND(lex) - start, 1, KMAG);
 }
 
+/* warn_binding: print warning about the binding of key at line lnum */
+void warn_binding(struct lexer *lex, unsigned int lnum, long col,
+                  const char *msg, const char *key)
+{
+	PUTWARN(lex, lnum, col, "%s `%s'\n", msg, key);
+}
+
 /* note_duplicate: print a note informing duplicate modifier declaration */
 void note_duplicate(struct lexer *lex)
 {
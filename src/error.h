@@ -29,6 +29,8 @@ void err_invkey(struct lexer *lex);
 void err_selfmod(struct lexer *lex);
 void err_eof(struct lexer *lex);
 void warn_literal(struct lexer *lex, size_t lim, int quote);
+void warn_binding(struct lexer *lex, unsigned int lnum, long col,
+                  const char *msg, const char *key);
 void note_duplicate(struct lexer *lex);
 
 #endif
@@ -17,31 +17,90 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "display.h"
 #include "hotkey.h"
 #include "kbm.h"
 #include "keymap.h"
 
+#ifdef __linux__
+#include "proc.h"
+#endif
+
 static void get_os_codes(struct hotkey *hk);
+static uint32_t os_modmask(uint16_t code, uint8_t modmask);
+#ifdef __linux__
+static void macro_expire(struct timer *t);
+static void repeat_expire(struct timer *t);
+static void glide_step(struct timer *t);
+static void move_release(struct mover *m);
+#endif
 
-/* create_hotkey: define a new hotkey */
-struct hotkey *create_hotkey(uint8_t keycode, uint8_t modmask,
-                             uint8_t op, uint64_t opargs, uint32_t flags)
+/* create_hotkey: define a new hotkey performing nops operations */
+struct hotkey *create_hotkey(uint16_t keycode, uint8_t modmask,
+                             const struct operation *ops, size_t nops,
+                             uint32_t flags)
 {
 	struct hotkey *hk;
+	size_t i;
 
-	hk = malloc(sizeof *hk);
+	hk = malloc(sizeof *hk + nops * sizeof *ops);
 	hk->kbm_code = keycode;
 	hk->kbm_modmask = modmask;
-	hk->op = op;
-	hk->opargs = opargs;
 	hk->key_flags = flags;
 	hk->next = NULL;
+	hk->nops = nops;
+	memcpy(hk->ops, ops, nops * sizeof *ops);
 	get_os_codes(hk);
 
+#ifdef __linux__
+	hk->macro = NULL;
+	hk->repeat = NULL;
+	hk->seq = NULL;
+	hk->hold = NULL;
+	hk->hold_ms = 0;
+	hk->gest = NULL;
+	hk->layer = 0;
+	if (flags & KBM_MACRO) {
+		hk->macro = calloc(1, sizeof *hk->macro);
+		timer_init(&hk->macro->timer, macro_expire, hk);
+	}
+	if (flags & KBM_REPEAT) {
+		hk->repeat = calloc(1, sizeof *hk->repeat);
+		hk->repeat->period = 1000000000 / KBM_RATE(flags);
+		timer_init(&hk->repeat->timer, repeat_expire, hk);
+	}
+#endif
+
+	for (i = 0; i < nops; ++i) {
+		if (ops[i].op == OP_EXEC)
+			((struct exec_cmd *)ops[i].args)->hk = hk;
+#ifdef __linux__
+		if (ops[i].op == OP_GLIDE)
+			timer_init(&((struct glide *)ops[i].args)->timer,
+			           glide_step, (void *)ops[i].args);
+#endif
+	}
+
 	return hk;
 }
 
+/* has_op: check if hotkey hk performs operation op */
+int has_op(const struct hotkey *hk, uint8_t op)
+{
+	size_t i;
+
+	for (i = 0; i < hk->nops; ++i) {
+		if (hk->ops[i].op == op)
+			return 1;
+	}
+#ifdef __linux__
+	if (hk->hold)
+		return has_op(hk->hold, op);
+#endif
+	return 0;
+}
+
 /* add_hotkey: append a key to the end of list head */
 void add_hotkey(struct hotkey **head, struct hotkey *hk)
 {
@@ -53,19 +112,57 @@ void add_hotkey(struct hotkey **head, struct hotkey *hk)
 /* free_keys: free all hotkeys and their data in list starting at head */
 void free_keys(struct hotkey *head)
 {
+	struct exec_cmd *cmd;
+	size_t i;
 #if defined(__linux__) || defined(__APPLE__)
 	char **argv;
 #endif
 
 	if (head->next)
 		free_keys(head->next);
-	/*
-	 * For an exec operation, opargs stores the
-	 * address of some dynamically allocated data.
-	 */
-	if (head->op == OP_EXEC) {
+
+#ifdef __linux__
+	if (head->macro) {
+		timer_stop(&head->macro->timer);
+		free(head->macro);
+	}
+	if (head->repeat) {
+		timer_stop(&head->repeat->timer);
+		free(head->repeat);
+	}
+	free(head->seq);
+	if (head->hold)
+		free_keys(head->hold);
+#endif
+
+	for (i = 0; i < head->nops; ++i) {
+		/* the text of a type operation is dynamically allocated */
+		if (head->ops[i].op == OP_TYPE)
+			free((void *)head->ops[i].args);
+#ifdef __linux__
+		if (head->ops[i].op == OP_GLIDE) {
+			timer_stop(&((struct glide *)head->ops[i].args)->timer);
+			free((void *)head->ops[i].args);
+		}
+		if (head->ops[i].op == OP_MOVE) {
+			move_release((struct mover *)head->ops[i].args);
+			free((void *)head->ops[i].args);
+		}
+#endif
+
+		/*
+		 * For an exec operation, args stores the
+		 * address of some dynamically allocated data.
+		 */
+		if (head->ops[i].op != OP_EXEC)
+			continue;
+
+		cmd = (struct exec_cmd *)head->ops[i].args;
+#ifdef __linux__
+		proc_forget(cmd);
+#endif
 #if defined(__linux__) || defined(__APPLE__)
-		argv = (char **)head->opargs;
+		argv = cmd->argv;
 
 #ifdef __APPLE__
 		/* skip over "open" "-a", which are not dynamically allocated */
@@ -74,32 +171,375 @@ void free_keys(struct hotkey *head)
 
 		for (; *argv; ++argv)
 			free(*argv);
+		free(cmd->argv);
+#endif
+#ifdef __linux__
+		free(cmd->segs);
+		free(cmd->args);
+		free(cmd->buf);
+#endif
+#if defined(__CYGWIN__) || defined (__MINGW32__)
+		free(cmd->cmd);
 #endif
-		free((void *)head->opargs);
+		free(cmd);
 	}
 	free(head);
 }
 
-/* process_hotkey: perform the operation of hotkey hk */
+static int run_op(const struct operation *op, int tap);
+#ifdef __linux__
+static int macro_press(struct hotkey *hk);
+static int repeat_event(struct hotkey *hk, unsigned int type);
+static void move_press(struct mover *m);
+#endif
+
+/*
+ * process_hotkey:
+ * Perform the operations of hotkey hk in order.
+ * The key of a binding's only key operation is held down for as long as
+ * the hotkey is; in a sequence of operations, keys are tapped instead.
+ */
 int process_hotkey(struct hotkey *hk, unsigned int type)
 {
+	size_t i;
 	int x, y;
-#if defined(KBM_DEBUG) && defined(__linux__) || defined(__APPLE__)
-	char **s;
+
+#ifdef __linux__
+	if (hk->macro)
+		return type == KBM_PRESS ? macro_press(hk) : 0;
+	if (hk->repeat)
+		return repeat_event(hk, type);
+
+	/* a move operation lasts for as long as its key is held */
+	if (hk->nops == 1 && hk->ops[0].op == OP_MOVE) {
+		if (type == KBM_PRESS)
+			move_press((struct mover *)hk->ops[0].args);
+		else if (type == KBM_RELEASE)
+			move_release((struct mover *)hk->ops[0].args);
+		return 0;
+	}
 #endif
 
+	/* a held button is not pressed again */
+	if (type == KBM_AUTOREPEAT && hk->nops == 1
+	    && hk->ops[0].op == OP_PRESS)
+		return 0;
+	if (type == KBM_AUTOREPEAT)
+		type = KBM_PRESS;
+
 	if (type == KBM_RELEASE) {
 		/* send a release event for a key mapping on key release */
-		if (hk->op == OP_KEY) {
-			x = hk->opargs & 0xFFFFFFFF;
-			y = (hk->opargs >> 32) & 0xFFFFFFFF;
+		if (hk->nops == 1 && hk->ops[0].op == OP_KEY) {
+			x = hk->ops[0].args & 0xFFFFFFFF;
+			y = (hk->ops[0].args >> 32) & 0xFFFFFFFF;
 			send_key(OSCODE(x), OSMASK(y), type);
 		}
+		/* likewise, release a held button */
+		if (hk->nops == 1 && hk->ops[0].op == OP_PRESS)
+			send_button_event(hk->ops[0].args, type);
 		return 0;
 	}
 
 	PRINT_DEBUG("KEYPRESS:  %s\n", keystr(hk->kbm_code, hk->kbm_modmask));
-	switch (hk->op) {
+	for (i = 0; i < hk->nops; ++i) {
+		if (run_op(&hk->ops[i], hk->nops > 1) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+#define LATE_AVG_US(l) \
+	((l)->count ? (unsigned long long)((l)->sum / (l)->count / 1000) : 0ULL)
+#define LATE_MAX_US(l) ((unsigned long long)((l)->max / 1000))
+
+/* note_lateness: record how late timer t expired */
+static void note_lateness(struct lateness *l, const struct timer *t)
+{
+	l->count++;
+	l->sum += t->late;
+	if (t->late > l->max)
+		l->max = t->late;
+}
+
+/*
+ * macro_step:
+ * Run the operations of macro hk up to its next wait, and schedule the
+ * rest for when the wait ends. Waits are measured from the start of
+ * playback rather than from when the previous one happened to expire,
+ * so lateness in running one step does not delay all the ones after it.
+ */
+static int macro_step(struct hotkey *hk)
+{
+	struct macro *m;
+	const struct operation *op;
+
+	m = hk->macro;
+	while (m->pc < hk->nops) {
+		op = &hk->ops[m->pc++];
+		if (op->op == OP_WAIT) {
+			m->elapsed += op->args * 1000000;
+			timer_start(&m->timer, m->start + m->elapsed);
+			return 0;
+		}
+		if (run_op(op, 1) == -1)
+			return -1;
+	}
+
+	PRINT_DEBUG("MACRO:     %s done, %u waits, lateness avg %lluus "
+	            "max %lluus\n", keystr(hk->kbm_code, hk->kbm_modmask),
+	            m->late.count, LATE_AVG_US(&m->late),
+	            LATE_MAX_US(&m->late));
+	return 0;
+}
+
+/* macro_press: start playing back macro hk, or cancel it if running */
+static int macro_press(struct hotkey *hk)
+{
+	struct macro *m;
+
+	m = hk->macro;
+	PRINT_DEBUG("KEYPRESS:  %s\n", keystr(hk->kbm_code, hk->kbm_modmask));
+	if (TIMER_ACTIVE(&m->timer)) {
+		PRINT_DEBUG("MACRO:     cancelled at step %u\n", m->pc);
+		timer_stop(&m->timer);
+		return 0;
+	}
+
+	m->start = loop_now();
+	m->elapsed = 0;
+	m->pc = 0;
+	memset(&m->late, 0, sizeof m->late);
+	return macro_step(hk);
+}
+
+/* macro_expire: continue playing back a macro after a wait */
+static void macro_expire(struct timer *t)
+{
+	struct hotkey *hk;
+	struct macro *m;
+
+	hk = t->data;
+	m = hk->macro;
+	note_lateness(&m->late, t);
+
+	if (macro_step(hk) == -1)
+		stop_listening();
+}
+
+/*
+ * repeat_fire:
+ * Run the operations of repeating hotkey hk and schedule the next firing.
+ * Firings are at fixed offsets from the first, so the rate does not
+ * drift; if more than a full period has been lost, the missed firings
+ * are skipped rather than run back to back.
+ */
+static int repeat_fire(struct hotkey *hk)
+{
+	struct repeat *r;
+	uint64_t now;
+	size_t i;
+
+	r = hk->repeat;
+	for (i = 0; i < hk->nops; ++i) {
+		if (run_op(&hk->ops[i], 1) == -1)
+			return -1;
+	}
+
+	now = loop_now();
+	r->last = now;
+	r->count++;
+	if (r->start + r->count * r->period + r->period <= now)
+		r->count = (now - r->start) / r->period + 1;
+	timer_start(&r->timer, r->start + r->count * r->period);
+	return 0;
+}
+
+/*
+ * repeat_event:
+ * Start repeating hotkey hk when its key is pressed and stop on release.
+ * Autorepeated presses continue an interrupted repeat on the same schedule,
+ * as servers without detectable autorepeat send a release before each.
+ */
+static int repeat_event(struct hotkey *hk, unsigned int type)
+{
+	struct repeat *r;
+
+	r = hk->repeat;
+	switch (type) {
+	case KBM_PRESS:
+		PRINT_DEBUG("KEYPRESS:  %s\n", keystr(hk->kbm_code,
+		                                       hk->kbm_modmask));
+		r->start = loop_now();
+		r->count = 0;
+		memset(&r->late, 0, sizeof r->late);
+		return repeat_fire(hk);
+	case KBM_AUTOREPEAT:
+		if (!TIMER_ACTIVE(&r->timer) && r->count)
+			timer_start(&r->timer, r->start + r->count * r->period);
+		return 0;
+	default:
+		timer_stop(&r->timer);
+		PRINT_DEBUG("REPEAT:    %s fired %llu times at %.1fHz, "
+		            "lateness avg %lluus max %lluus\n",
+		            keystr(hk->kbm_code, hk->kbm_modmask),
+		            (unsigned long long)r->count, r->count > 1
+		            ? (r->count - 1) * 1e9 / (r->last - r->start) : 0.0,
+		            LATE_AVG_US(&r->late), LATE_MAX_US(&r->late));
+		return 0;
+	}
+}
+
+/*
+ * glide_step:
+ * Move the cursor to where an interpolated jump should be at the current
+ * time. Steps are scheduled on a fixed grid from the start of the motion;
+ * any missed while the event loop was busy are merged into the next one.
+ */
+static void glide_step(struct timer *t)
+{
+	struct glide *g;
+	uint64_t now, elapsed, duration, period;
+	double p;
+	int32_t x, y;
+
+	g = t->data;
+	now = loop_now();
+	elapsed = now - g->start;
+	duration = (uint64_t)g->ms * 1000000;
+
+	p = elapsed >= duration ? 1.0 : (double)elapsed / duration;
+	if (g->ease == GLIDE_EASE)
+		p = p * p * (3 - 2 * p);
+
+	x = g->dx * p + (g->dx < 0 ? -0.5 : 0.5);
+	y = g->dy * p + (g->dy < 0 ? -0.5 : 0.5);
+	if (x != g->x || y != g->y) {
+		move_cursor(x - g->x, y - g->y);
+		g->x = x;
+		g->y = y;
+	}
+
+	if (elapsed < duration) {
+		period = 1000000000 / GLIDE_HZ;
+		timer_start(t, g->start + (elapsed / period + 1) * period);
+	}
+}
+
+/* glide_start: begin an interpolated jump, abandoning one in progress */
+static void glide_start(struct glide *g)
+{
+	timer_stop(&g->timer);
+	g->start = loop_now();
+	g->x = g->y = 0;
+	glide_step(&g->timer);
+}
+
+/* held move operations, all advanced together by move_timer */
+static struct mover *movers = NULL;
+static uint64_t move_last;
+
+/* cursor motion owed by the movers which is smaller than a pixel */
+static double move_fx, move_fy;
+
+/*
+ * move_tick:
+ * Advance every held mover by the time since the last tick and move the
+ * cursor once by their combined motion. Each mover speeds up linearly
+ * from its initial speed for as long as its key is held.
+ */
+static void move_tick(struct timer *t)
+{
+	struct mover *m;
+	uint64_t now, period, next;
+	double dt, f;
+	int x, y;
+
+	now = loop_now();
+	dt = (now - move_last) / 1e9;
+	move_last = now;
+
+	for (m = movers; m; m = m->next) {
+		f = 1 + (now - m->start) / 1e9 * m->accel / 100;
+		if (f > MOVE_MAX_FACTOR)
+			f = MOVE_MAX_FACTOR;
+		move_fx += m->vx * f * dt;
+		move_fy += m->vy * f * dt;
+	}
+
+	x = move_fx;
+	y = move_fy;
+	move_fx -= x;
+	move_fy -= y;
+	if (x || y)
+		move_cursor(x, y);
+
+	period = 1000000000 / MOVE_HZ;
+	next = t->deadline + period;
+	if (next <= now)
+		next = now + period;
+	timer_start(t, next);
+}
+
+static struct timer move_timer = { 0, 0, TIMER_IDLE, move_tick, NULL };
+
+/* move_press: start moving the cursor with m */
+static void move_press(struct mover *m)
+{
+	if (m->held)
+		return;
+
+	PRINT_DEBUG("OPERATION: move %d %d\n", m->vx, m->vy);
+	m->held = 1;
+	m->start = loop_now();
+	m->next = movers;
+	movers = m;
+
+	if (!TIMER_ACTIVE(&move_timer)) {
+		move_last = m->start;
+		move_fx = move_fy = 0;
+		timer_start(&move_timer, m->start + 1000000000 / MOVE_HZ);
+	}
+}
+
+/* move_release: stop moving the cursor with m */
+static void move_release(struct mover *m)
+{
+	struct mover **p;
+
+	if (!m->held)
+		return;
+
+	m->held = 0;
+	for (p = &movers; *p != m; p = &(*p)->next)
+		;
+	*p = m->next;
+
+	if (!movers)
+		timer_stop(&move_timer);
+}
+
+/* repeat_expire: fire a repeating hotkey again */
+static void repeat_expire(struct timer *t)
+{
+	struct hotkey *hk;
+
+	hk = t->data;
+	note_lateness(&hk->repeat->late, t);
+	if (repeat_fire(hk) == -1)
+		stop_listening();
+}
+#endif
+
+/* run_op: perform a single operation, tapping keys if tap is set */
+static int run_op(const struct operation *op, int tap)
+{
+	int x, y;
+#if defined(KBM_DEBUG) && defined(__linux__) || defined(__APPLE__)
+	char **s;
+#endif
+
+	switch (op->op) {
 	case OP_CLICK:
 		/* click operation: send a mouse click event */
 		PRINT_DEBUG("OPERATION: click\n");
@@ -110,52 +550,127 @@ int process_hotkey(struct hotkey *hk, unsigned int type)
 		PRINT_DEBUG("OPERATION: rclick\n");
 		send_button(KBM_BUTTON_RIGHT);
 		return 0;
+	case OP_MCLICK:
+		/* mclick operation: send a mouse middle click event */
+		PRINT_DEBUG("OPERATION: mclick\n");
+		send_button(KBM_BUTTON_MIDDLE);
+		return 0;
+	case OP_SCROLL:
+		/* scroll operation: scroll the mouse wheel */
+		/* direction is stored in lower 32 bits, count in upper 32 */
+		x = op->args & 0xFFFFFFFF;
+		y = (op->args >> 32) & 0xFFFFFFFF;
+		PRINT_DEBUG("OPERATION: scroll %d %d\n", x, y);
+		send_scroll(x, y);
+		return 0;
+	case OP_PRESS:
+		/* press operation: press a mouse button */
+		PRINT_DEBUG("OPERATION: press %d\n", (int)op->args);
+		send_button_event(op->args, KBM_PRESS);
+		return 0;
+	case OP_RELEASE:
+		/* release operation: release a mouse button */
+		PRINT_DEBUG("OPERATION: release %d\n", (int)op->args);
+		send_button_event(op->args, KBM_RELEASE);
+		return 0;
+	case OP_DRAG:
+		/* drag operation: drag the cursor with the left button */
+		x = op->args & 0xFFFFFFFF;
+		y = (op->args >> 32) & 0xFFFFFFFF;
+		PRINT_DEBUG("OPERATION: drag %d %d\n", x, y);
+		drag_cursor(x, y);
+		return 0;
 	case OP_JUMP:
 		/* jump operation: move the cursor */
 		/* x value is stored in lower 32 bits, y value in upper 32 */
-		x = hk->opargs & 0xFFFFFFFF;
-		y = (hk->opargs >> 32) & 0xFFFFFFFF;
+		x = op->args & 0xFFFFFFFF;
+		y = (op->args >> 32) & 0xFFFFFFFF;
 		PRINT_DEBUG("OPERATION: jump %d %d\n", x, y);
 		move_cursor(x, y);
 		return 0;
+#ifdef __linux__
+	case OP_JUMPTO:
+		/* jumpto operation: place the cursor at a point on screen */
+		/* x and y are 16 bits each, followed by monitor and flags */
+		PRINT_DEBUG("OPERATION: jumpto %u %u on %u\n",
+		            (unsigned int)(op->args & 0xFFFF),
+		            (unsigned int)((op->args >> 16) & 0xFFFF),
+		            (unsigned int)((op->args >> 32) & 0xFFFF));
+		warp_cursor((op->args >> 32) & 0xFFFF, op->args & 0xFFFF,
+		            (op->args >> 16) & 0xFFFF,
+		            (op->args >> 48) & 0xFFFF);
+		return 0;
+	case OP_GLIDE:
+		/* jump operation over time: move the cursor smoothly */
+		PRINT_DEBUG("OPERATION: jump %d %d over %u\n",
+		            ((struct glide *)op->args)->dx,
+		            ((struct glide *)op->args)->dy,
+		            ((struct glide *)op->args)->ms);
+		glide_start((struct glide *)op->args);
+		return 0;
+#endif
 	case OP_KEY:
 		/* key operation: simulate a keypress */
 		/* keycode is stored in lower 32 bits, modmask in upper 32 */
-		x = hk->opargs & 0xFFFFFFFF;
-		y = (hk->opargs >> 32) & 0xFFFFFFFF;
+		x = op->args & 0xFFFFFFFF;
+		y = (op->args >> 32) & 0xFFFFFFFF;
 		PRINT_DEBUG("OPERATION: key %s\n", keystr(x, y));
-		send_key(OSCODE(x), OSMASK(y), type);
+		send_key(OSCODE(x), OSMASK(y), KBM_PRESS);
+		if (tap)
+			send_key(OSCODE(x), OSMASK(y), KBM_RELEASE);
 		return 0;
 	case OP_TOGGLE:
 		/* toggle operation: enable/disable hotkeys */
 		PRINT_DEBUG("OPERATION: toggle\n");
 		toggle_keys();
 		return 0;
+#ifdef __linux__
+	case OP_LAYER:
+		/* layer operation: change the active layer */
+		PRINT_DEBUG("OPERATION: layer %u %u\n",
+		            (unsigned int)(op->args & 0xFF),
+		            (unsigned int)(op->args >> 8 & 0xFF));
+		switch_layer(op->args & 0xFF, op->args >> 8 & 0xFF);
+		return 0;
+	case OP_PROFILE:
+		/* profile operation: use another loaded keymap file */
+		PRINT_DEBUG("OPERATION: profile %u\n",
+		            (unsigned int)op->args);
+		switch_profile((int)op->args - 1);
+		return 0;
+#endif
 	case OP_QUIT:
 		/* exit operation: quit the program */
 		PRINT_DEBUG("OPERATION: quit\n");
 		return -1;
+#ifdef __linux__
+	case OP_TYPE:
+		/* type operation: type a string of keysyms */
+		PRINT_DEBUG("OPERATION: type\n");
+		send_text((const uint32_t *)op->args);
+		return 0;
+#endif
 	case OP_EXEC:
 		/* exec operation: execute command or program */
 		PRINT_DEBUG("OPERATION: exec");
 #if defined(KBM_DEBUG) && defined(__linux__) || defined(__APPLE__)
 		/*
-		 * On Unix-based systems, opargs is the start of the
-		 * argv array of the command to be executed.
+		 * On Unix-based systems, args points to a command
+		 * holding the argv array of the program to execute.
 		 */
-		s = (char **)hk->opargs;
+		s = ((struct exec_cmd *)op->args)->argv;
 		for (; *s; ++s)
 			PRINT_DEBUG(" %s", *s);
 		putchar('\n');
 #endif
 #if defined(__CYGWIN__) || defined (__MINGW32__)
 		/*
-		 * On Windows, opargs is the address of the string
+		 * On Windows, the command holds the string
 		 * detailing the command to execute.
 		 */
-		PRINT_DEBUG(" %s\n", (char *)hk->opargs);
+		PRINT_DEBUG(" %s\n", ((struct exec_cmd *)op->args)->cmd);
 #endif
-		kbm_exec((void *)hk->opargs);
+		kbm_exec((struct exec_cmd *)op->args);
 		return 0;
 	default:
 		return 0;
@@ -175,18 +690,67 @@ void free_windows(struct keymap *k)
 	k->win_len = 0;
 }
 
+void free_layers(struct keymap *k)
+{
+	size_t i;
+
+	for (i = 0; i < k->nlayers; ++i)
+		free(k->layers[i]);
+	free(k->layers);
+	k->layers = NULL;
+	k->nlayers = 0;
+}
+
 /* get_os_codes: load os-specific keycodes and mod masks into hk */
 static void get_os_codes(struct hotkey *hk)
 {
 	hk->os_code = OSCODE(hk->kbm_code);
-	hk->os_modmask = OSMASK(hk->kbm_modmask);
+	hk->os_modmask = os_modmask(hk->kbm_code, hk->kbm_modmask);
+}
 
+/* os_modmask: return the OS modifier masks of key code with modmask */
+static uint32_t os_modmask(uint16_t code, uint8_t modmask)
+{
+	uint32_t mask;
+
+	mask = OSMASK(modmask);
 #ifdef __linux__
 	/*
 	 * The keys NUMDEC through NUM9 are only accessible when Num Lock is
 	 * on. Set the Num Lock bit to active to indicate this.
 	 */
-	if (hk->kbm_code >= KEY_NUMDEC)
-		hk->os_modmask |= XCB_MOD_MASK_2;
+	if (code >= KEY_NUMDEC && code <= KEY_NUM9)
+		mask |= XCB_MOD_MASK_2;
+#else
+	KBM_UNUSED(code);
 #endif
+	return mask;
+}
+
+#ifdef __linux__
+void set_sequence(struct hotkey *hk, const uint64_t *keys, size_t n,
+                  uint32_t kind)
+{
+	struct seq_key *k;
+	size_t i;
+
+	hk->seq = malloc(sizeof *hk->seq + n * sizeof *hk->seq->keys);
+	hk->seq->len = n;
+	for (i = 0; i < n; ++i) {
+		k = &hk->seq->keys[i];
+		k->kbm_code = keys[i] & 0xFFFFFFFF;
+		k->kbm_modmask = kind == KBM_CHORD ? hk->kbm_modmask
+		                                   : (keys[i] >> 32) & 0xFF;
+		k->os_code = OSCODE(k->kbm_code);
+		k->os_modmask = os_modmask(k->kbm_code, k->kbm_modmask);
+	}
+	hk->key_flags |= kind;
+}
+
+void set_hold(struct hotkey *hk, struct hotkey *hold, unsigned int ms)
+{
+	hk->hold = hold;
+	hk->hold_ms = ms ? ms : KBM_HOLD_TIME;
+	hk->key_flags |= KBM_HOLD;
 }
+#endif
@@ -19,9 +19,15 @@
 #ifndef KBM_HOTKEY_H
 #define KBM_HOTKEY_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "keymap.h"
 
+#ifdef __linux__
+#include <sys/types.h>
+#include "loop.h"
+#endif
+
 /* operations that can be performed */
 #define OP_CLICK	0xA0
 #define OP_RCLICK	0xA1
@@ -30,38 +36,301 @@
 #define OP_TOGGLE	0xA4
 #define OP_QUIT		0xA5
 #define OP_EXEC		0xA6
+#define OP_WAIT		0xA7
+#define OP_TYPE		0xA8
+#define OP_MCLICK	0xA9
+#define OP_SCROLL	0xAA
+#define OP_PRESS	0xAB
+#define OP_RELEASE	0xAC
+#define OP_DRAG		0xAD
+#define OP_GLIDE	0xAE
+#define OP_MOVE		0xAF
+#define OP_JUMPTO	0xB0
+#define OP_LAYER	0xB1
+#define OP_PROFILE	0xB2
+
+/* maximum number of notches scrolled by a single scroll operation */
+#define KBM_MAX_SCROLL	1000
+
+/* longest duration of an interpolated jump in milliseconds */
+#define KBM_MAX_GLIDE	10000
+
+/* rate at which interpolated jumps move the cursor */
+#define GLIDE_HZ	60
+
+/* largest coordinate and monitor number of a jumpto operation */
+#define KBM_MAX_COORD	32767
+#define KBM_MAX_MONITOR	16
+
+/* fastest speed of a move operation in pixels per second */
+#define KBM_MAX_SPEED	10000
+
+/* highest acceleration of a move operation in percent per second */
+#define KBM_MAX_ACCEL	1000
+
+/* acceleration of a move operation without an accel qualifier */
+#define MOVE_ACCEL	100
+
+/* limit on how many times its initial speed a move operation can reach */
+#define MOVE_MAX_FACTOR	8
+
+/* rate at which held move operations move the cursor */
+#define MOVE_HZ		60
+
+/* paths of interpolated jumps */
+enum {
+	GLIDE_LINEAR,			/* constant speed */
+	GLIDE_EASE			/* accelerate, then decelerate */
+};
 
 /* keypress and key release */
 #define KBM_PRESS	0x00
 #define KBM_RELEASE	0x01
+#define KBM_AUTOREPEAT	0x02	/* keypress generated by key autorepeat */
 
 /* additional flags */
 #define KBM_NOREPEAT	0x01
+#define KBM_MACRO	0x02	/* operations are played back over time */
+#define KBM_REPEAT	0x04	/* operations repeat while the key is held */
+#define KBM_WILDCARD	0x08	/* modifiers not in kbm_modmask are ignored */
+#define KBM_SEQUENCE	0x10	/* further keys follow the first */
+#define KBM_CHORD	0x20	/* further keys are pressed with the first */
+#define KBM_HOLD	0x40	/* the key runs other operations when held */
+#define KBM_DOUBLE	0x80	/* runs when the key is tapped twice */
+#define KBM_LONG	0x100	/* runs when the key is held for hold_ms */
+
+/* limits of key sequences, such as ^x ^f */
+#define KBM_MAX_SEQ		8	/* keys in a sequence */
+#define KBM_SEQ_TIMEOUT		1000	/* default ms to wait for a key */
+#define KBM_MAX_SEQ_TIMEOUT	60000
+
+/* limits of chords, such as j+k */
+#define KBM_MAX_CHORD		4	/* keys in a chord */
+#define KBM_CHORD_WINDOW	50	/* default ms to press all keys in */
+#define KBM_MAX_CHORD_WINDOW	1000
+
+/* ms after which a tap and hold key counts as held, unless given */
+#define KBM_HOLD_TIME		200
+#define KBM_MAX_HOLD_TIME	5000
+
+/* ms in which the second tap of a double tap must follow the first */
+#define KBM_DOUBLE_TIME		250
+
+/* limits of layers, whose bindings are active while they are on top */
+#define KBM_MAX_LAYERS		16	/* layers in a file */
+#define KBM_MAX_LAYER_DEPTH	8	/* layers pushed on top of each other */
+
+/* actions of a layer operation */
+enum {
+	LAYER_PUSH,			/* make a layer active until popped */
+	LAYER_POP,			/* return to the layer below */
+	LAYER_SET			/* make a layer the only active one */
+};
+
+/* most keymap files loaded as profiles at once */
+#define KBM_MAX_PROFILES	16
+
+/* the repeat rate in Hz is stored in the upper 16 bits of the flags */
+#define KBM_RATE(flags)	(((flags) >> 16) & 0xFFFF)
+#define KBM_MAX_RATE	1000
+
+/* exec qualifiers */
+#define EXEC_TOGGLE	0x01	/* kill running instances on a second press */
+#define EXEC_CAPTURE	0x02	/* record output in the output log */
+
+/* maximum number of tracked instances of a single exec binding */
+#define EXEC_MAX_PROCS	16
+
+/* runtime values which can be substituted into exec arguments */
+enum {
+	EXEC_SLOT_WINDOW,		/* {window}: id of the active window */
+	EXEC_SLOT_X,			/* {x}: cursor x position */
+	EXEC_SLOT_Y,			/* {y}: cursor y position */
+	EXEC_SLOT_KEY,			/* {key}: name of the hotkey */
+	EXEC_NUM_SLOTS,
+	EXEC_LITERAL = EXEC_NUM_SLOTS
+};
+
+/* maximum length of a substituted value */
+#define EXEC_SLOT_LEN	64
+
+struct hotkey;
+
+#ifdef __linux__
+struct exec_cmd;
+struct gesture;
+
+/* a piece of an exec argument: a slice of literal text or a slot */
+struct exec_seg {
+	uint16_t	arg;		/* index of the argument in argv */
+	uint16_t	slot;		/* EXEC_SLOT_* or EXEC_LITERAL */
+	uint16_t	off;		/* offset of literal text in argument */
+	uint16_t	len;		/* length of literal text */
+};
+
+struct child {
+	pid_t		pid;		/* process id of the child */
+	int		pidfd;		/* file descriptor referring to pid */
+	int		outfd;		/* read end of captured output, or -1 */
+	struct exec_cmd	*cmd;		/* command which started the child */
+};
+#endif
+
+/* command run by an exec operation, stored in opargs */
+struct exec_cmd {
+#if defined(__linux__) || defined(__APPLE__)
+	char		**argv;		/* argv array of the command */
+#endif
+#if defined(__CYGWIN__) || defined (__MINGW32__)
+	char		*cmd;		/* full command line */
+#endif
+	uint8_t		flags;		/* exec qualifiers */
+	uint8_t		max;		/* max running instances, 0 if any */
+	struct hotkey	*hk;		/* hotkey which runs the command */
+#ifdef __linux__
+	uint8_t		slots;		/* bitmask of substituted slots */
+	uint16_t	nsegs;		/* number of template segments */
+	struct exec_seg	*segs;		/* templates of substituted arguments */
+	char		**args;		/* argv assembled at launch */
+	char		*buf;		/* storage for assembled arguments */
+	uint8_t		nprocs;		/* number of running instances */
+	uint16_t	running;	/* bitmask of occupied procs slots */
+	struct child	procs[EXEC_MAX_PROCS];
+#endif
+};
+
+/* maximum number of operations performed by a single hotkey */
+#define KBM_MAX_OPS	32
+
+struct operation {
+	uint8_t		op;		/* operation to perform */
+	uint64_t	args;		/* arguments for the operation */
+};
+
+#ifdef __linux__
+/* how late timer-driven operations ran */
+struct lateness {
+	uint32_t	count;		/* number of samples */
+	uint64_t	sum;		/* total lateness in ns */
+	uint64_t	max;		/* greatest lateness in ns */
+};
+
+/* playback state of a macro binding */
+struct macro {
+	struct timer	timer;		/* expires at the end of a wait */
+	uint64_t	start;		/* time at which playback started */
+	uint64_t	elapsed;	/* total of the waits played so far */
+	uint8_t		pc;		/* index of the next operation */
+	struct lateness	late;		/* lateness of waits */
+};
+
+/* a jump interpolated over time, stored in args */
+struct glide {
+	int32_t		dx;		/* total horizontal motion */
+	int32_t		dy;		/* total vertical motion */
+	uint32_t	ms;		/* duration of the motion */
+	uint8_t		ease;		/* GLIDE_* path */
+	struct timer	timer;		/* expires at the next step */
+	uint64_t	start;		/* time at which the motion started */
+	int32_t		x;		/* horizontal motion made so far */
+	int32_t		y;		/* vertical motion made so far */
+};
+
+/* a continuous cursor motion for as long as a key is held, stored in args */
+struct mover {
+	int32_t		vx;		/* initial horizontal speed */
+	int32_t		vy;		/* initial vertical speed */
+	uint32_t	accel;		/* speed increase in percent per second */
+	uint64_t	start;		/* time at which the key was pressed */
+	struct mover	*next;		/* next held mover */
+	uint8_t		held;
+};
+
+/* a key following the first of a key sequence or chord */
+struct seq_key {
+	uint16_t	kbm_code;
+	uint8_t		kbm_modmask;
+	uint32_t	os_code;
+	uint32_t	os_modmask;
+};
+
+/* the keys after the first of a sequence or chord binding */
+struct sequence {
+	uint8_t		len;
+	struct seq_key	keys[];
+};
+
+/* state of a binding repeating while its key is held */
+struct repeat {
+	struct timer	timer;		/* expires at the next firing */
+	uint64_t	period;		/* time between firings in ns */
+	uint64_t	start;		/* time of the first firing */
+	uint64_t	last;		/* time of the most recent firing */
+	uint64_t	count;		/* firings since the key was pressed */
+	struct lateness	late;		/* lateness of firings */
+};
+#endif
 
 struct hotkey {
-	uint8_t		kbm_code;	/* kbm keycode of the hotkey */
+	uint16_t	kbm_code;	/* kbm keycode of the hotkey */
 	uint8_t		kbm_modmask;	/* kbm modifier masks */
 	uint32_t	os_code;	/* os-specific keycode of the hotkey */
 	uint32_t	os_modmask;	/* os-specific modifier masks */
-	uint8_t		op;		/* operation to perform on keypress */
-	uint64_t	opargs;		/* arguments for the operation */
 	uint32_t	key_flags;	/* extra hotkey flags */
 	struct hotkey	*next;		/* next key binding */
+#ifdef __linux__
+	struct macro	*macro;		/* playback state if KBM_MACRO */
+	struct repeat	*repeat;	/* repeat state if KBM_REPEAT */
+	struct sequence	*seq;		/* following keys of a sequence or chord */
+	struct hotkey	*hold;		/* binding run if the key is held */
+	uint16_t	hold_ms;	/* time after which the key is held */
+	struct gesture	*gest;		/* taps, double taps and long presses */
+	uint8_t		layer;		/* layer of the binding, 0 if none */
+#endif
+	uint8_t		nops;		/* number of operations */
+	struct operation ops[];		/* operations to perform in order */
 };
 
 #define KBM_ACTIVEWIN   0x01    /* only run hotkeys in specified windows */
 
 struct keymap {
 	int flags;              /* global flags */
+	unsigned int seq_timeout; /* ms to wait for the next key of a sequence */
+	unsigned int chord_window; /* ms in which the keys of a chord are pressed */
 	char **windows;         /* titles of windows in which keys are active */
 	size_t win_len;         /* number of windows in which keys are active */
 	size_t win_size;        /* allocated size of windows array */
+	char **layers;          /* names of the layers, from layer 1 */
+	size_t nlayers;         /* number of named layers */
 	struct hotkey *keys;    /* list of mapped keys */
 };
 
-/* create_hotkey: define a new hotkey */
-struct hotkey *create_hotkey(uint8_t keycode, uint8_t mods,
-                             uint8_t op, uint64_t opargs, uint32_t flags);
+/* create_hotkey: define a new hotkey performing nops operations */
+struct hotkey *create_hotkey(uint16_t keycode, uint8_t mods,
+                             const struct operation *ops, size_t nops,
+                             uint32_t flags);
+
+#ifdef __linux__
+/*
+ * set_sequence:
+ * Make hk a key sequence or, if kind is KBM_CHORD, a chord, with the n
+ * parsed keys in keys following its own. Each key holds its kbm code in
+ * the lower and modifiers in the upper 32 bits. The keys of a chord all
+ * take the modifiers of its first.
+ */
+void set_sequence(struct hotkey *hk, const uint64_t *keys, size_t n,
+                  uint32_t kind);
+
+/*
+ * set_hold:
+ * Make hk a tap and hold key, which runs the operations of hold instead
+ * of its own once it has been held for ms milliseconds.
+ */
+void set_hold(struct hotkey *hk, struct hotkey *hold, unsigned int ms);
+#endif
+
+/* has_op: check if hotkey hk, tapped or held, performs operation op */
+int has_op(const struct hotkey *hk, uint8_t op);
 
 /* add_hotkey: append hotkey hk to the end of list head */
 void add_hotkey(struct hotkey **head, struct hotkey *hk);
@@ -74,4 +343,7 @@ int process_hotkey(struct hotkey *hk, unsigned int type);
 
 void free_windows(struct keymap *k);
 
+/* free_layers: free the layer names of keymap k */
+void free_layers(struct keymap *k);
+
 #endif /* KBM_HOTKEY_H */
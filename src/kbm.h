@@ -38,6 +38,10 @@
 
 #define KBM_UNUSED(x) ((void)x)
 
+/* expand and stringify a macro */
+#define _KBM_STR(x) #x
+#define KBM_STR(x) _KBM_STR(x)
+
 /* print beautiful coloured output */
 #if defined(__linux__) || defined(__APPLE__)
 #define KNRM	"\x1B[0m"
@@ -71,6 +75,7 @@ struct _program_info {
 	int keys_active;        /* whether hotkeys are active */
 	int keys_toggled;       /* whether keys are toggled on */
 	int notifications;      /* whether notifications are enabled */
+	int immediate;          /* send simulated input without batching */
 	const char *curr_file;  /* basename of loaded keymap file */
 	struct keymap map;
 
@@ -20,135 +20,30 @@
 #define KBM_KEYMAP_H
 
 /*
- * Keycodes for all keys on a standard ANSI keyboard
- * and both functions of Numpad keys.
+ * Keycodes for all keys on a standard ANSI keyboard, both functions of
+ * Numpad keys, mouse buttons and extended keys, generated from keys.def.
  */
+enum {
+	KEY_NONE,
+#define KEY(id, name, x11, win32, carbon) KEY_##id,
+#define NAME(id, lexeme)
+#include "keys.def"
+#undef KEY
+#undef NAME
+	KEY_COUNT
+};
 
-/* alphabetic keys */
-#define KEY_Q           0x01
-#define KEY_W           0x02
-#define KEY_E           0x03
-#define KEY_R           0x04
-#define KEY_T           0x05
-#define KEY_Y           0x06
-#define KEY_U           0x07
-#define KEY_I           0x08
-#define KEY_O           0x09
-#define KEY_P           0x0A
-#define KEY_A           0x0B
-#define KEY_S           0x0C
-#define KEY_D           0x0D
-#define KEY_F           0x0E
-#define KEY_G           0x0F
-#define KEY_H           0x10
-#define KEY_J           0x11
-#define KEY_K           0x12
-#define KEY_L           0x13
-#define KEY_Z           0x14
-#define KEY_X           0x15
-#define KEY_C           0x16
-#define KEY_V           0x17
-#define KEY_B           0x18
-#define KEY_N           0x19
-#define KEY_M           0x1A
-
-/* numeric keys */
-#define KEY_0           0x1B
-#define KEY_1           0x1C
-#define KEY_2           0x1D
-#define KEY_3           0x1E
-#define KEY_4           0x1F
-#define KEY_5           0x20
-#define KEY_6           0x21
-#define KEY_7           0x22
-#define KEY_8           0x23
-#define KEY_9           0x24
-
-/* other keys */
-#define KEY_BTICK       0x25
-#define KEY_MINUS       0x26
-#define KEY_EQUAL       0x27
-#define KEY_LSQBR       0x28
-#define KEY_RSQBR       0x29
-#define KEY_BSLASH      0x2A
-#define KEY_SEMIC       0x2B
-#define KEY_QUOTE       0x2C
-#define KEY_COMMA       0x2D
-#define KEY_PERIOD      0x2E
-#define KEY_FSLASH      0x2F
-#define KEY_SPACE       0x30
-
-/* modifiers and special keys */
-#define KEY_ESCAPE      0x31
-#define KEY_BSPACE      0x32
-#define KEY_TAB	        0x33
-#define KEY_CAPS        0x34
-#define KEY_ENTER       0x35
-#define KEY_SHIFT       0x36    /* don't bother distinguishing	*/
-#define KEY_CTRL        0x37    /* between the left and right	*/
-#define KEY_SUPER       0x38    /* versions of these keys;	*/
-#define KEY_META        0x39    /* treat them identically	*/
-
-/* f keys */
-#define KEY_F1          0x3A
-#define KEY_F2          0x3B
-#define KEY_F3          0x3C
-#define KEY_F4          0x3D
-#define KEY_F5          0x3E
-#define KEY_F6          0x3F
-#define KEY_F7          0x40
-#define KEY_F8          0x41
-#define KEY_F9          0x42
-#define KEY_F10         0x43
-#define KEY_F11         0x44
-#define KEY_F12         0x45
-
-/* TKL keys */
-#define KEY_PRTSCR      0x46
-#define KEY_SCRLCK      0x47
-#define KEY_PAUSE       0x48
-#define KEY_INSERT      0x49
-#define KEY_DELETE      0x4A
-#define KEY_HOME        0x4B
-#define KEY_END         0x4C
-#define KEY_PGUP        0x4D
-#define KEY_PGDOWN      0x4E
-#define KEY_LARROW      0x4F
-#define KEY_RARROW      0x50
-#define KEY_UARROW      0x51
-#define KEY_DARROW      0x52
-
-/* numpad keys */
-#define KEY_NUMLOCK     0x53
-#define KEY_NUMDIV      0x54
-#define KEY_NUMMULT     0x55
-#define KEY_NUMMINUS    0x56
-#define KEY_NUMPLUS     0x57
-#define KEY_NUMENTER    0x58
-/* num lock off */
-#define KEY_NUMDEL      0x59
-#define KEY_NUMINS      0x5A
-#define KEY_NUMEND      0x5B
-#define KEY_NUMDOWN     0x5C
-#define KEY_NUMPGDN     0x5D
-#define KEY_NUMLEFT     0x5E
-#define KEY_NUMCLEAR    0x5F
-#define KEY_NUMRIGHT    0x60
-#define KEY_NUMHOME     0x61
-#define KEY_NUMUP       0x62
-#define KEY_NUMPGUP     0x63
-/* num lock on */
-#define KEY_NUMDEC      0x64
-#define KEY_NUM0        0x65
-#define KEY_NUM1        0x66
-#define KEY_NUM2        0x67
-#define KEY_NUM3        0x68
-#define KEY_NUM4        0x69
-#define KEY_NUM5        0x6A
-#define KEY_NUM6        0x6B
-#define KEY_NUM7        0x6C
-#define KEY_NUM8        0x6D
-#define KEY_NUM9        0x6E
+/*
+ * Keys can also be given by their raw OS-specific keycode, written as
+ * keycode:NNN. These follow all named keys in the space of kbm codes.
+ */
+#define KEY_RAW_BASE    0x1000
+#define KEY_RAW_MAX     255
+#define KEY_RAW(n)      (KEY_RAW_BASE + (n))
+#define K_ISRAW(kc)     ((kc) >= KEY_RAW_BASE)
+
+/* OS code of a key which does not exist on the current platform */
+#define NOKEY           0xFFFFFFFF
 
 
 /* bitmasks for the various modifier keys */
@@ -157,10 +52,29 @@
 #define KBM_SUPER_MASK  0x04    /* command on OS X */
 #define KBM_META_MASK   0x08    /* option  on OS X */
 
+/*
+ * The right-hand modifiers are always set together with their plain
+ * masks above, which match either side of the key.
+ */
+#define KBM_RSHIFT_MASK 0x10
+#define KBM_RCTRL_MASK  0x20
+#define KBM_RSUPER_MASK 0x40
+#define KBM_RMETA_MASK  0x80
+#define KBM_RIGHT_MASKS 0xF0
+#define KBM_BASE_MASKS  0x0F
+
 /* check if kc is the keycode of a modifier */
 #define K_ISMOD(kc) \
 	((kc) == KEY_CTRL || (kc) == KEY_SHIFT || \
-	(kc) == KEY_SUPER || (kc) == KEY_META)
+	(kc) == KEY_SUPER || (kc) == KEY_META || \
+	(kc) == KEY_RCTRL || (kc) == KEY_RSHIFT || \
+	(kc) == KEY_RSUPER || (kc) == KEY_RMETA)
+
+/* check if kc is the keycode of a right-hand modifier */
+#define K_ISRMOD(kc) ((kc) >= KEY_RSHIFT && (kc) <= KEY_RMETA)
+
+/* check if kc is the keycode of a mouse button */
+#define K_ISBUTTON(kc) ((kc) >= KEY_BUTTON1 && (kc) <= KEY_BUTTON9)
 
 /* convert kbm codes and modmasks to OS-specific ones */
 #ifdef __linux__
@@ -182,7 +96,7 @@ void keymap_init(void);
 void keymap_free(void);
 
 /* keystr: return a string representation of key corresponding to keycode */
-char *keystr(uint8_t keycode, uint8_t mask);
+char *keystr(uint16_t keycode, uint8_t mask);
 
 /* lookup_keycode: return the kbm keycode of key */
 uint32_t lookup_keycode(const char *key);
@@ -195,23 +109,41 @@ uint32_t lookup_keycode(const char *key);
 
 #ifdef __linux__
 #include <X11/keysym.h>
+#include <X11/XF86keysym.h>
 #include <xcb/xcb.h>
 
-unsigned int kbm_to_keysym(uint8_t keycode);
+/*
+ * OS codes of mouse buttons and raw keycodes are told apart from keysyms,
+ * which never exceed 29 bits, by their top bits.
+ */
+#define X11_BUTTON(b)   (0x80000000 | (b))
+#define X11_ISBUTTON(c) (((c) & 0xC0000000) == 0x80000000)
+#define X11_KEYCODE(k)  (0x40000000 | (k))
+#define X11_ISKEYCODE(c) (((c) & 0xC0000000) == 0x40000000)
+
+/*
+ * X11 has no modifier masks for the right-hand keys, so a binding to one
+ * carries the X11 mask of the modifier with a copy of it shifted above
+ * the core masks. Only the low bits are used in grabs.
+ */
+#define X11_RIGHT(m)    ((m) << 16)
+#define X11_MODS(m)     ((m) & 0xFFFF)
+
+unsigned int kbm_to_keysym(uint16_t keycode);
 unsigned int kbm_to_xcb_masks(uint8_t modmask);
 #endif
 
 #if defined(__CYGWIN__) || defined (__MINGW32__)
 #include <Windows.h>
 
-unsigned int kbm_to_win32(uint8_t keycode);
+unsigned int kbm_to_win32(uint16_t keycode);
 unsigned int kbm_to_win_masks(uint8_t modmask);
 #endif
 
 #ifdef __APPLE__
 #include <Carbon/Carbon.h>
 
-unsigned int kbm_to_carbon(uint8_t keycode);
+unsigned int kbm_to_carbon(uint16_t keycode);
 unsigned int kbm_to_osx_masks(uint8_t modmask);
 #endif
 
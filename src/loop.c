@@ -0,0 +1,336 @@
+/*
+ * loop.c
+ * Copyright (C) 2016-2017 Alexei Frolov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "kbm.h"
+#include "loop.h"
+
+struct watch {
+	loop_fn         fn;     /* function to call when fd is ready */
+	void            *data;  /* argument passed to fn */
+};
+
+/*
+ * The pollfd array is passed to poll directly; watches[i] holds the
+ * callback for fds[i]. Removal swaps the last entry into the hole.
+ */
+static struct pollfd fds[LOOP_MAX_FDS];
+static struct watch watches[LOOP_MAX_FDS];
+static size_t nfds = 0;
+
+/* signals are received synchronously through a signalfd */
+static int sigfd = -1;
+static sigset_t sigs;
+static signal_fn handlers[NSIG];
+
+/*
+ * Active timers are kept in a binary min-heap ordered by deadline,
+ * each timer recording its own position so that it can be cancelled
+ * without a search. A single timerfd is armed for the earliest one.
+ */
+static struct timer **heap = NULL;
+static size_t nheap = 0;
+static size_t heapsz = 0;
+static int timerfd = -1;
+
+/* set while expired timers are run, which rearm the timerfd themselves */
+static int dispatching = 0;
+
+static void read_signals(int fd, void *data);
+static void run_timers(int fd, void *data);
+static void arm_timerfd(void);
+
+/* loop_add: watch fd for input, calling fn with data when it is ready */
+int loop_add(int fd, loop_fn fn, void *data)
+{
+	if (nfds == LOOP_MAX_FDS) {
+		fprintf(stderr, "error: too many open event sources\n");
+		return 1;
+	}
+
+	fds[nfds].fd = fd;
+	fds[nfds].events = POLLIN;
+	fds[nfds].revents = 0;
+	watches[nfds].fn = fn;
+	watches[nfds].data = data;
+	nfds++;
+
+	return 0;
+}
+
+/* loop_remove: stop watching fd */
+void loop_remove(int fd)
+{
+	size_t i;
+
+	for (i = 0; i < nfds; ++i) {
+		if (fds[i].fd == fd) {
+			nfds--;
+			fds[i] = fds[nfds];
+			watches[i] = watches[nfds];
+			return;
+		}
+	}
+}
+
+/*
+ * loop_signal:
+ * Call fn from the event loop whenever sig is received.
+ * The signal is blocked so that it is only delivered through sigfd.
+ */
+int loop_signal(int sig, signal_fn fn)
+{
+	int fd;
+
+	if (sigfd == -1)
+		sigemptyset(&sigs);
+	sigaddset(&sigs, sig);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	handlers[sig] = fn;
+
+	if ((fd = signalfd(sigfd, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		perror("signalfd");
+		return 1;
+	}
+	if (sigfd == -1) {
+		sigfd = fd;
+		return loop_add(sigfd, read_signals, NULL);
+	}
+
+	return 0;
+}
+
+/* loop_now: return the current monotonic time in nanoseconds */
+uint64_t loop_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* heap_set: place t at position i of the heap */
+static void heap_set(size_t i, struct timer *t)
+{
+	heap[i] = t;
+	t->index = i;
+}
+
+/* sift_up: move the timer at position i towards the root */
+static void sift_up(size_t i)
+{
+	struct timer *t;
+	size_t parent;
+
+	t = heap[i];
+	for (; i; i = parent) {
+		parent = (i - 1) / 2;
+		if (heap[parent]->deadline <= t->deadline)
+			break;
+		heap_set(i, heap[parent]);
+	}
+	heap_set(i, t);
+}
+
+/* sift_down: move the timer at position i towards the leaves */
+static void sift_down(size_t i)
+{
+	struct timer *t;
+	size_t child;
+
+	t = heap[i];
+	while ((child = 2 * i + 1) < nheap) {
+		if (child + 1 < nheap
+		    && heap[child + 1]->deadline < heap[child]->deadline)
+			child++;
+		if (t->deadline <= heap[child]->deadline)
+			break;
+		heap_set(i, heap[child]);
+		i = child;
+	}
+	heap_set(i, t);
+}
+
+/* heap_remove: take the timer at position i out of the heap */
+static void heap_remove(size_t i)
+{
+	struct timer *t;
+
+	heap[i]->index = TIMER_IDLE;
+	if (i == --nheap)
+		return;
+
+	t = heap[nheap];
+	heap_set(i, t);
+	if (i && heap[(i - 1) / 2]->deadline > t->deadline)
+		sift_up(i);
+	else
+		sift_down(i);
+}
+
+/* timer_init: prepare t to call fn on expiry */
+void timer_init(struct timer *t, timer_fn fn, void *data)
+{
+	t->deadline = 0;
+	t->late = 0;
+	t->index = TIMER_IDLE;
+	t->fn = fn;
+	t->data = data;
+}
+
+/* timer_start: schedule t to expire at deadline, rescheduling if active */
+int timer_start(struct timer *t, uint64_t deadline)
+{
+	if (timerfd == -1) {
+		timerfd = timerfd_create(CLOCK_MONOTONIC,
+		                         TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timerfd < 0) {
+			perror("timerfd_create");
+			return 1;
+		}
+		if (loop_add(timerfd, run_timers, NULL) != 0)
+			return 1;
+	}
+
+	if (TIMER_ACTIVE(t))
+		heap_remove(t->index);
+
+	if (nheap == heapsz) {
+		heapsz = heapsz ? heapsz * 2 : 64;
+		heap = realloc(heap, heapsz * sizeof *heap);
+	}
+
+	t->deadline = deadline;
+	heap_set(nheap++, t);
+	sift_up(t->index);
+
+	if (!dispatching && heap[0] == t)
+		arm_timerfd();
+	return 0;
+}
+
+/* timer_stop: cancel t if it is active */
+void timer_stop(struct timer *t)
+{
+	int first;
+
+	if (!TIMER_ACTIVE(t))
+		return;
+
+	first = t->index == 0;
+	heap_remove(t->index);
+	if (!dispatching && first)
+		arm_timerfd();
+}
+
+/*
+ * loop_poll:
+ * Wait up to timeout milliseconds for any watched file descriptor
+ * to become ready and run the callbacks of those which are.
+ * Return nonzero on an unrecoverable error.
+ */
+int loop_poll(int timeout)
+{
+	size_t i;
+	struct watch w;
+
+	if (poll(fds, nfds, timeout) < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("poll");
+		return 1;
+	}
+
+	/*
+	 * Walk backwards so that entries moved by a callback removing a
+	 * watch are ones which have already been handled. revents is
+	 * cleared before each callback so they are never handled twice.
+	 */
+	for (i = nfds; i-- > 0;) {
+		if (i >= nfds || !fds[i].revents)
+			continue;
+
+		fds[i].revents = 0;
+		w = watches[i];
+		if (w.fn)
+			w.fn(fds[i].fd, w.data);
+	}
+
+	return 0;
+}
+
+/* read_signals: run the handlers of all pending signals */
+static void read_signals(int fd, void *data)
+{
+	struct signalfd_siginfo si;
+
+	KBM_UNUSED(data);
+
+	while (read(fd, &si, sizeof si) == sizeof si) {
+		if (si.ssi_signo < NSIG && handlers[si.ssi_signo])
+			handlers[si.ssi_signo](si.ssi_signo);
+	}
+}
+
+/* run_timers: run the callbacks of all expired timers */
+static void run_timers(int fd, void *data)
+{
+	uint64_t expirations, now;
+	struct timer *t;
+
+	KBM_UNUSED(data);
+
+	while (read(fd, &expirations, sizeof expirations) > 0)
+		;
+
+	dispatching = 1;
+	now = loop_now();
+	while (nheap && heap[0]->deadline <= now) {
+		t = heap[0];
+		heap_remove(0);
+		t->late = now - t->deadline;
+		t->fn(t);
+		now = loop_now();
+	}
+	dispatching = 0;
+	arm_timerfd();
+}
+
+/* arm_timerfd: set the timerfd to fire at the earliest deadline */
+static void arm_timerfd(void)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	uint64_t deadline;
+
+	if (nheap) {
+		/* a zero expiry would disarm the timer */
+		deadline = heap[0]->deadline ? heap[0]->deadline : 1;
+		its.it_value.tv_sec = deadline / 1000000000;
+		its.it_value.tv_nsec = deadline % 1000000000;
+	}
+	if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+		perror("timerfd_settime");
+}
@@ -0,0 +1,83 @@
+/*
+ * loop.h
+ * Copyright (C) 2016-2017 Alexei Frolov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KBM_LOOP_H
+#define KBM_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* maximum number of file descriptors watched by the event loop */
+#define LOOP_MAX_FDS 256
+
+/* function called when a watched file descriptor becomes ready */
+typedef void (*loop_fn)(int fd, void *data);
+
+/* function called when a signal is received */
+typedef void (*signal_fn)(int sig);
+
+struct timer;
+
+/* function called when a timer expires */
+typedef void (*timer_fn)(struct timer *t);
+
+/* position of a timer which is not scheduled */
+#define TIMER_IDLE ((size_t)-1)
+
+#define TIMER_ACTIVE(t) ((t)->index != TIMER_IDLE)
+
+/*
+ * A one-shot timer. The structure is owned by the caller
+ * and must remain valid for as long as the timer is active.
+ */
+struct timer {
+	uint64_t        deadline;       /* expiry time, as returned by loop_now */
+	uint64_t        late;           /* how late the last expiry was run */
+	size_t          index;          /* position in the timer heap */
+	timer_fn        fn;             /* function to call on expiry */
+	void            *data;          /* user data */
+};
+
+/*
+ * loop_add: watch fd for input, calling fn with data when it is ready.
+ * A NULL fn only wakes up the loop.
+ */
+int loop_add(int fd, loop_fn fn, void *data);
+
+/* loop_remove: stop watching fd */
+void loop_remove(int fd);
+
+/* loop_signal: call fn from the event loop whenever sig is received */
+int loop_signal(int sig, signal_fn fn);
+
+/* loop_now: return the current monotonic time in nanoseconds */
+uint64_t loop_now(void);
+
+/* timer_init: prepare t to call fn on expiry */
+void timer_init(struct timer *t, timer_fn fn, void *data);
+
+/* timer_start: schedule t to expire at deadline, rescheduling if active */
+int timer_start(struct timer *t, uint64_t deadline);
+
+/* timer_stop: cancel t if it is active */
+void timer_stop(struct timer *t);
+
+/* loop_poll: wait for watched file descriptors and dispatch their callbacks */
+int loop_poll(int timeout);
+
+#endif /* KBM_LOOP_H */
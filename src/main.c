@@ -32,6 +32,7 @@ extern int NSApplicationMain(int argc, char **argv);
 static const struct option long_opts[] = {
 	{ "disable", no_argument, 0, 'd' },
 	{ "help", no_argument, 0, 'h' },
+	{ "immediate", no_argument, 0, 'i' },
 	{ "no-notifications", no_argument, 0, 'n' },
 	{ "version", no_argument, 0, 'v' },
 	{ 0, 0, 0, 0 }
@@ -39,8 +40,22 @@ static const struct option long_opts[] = {
 
 struct _program_info kbm_info;
 
+#ifdef __linux__
+/* each keymap file given is loaded as a profile, switched between at will */
+#define USAGE_FILES "[FILE]..."
+
+static struct keymap maps[KBM_MAX_PROFILES];
+static const char *names[KBM_MAX_PROFILES];
+static size_t nmaps;
+#else
+#define USAGE_FILES "[FILE]"
+#endif
+
 static void parseopts(int argc, char **argv);
 static void print_help(void);
+#ifdef __linux__
+static void free_maps(int keys);
+#endif
 #if defined(__linux__) || defined(__CYGWIN__) || defined (__MINGW32__)
 static int run(void);
 #endif
@@ -83,10 +98,11 @@ static void parseopts(int argc, char **argv)
 	kbm_info.keys_active = 1;
 	kbm_info.keys_toggled = 1;
 	kbm_info.notifications = 1;
+	kbm_info.immediate = 0;
 	kbm_info.curr_file = NULL;
 	memset(&kbm_info.map, 0, sizeof kbm_info.map);
 
-	while ((c = getopt_long(argc, argv, "dhnv", long_opts, NULL)) != EOF) {
+	while ((c = getopt_long(argc, argv, "dhinv", long_opts, NULL)) != EOF) {
 		switch (c) {
 		case 'd':
 			kbm_info.keys_toggled = 0;
@@ -94,6 +110,9 @@ static void parseopts(int argc, char **argv)
 		case 'h':
 			print_help();
 			exit(0);
+		case 'i':
+			kbm_info.immediate = 1;
+			break;
 		case 'n':
 			kbm_info.notifications = 0;
 			break;
@@ -106,7 +125,7 @@ static void parseopts(int argc, char **argv)
 			       "version 3 or later.\n");
 			exit(0);
 		default:
-			fprintf(stderr, "usage: %s [FILE]\n", argv[0]);
+			fprintf(stderr, "usage: %s " USAGE_FILES "\n", argv[0]);
 			exit(1);
 		}
 	}
@@ -114,6 +133,22 @@ static void parseopts(int argc, char **argv)
 	keymap_init();
 	reserve_symbols();
 
+#ifdef __linux__
+	if (argc - optind > KBM_MAX_PROFILES) {
+		fprintf(stderr, "%s: at most " KBM_STR(KBM_MAX_PROFILES)
+		        " files can be loaded\n", argv[0]);
+		goto err_cleanup;
+	}
+	for (; optind < argc; ++optind) {
+		if (parse_file(argv[optind], &maps[nmaps], stderr) != 0)
+			goto err_cleanup;
+
+		names[nmaps] = basename(argv[optind]);
+		if (strcmp(names[nmaps], "-") == 0)
+			names[nmaps] = "stdin";
+		nmaps++;
+	}
+#else
 	if (optind != argc) {
 		if (optind != argc - 1) {
 			fprintf(stderr, "usage: %s [FILE]\n", argv[0]);
@@ -126,15 +161,25 @@ static void parseopts(int argc, char **argv)
 		if (strcmp(kbm_info.curr_file, "-") == 0)
 			kbm_info.curr_file = "stdin";
 	}
+#endif
 
 	if (init_display() != 0)
 		goto err_cleanup;
 
+#ifdef __linux__
+	load_profiles(maps, names, nmaps);
+#else
 	load_keys(kbm_info.map.keys);
+#endif
 	return;
 
 err_cleanup:
+#ifdef __linux__
+	free_maps(1);
+#else
 	free_windows(&kbm_info.map);
+	free_layers(&kbm_info.map);
+#endif
 	keymap_free();
 	free_symbols();
 	exit(1);
@@ -146,7 +191,12 @@ static int run(void)
 	start_listening();
 	unload_keys();
 	close_display();
+#ifdef __linux__
+	free_maps(0);
+#else
 	free_windows(&kbm_info.map);
+	free_layers(&kbm_info.map);
+#endif
 	keymap_free();
 	free_symbols();
 
@@ -156,14 +206,36 @@ static int run(void)
 
 static void print_help(void)
 {
-	printf("usage: " PROGRAM_NAME " [OPTION]... [FILE]\n");
+	printf("usage: " PROGRAM_NAME " [OPTION]... " USAGE_FILES "\n");
 	printf(PROGRAM_NAME " - a simple hotkey mapper\n\n");
 	printf("    -d, --disable\n");
 	printf("        disable hotkeys on load\n");
 	printf("    -h, --help\n");
 	printf("        display this help text and exit\n");
+	printf("    -i, --immediate\n");
+	printf("        send each simulated event as soon as it is generated\n");
 	printf("    -n, --no-notifications\n");
 	printf("        don't send desktop notification when keys are toggled\n");
 	printf("    -v, --version\n");
 	printf("        print version information and exit\n");
+#ifdef __linux__
+	printf("\nEach FILE is loaded as a profile, the first in use. "
+	       "Sending SIGUSR2\nswitches to the next profile.\n");
+#endif
 }
+
+#ifdef __linux__
+/* free_maps: free the keymaps of the files given, with their keys if set */
+static void free_maps(int keys)
+{
+	size_t i;
+
+	for (i = 0; i < nmaps; ++i) {
+		if (keys && maps[i].keys)
+			free_keys(maps[i].keys);
+		free_windows(&maps[i]);
+		free_layers(&maps[i]);
+	}
+	nmaps = 0;
+}
+#endif /* __linux__ */
@@ -19,12 +19,15 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include "display.h"
 #include "error.h"
 #include "parser.h"
 
-#if defined(__linux__) || defined(__APPLE__)
 #include <sys/types.h>
 #include <sys/stat.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <limits.h>
 #include <unistd.h>
 #endif
 
@@ -33,21 +36,94 @@
 
 #define ISMOD(lexeme) \
 	((lexeme) == '^' || (lexeme) == '!' \
-	 || (lexeme) == '~' || (lexeme) == '@')
+	 || (lexeme) == '~' || (lexeme) == '@' || (lexeme) == '*')
+
+/* modifier bit of a parsed key which was declared with a wildcard */
+#define ANY_MODS 0x100
+
+/* valid nonalphanumeric key lexemes */
+#define MISC_KEYS "`-=[]\\;',./"
+
+/* check if tok can begin a key declaration */
+#define IS_KEY_START(tok) \
+	((tok)->tag == TOK_MOD || (tok)->tag == TOK_ID \
+	 || (tok)->tag == TOK_NUM \
+	 || ((tok)->tag < TOK_NUM && strchr(MISC_KEYS, (tok)->tag)))
 
 #define IS_RESERVED(tok) (tok->tag == TOK_FUNC || tok->tag == TOK_QUAL)
 
+/* check if tok separates the tapped and held operations of a binding */
+#define IS_HOLD(tok) \
+	((tok)->tag == TOK_FUNC && strcmp((tok)->str, "hold") == 0)
+
+/* toggle doubles as a qualifier following an exec operation */
+#define IS_QUAL(tok, op) \
+	(tok->tag == TOK_QUAL || (op == OP_EXEC && tok->tag == TOK_FUNC \
+	                          && strcmp(tok->str, "toggle") == 0))
+
+/* check if tok opens a layer block or begins a layer operation */
+#define IS_LAYER(tok) \
+	((tok)->tag == TOK_FUNC && strcmp((tok)->str, "layer") == 0)
+
+/* check if tok includes the bindings of another file */
+#define IS_INCLUDE(tok) \
+	((tok)->tag == TOK_GDEF && strcmp((tok)->str, "include") == 0)
+
+/* check if tok binds a double tap or long press of a key */
+#define IS_GESTURE(tok) \
+	((tok)->tag == TOK_QUAL && (strcmp((tok)->str, "double") == 0 \
+	                            || strcmp((tok)->str, "long") == 0))
+
 /* set bitmask mask to mods with duplicate notice */
 #define SET_MODS(mods, mask, lex) \
 	do { \
-		if (mods & mask) \
+		if ((mods) & (mask)) \
 			note_duplicate(lex); \
-		mods |= mask; \
+		(mods) |= (mask); \
 	} while (0)
 
 /* hash table of reserved words */
 static struct token *reserved;
 
+/*
+ * Included files are parsed into keymaps of their own, kept by path along
+ * with the modification time and size of the file, and each file which
+ * includes one gets a copy of its bindings. A file is checked once in
+ * each load, a call of parse_file, and only parsed again if it or a file
+ * it includes has changed since.
+ */
+enum {
+	INC_FAILED,			/* the last parse of the file failed */
+	INC_PARSING,			/* being parsed, so included by itself */
+	INC_PARSED
+};
+
+struct include_dep {
+	struct include	*inc;		/* file included */
+	unsigned int	version;	/* its version when it was copied */
+};
+
+struct include {
+	char			*path;		/* resolved path of the file */
+	time_t			mtime;
+#ifdef __linux__
+	long			mtime_ns;
+#endif
+	off_t			size;
+	unsigned int		load;		/* last load which checked it */
+	unsigned int		version;	/* incremented on each parse */
+	int			state;		/* INC_* */
+	uint32_t		defined;	/* layers with blocks in the file */
+	struct keymap		map;		/* bindings parsed from the file */
+	struct include_dep	*deps;		/* files it includes */
+	size_t			ndeps;
+	UT_hash_handle		hh;
+};
+
+static struct include *includes;
+static unsigned int load;
+static char *root_path;		/* resolved path of the file loaded */
+
 static FILE *open_file(const char *path);
 static struct token *scan(FILE *f, struct lexer *lex);
 static struct token *read_str(FILE *f, struct lexer *lex);
@@ -56,12 +132,38 @@ static void free_token(struct token *t);
 static void reserve(struct token *word);
 static char *next_line(FILE *f, struct lexer *lex);
 static int next_token(FILE *f, struct lexer *lex, int free, int err);
+static void free_include(struct include *inc);
+static char *resolve_path(char *path);
+
+struct layer_refs;
 
-static int parse_func(FILE *f, struct lexer *lex, uint8_t *op, uint64_t *args);
+static int parse_func(FILE *f, struct lexer *lex, struct layer_refs *refs,
+                      uint8_t *op, uint64_t *args);
+static int parse_layer_op(FILE *f, struct lexer *lex, struct layer_refs *refs,
+                          uint64_t *args);
+static int parse_profile(FILE *f, struct lexer *lex, uint64_t *args);
 static int parse_num(FILE *f, struct lexer *lex, uint32_t *num);
+static int parse_button(FILE *f, struct lexer *lex, uint64_t *args);
+static int parse_glide(FILE *f, struct lexer *lex, uint8_t *op, uint64_t *args);
+static int parse_move(FILE *f, struct lexer *lex, uint64_t *args);
+static int parse_jumpto(FILE *f, struct lexer *lex, uint64_t *args);
+static int parse_scroll(FILE *f, struct lexer *lex, uint64_t *args);
 static int parse_exec(FILE *f, struct lexer *lex, uint64_t *retval);
-static int parse_qual(FILE *f, struct lexer *lex, uint32_t *flags);
+static int parse_qual(FILE *f, struct lexer *lex, uint32_t *flags,
+                      uint8_t op, uint64_t args, unsigned int *ms);
+#ifdef __linux__
+static int parse_text(FILE *f, struct lexer *lex, uint64_t *retval);
+static void compile_exec(struct exec_cmd *cmd);
+#endif
 static int validkey(uint64_t *key, struct lexer *lex);
+static int seq_key_ok(uint64_t key, struct lexer *lex);
+static int parse_hold(FILE *f, struct lexer *lex, uint64_t key,
+                      uint32_t kind, size_t ntap, unsigned int *ms);
+static int chord_key_ok(uint64_t key, int first, struct lexer *lex);
+static int gesture_ok(uint64_t key, uint32_t kind, size_t ntap,
+                      struct lexer *lex);
+static int parse_ms(FILE *f, struct lexer *lex, unsigned int *ms,
+                    unsigned int max, const char *msg);
 
 /* reserve_symbols: populate the reserved hashtable with keyword tokens */
 void reserve_symbols(void)
@@ -69,24 +171,55 @@ void reserve_symbols(void)
 	reserved = NULL;
 	reserve(create_token(TOK_FUNC, "click"));
 	reserve(create_token(TOK_FUNC, "rclick"));
+	reserve(create_token(TOK_FUNC, "mclick"));
+	reserve(create_token(TOK_FUNC, "scroll"));
+	reserve(create_token(TOK_FUNC, "press"));
+	reserve(create_token(TOK_FUNC, "release"));
+	reserve(create_token(TOK_FUNC, "drag"));
 	reserve(create_token(TOK_FUNC, "jump"));
+	reserve(create_token(TOK_FUNC, "jumpto"));
+	reserve(create_token(TOK_FUNC, "move"));
 	reserve(create_token(TOK_FUNC, "key"));
 	reserve(create_token(TOK_FUNC, "toggle"));
 	reserve(create_token(TOK_FUNC, "quit"));
 	reserve(create_token(TOK_FUNC, "exec"));
+	reserve(create_token(TOK_FUNC, "macro"));
+	reserve(create_token(TOK_FUNC, "wait"));
+	reserve(create_token(TOK_FUNC, "type"));
+	reserve(create_token(TOK_FUNC, "hold"));
+	reserve(create_token(TOK_FUNC, "layer"));
+	reserve(create_token(TOK_FUNC, "profile"));
 	reserve(create_token(TOK_QUAL, "norepeat"));
+	reserve(create_token(TOK_QUAL, "single"));
+	reserve(create_token(TOK_QUAL, "max"));
+	reserve(create_token(TOK_QUAL, "capture"));
+	reserve(create_token(TOK_QUAL, "repeat"));
+	reserve(create_token(TOK_QUAL, "double"));
+	reserve(create_token(TOK_QUAL, "long"));
 	reserve(create_token(TOK_GDEF, "active_window"));
+	reserve(create_token(TOK_GDEF, "sequence_timeout"));
+	reserve(create_token(TOK_GDEF, "chord_window"));
+	reserve(create_token(TOK_GDEF, "include"));
 }
 
 /* free_symbols: free all tokens in the reserved hashtable */
 void free_symbols(void)
 {
 	struct token *t, *tmp;
+	struct include *inc, *itmp;
 
 	HASH_ITER(hh, reserved, t, tmp) {
 		HASH_DEL(reserved, t);
 		free_token(t);
 	}
+
+	/* the cached included files are kept until the parser is done */
+	HASH_ITER(hh, includes, inc, itmp) {
+		HASH_DEL(includes, inc);
+		free_include(inc);
+		free(inc->path);
+		free(inc);
+	}
 }
 
 #if defined(__CYGWIN__) || defined (__MINGW32__)
@@ -102,8 +235,37 @@ const char *basename(const char *path)
 	return s ? s + 1 : path;
 }
 
+/* location of the key of a parsed binding, for later warnings */
+struct binding_pos {
+	unsigned int	line;
+	long		col;
+};
+
+/* the layers named in a file, numbered from 1 in the order of naming */
+struct layer_refs {
+	struct keymap		*k;		/* keymap holding their names */
+	struct binding_pos	pos[KBM_MAX_LAYERS + 1]; /* first naming */
+	uint32_t		defined;	/* bitmask of layers with blocks */
+	unsigned int		curr;		/* layer of the open block, or 0 */
+};
+
+static int parse_keymap(const char *path, struct keymap *k, FILE *err,
+                        struct include *self);
 static void parse_globals(FILE *f, struct lexer *lex, struct keymap *k);
-static struct hotkey *parse_binding(FILE *f, struct lexer *lex);
+static int parse_layer(FILE *f, struct lexer *lex, struct layer_refs *refs);
+static unsigned int find_layer(struct lexer *lex, struct layer_refs *refs);
+static unsigned int name_layer(struct lexer *lex, struct layer_refs *refs,
+                               const char *name);
+static int parse_include(FILE *f, struct lexer *lex, struct layer_refs *refs,
+                         struct include *self, struct hotkey **keys);
+static void load_include(struct include *inc, FILE *err);
+static struct hotkey *copy_binding(const struct hotkey *hk,
+                                   const uint8_t *layers);
+static void free_ops(struct operation *ops, size_t nops);
+static struct hotkey *parse_binding(FILE *f, struct lexer *lex,
+                                    struct layer_refs *refs);
+static void check_bindings(struct lexer *lex, struct hotkey *head,
+                           const struct binding_pos *pos);
 
 /*
  * parse_file:
@@ -113,14 +275,41 @@ static struct hotkey *parse_binding(FILE *f, struct lexer *lex);
  */
 int parse_file(const char *path, struct keymap *k, FILE *err)
 {
-	struct hotkey *hk;
+	int ret;
+
+	load++;
+	root_path = resolve_path(strdup(path));
+	ret = parse_keymap(path, k, err, NULL);
+	free(root_path);
+	root_path = NULL;
+	return ret;
+}
+
+/*
+ * parse_keymap:
+ * Parse the file at path into k. If the file is included by another,
+ * self is its entry in the cache of included files.
+ */
+static int parse_keymap(const char *path, struct keymap *k, FILE *err,
+                        struct include *self)
+{
+	struct hotkey *hk, *inc_keys;
 	struct lexer lex;
+	struct binding_pos *pos;
+	struct layer_refs refs;
+	size_t n, size;
+	unsigned int i;
 	FILE *f;
 	int ret;
 
 	lex.file_path = path;
 	lex.err_file = err;
 	memset(k, 0, sizeof *k);
+	memset(&refs, 0, sizeof refs);
+	refs.k = k;
+	pos = NULL;
+	inc_keys = NULL;
+	n = size = 0;
 
 	if (strcmp(path, "-") == 0) {
 		f = stdin;
@@ -130,8 +319,9 @@ int parse_file(const char *path, struct keymap *k, FILE *err)
 	}
 
 	lex.line_num = 0;
+	ret = 0;
 	if (!next_line(f, &lex))
-		return 0;
+		goto cleanup;
 
 	/* grab the first token */
 	next_token(f, &lex, 0, 0);
@@ -145,21 +335,68 @@ int parse_file(const char *path, struct keymap *k, FILE *err)
 
 	ret = 0;
 	while (lex.curr) {
-		if (!(hk = parse_binding(f, &lex))) {
-			if (lex.curr && !IS_RESERVED(lex.curr))
-				free_token(lex.curr);
-			if (k->keys)
-				free_keys(k->keys);
-			free_windows(k);
-			ret = 1;
-			goto cleanup;
+		/* a closing brace ends the open layer block */
+		if (refs.curr && lex.curr->tag == '}') {
+			refs.curr = 0;
+			next_token(f, &lex, 1, 0);
+			continue;
 		}
+		if (IS_LAYER(lex.curr)) {
+			if (parse_layer(f, &lex, &refs) != 0)
+				goto err;
+			continue;
+		}
+		if (IS_INCLUDE(lex.curr)) {
+			if (parse_include(f, &lex, &refs, self, &inc_keys) != 0)
+				goto err;
+			continue;
+		}
+
+		if (n == size) {
+			size = size ? size * 2 : 32;
+			pos = realloc(pos, size * sizeof *pos);
+		}
+		pos[n].line = lex.line_num;
+		pos[n].col = CURR_START((&lex));
+
+		if (!(hk = parse_binding(f, &lex, &refs)))
+			goto err;
 		PRINT_DEBUG("hotkey parsed: %s\n",
 		            keystr(hk->kbm_code, hk->kbm_modmask));
 		add_hotkey(&k->keys, hk);
+		n++;
+	}
+	if (refs.curr) {
+		err_eof(&lex);
+		goto err;
 	}
+	check_bindings(&lex, k->keys, pos);
+	for (i = 1; i <= k->nlayers; ++i) {
+		if (!(refs.defined & 1 << i))
+			warn_binding(&lex, refs.pos[i].line, refs.pos[i].col,
+			             "no block defines layer",
+			             k->layers[i - 1]);
+	}
+
+	/* the file's own bindings take precedence over those included */
+	add_hotkey(&k->keys, inc_keys);
+	if (self)
+		self->defined = refs.defined;
+	goto cleanup;
+
+err:
+	if (lex.curr && !IS_RESERVED(lex.curr))
+		free_token(lex.curr);
+	if (k->keys)
+		free_keys(k->keys);
+	if (inc_keys)
+		free_keys(inc_keys);
+	free_windows(k);
+	free_layers(k);
+	ret = 1;
 
 cleanup:
+	free(pos);
 	fclose(f);
 	return ret;
 }
@@ -455,10 +692,48 @@ static void parse_globals(FILE *f, struct lexer *lex, struct keymap *k)
 				return;
 			}
 			parse_windows(f, lex, k);
+		} else if (strcmp(lex->curr->str, "sequence_timeout") == 0) {
+			if (parse_ms(f, lex, &k->seq_timeout,
+			             KBM_MAX_SEQ_TIMEOUT,
+			             "sequence_timeout must be between 1 and "
+			             KBM_STR(KBM_MAX_SEQ_TIMEOUT)) != 0)
+				return;
+		} else if (strcmp(lex->curr->str, "chord_window") == 0) {
+			if (parse_ms(f, lex, &k->chord_window,
+			             KBM_MAX_CHORD_WINDOW,
+			             "chord_window must be between 1 and "
+			             KBM_STR(KBM_MAX_CHORD_WINDOW)) != 0)
+				return;
+		} else {
+			/* an include is read along with the bindings */
+			return;
 		}
 	}
 }
 
+/*
+ * parse_ms:
+ * Read the duration following a global definition into ms. On error,
+ * print msg and discard the current token.
+ */
+static int parse_ms(FILE *f, struct lexer *lex, unsigned int *ms,
+                    unsigned int max, const char *msg)
+{
+	if (next_token(f, lex, 0, 1) != 0)
+		return 1;
+
+	if (lex->curr->tag != TOK_NUM || lex->curr->val < 1
+	    || (unsigned int)lex->curr->val > max) {
+		err_generic(lex, msg);
+		free_token(lex->curr);
+		lex->curr = NULL;
+		return 1;
+	}
+	*ms = lex->curr->val;
+	next_token(f, lex, 1, 0);
+	return 0;
+}
+
 static int parse_key(FILE *f, struct lexer *lex,
                      uint64_t *retval, int failnext);
 static int parse_mod(FILE *f, struct lexer *lex,
@@ -467,191 +742,979 @@ static int parse_id(FILE *f, struct lexer *lex,
                     uint64_t *retval, int failnext);
 static int parse_keynum(FILE *f, struct lexer *lex,
                         uint64_t *retval, int failnext);
+static int parse_rawkey(FILE *f, struct lexer *lex,
+                        uint64_t *retval, int failnext);
 static int parse_misc(FILE *f, struct lexer *lex,
                       uint64_t *retval, int failnext);
 
 /*
- * parse_binding:
- * Read a complete keybinding declaration from f.
- * The format of a keybinding is KEY -> FUNC [ARGS].
- * Return a struct hotkey representing the binding.
+ * parse_layer:
+ * Read the start of a layer block, layer NAME {. The bindings up to the
+ * closing brace are only active while the layer is.
  */
-static struct hotkey *parse_binding(FILE *f, struct lexer *lex)
+static int parse_layer(FILE *f, struct lexer *lex, struct layer_refs *refs)
 {
-	uint64_t key, args;
-	uint32_t flags;
-	uint8_t op;
-
-	key = args = flags = op = 0;
-	if (parse_key(f, lex, &key, 1) != 0 || !validkey(&key, lex))
-		return NULL;
+#ifndef __linux__
+	KBM_UNUSED(f);
+	KBM_UNUSED(refs);
+	err_generic(lex, "layers are not supported on this platform");
+	return 1;
+#else
+	unsigned int layer;
 
-	/* match the arrow following the key */
-	if (lex->curr->tag != TOK_ARROW) {
-		err_generic(lex, "expected '->' after key");
-		return NULL;
+	if (refs->curr) {
+		err_generic(lex, "layers cannot be nested");
+		return 1;
 	}
-	if (next_token(f, lex, 1, 1) != 0)
-		return NULL;
-
-	/* match the hotkey operation */
-	if (lex->curr->tag != TOK_FUNC) {
-		err_generic(lex, "expected function after '->'");
-		return NULL;
+	if (next_token(f, lex, 0, 1) != 0)
+		return 1;
+	if (lex->curr->tag != TOK_ID) {
+		err_generic(lex, "expected layer name");
+		return 1;
 	}
-	if (parse_func(f, lex, &op, &args) != 0)
-		return NULL;
-
-	if (lex->curr && lex->curr->tag == TOK_QUAL) {
-		if (parse_qual(f, lex, &flags) != 0)
-			return NULL;
+	if (!(layer = find_layer(lex, refs)))
+		return 1;
+	if (next_token(f, lex, 1, 1) != 0)
+		return 1;
+	if (lex->curr->tag != '{') {
+		err_generic(lex, "expected '{' after layer name");
+		return 1;
 	}
+	refs->defined |= 1 << layer;
+	refs->curr = layer;
+	return next_token(f, lex, 1, 1);
+#endif
+}
 
-	return create_hotkey(key & 0xFFFFFFFF,
-	                     (key >> 32) & 0xFFFFFFFF,
-	                     op, args, flags);
+/*
+ * find_layer:
+ * Return the number of the layer named by the current token, naming
+ * a new one if needed. Return 0 if there are too many layers.
+ */
+static unsigned int find_layer(struct lexer *lex, struct layer_refs *refs)
+{
+	return name_layer(lex, refs, lex->curr->str);
 }
 
-/* parse_key: parse a key declaration and its modifiers */
-static int parse_key(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+/*
+ * name_layer:
+ * Return the number of the layer called name, naming a new one at the
+ * current token if needed. Return 0 if there are too many layers.
+ */
+static unsigned int name_layer(struct lexer *lex, struct layer_refs *refs,
+                               const char *name)
 {
-	/* valid nonalphanumeric key lexemes */
-	static const char *misc_keys = "`-=[]\\;',./";
+	struct keymap *k;
+	size_t i;
 
-	if (lex->curr->tag == TOK_MOD) {
-		if (parse_mod(f, lex, retval, failnext) != 0)
-			return 1;
-	} else if (lex->curr->tag == TOK_ID) {
-		if (parse_id(f, lex, retval, failnext) != 0)
-			return 1;
-	} else if (lex->curr->tag == TOK_NUM) {
-		if (parse_keynum(f, lex, retval, failnext) != 0)
-			return 1;
-	} else if (strchr(misc_keys, lex->curr->tag)) {
-		if (parse_misc(f, lex, retval, failnext) != 0)
-			return 1;
-	} else {
-		err_invkey(lex);
-		return 1;
+	k = refs->k;
+	for (i = 0; i < k->nlayers; ++i) {
+		if (strcmp(k->layers[i], name) == 0)
+			return i + 1;
 	}
-	return 0;
+	if (k->nlayers == KBM_MAX_LAYERS) {
+		err_generic(lex, "too many layers - the limit is "
+		                 KBM_STR(KBM_MAX_LAYERS));
+		return 0;
+	}
+
+	k->layers = realloc(k->layers, (k->nlayers + 1) * sizeof *k->layers);
+	k->layers[k->nlayers++] = strdup(name);
+	refs->pos[k->nlayers].line = lex->line_num;
+	refs->pos[k->nlayers].col = CURR_START(lex);
+	return k->nlayers;
 }
 
-/* parse_mod: process a token of type MOD */
-static int parse_mod(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+/*
+ * include_path:
+ * Return the path of the file name included by the file at from, which
+ * is relative to the directory of from unless it is absolute.
+ */
+static char *include_path(const char *from, const char *name)
 {
-	uint32_t *mods;
-
-	mods = (uint32_t *)retval + 1;
+	const char *dir;
+	char *path;
+	size_t len;
+
+	dir = basename(from);
+	len = name[0] == PATH_SEP || strcmp(from, "<stdin>") == 0
+	      ? 0 : (size_t)(dir - from);
+	path = malloc(len + strlen(name) + 1);
+	memcpy(path, from, len);
+	strcpy(path + len, name);
+	return resolve_path(path);
+}
 
-	/* mark start of token for potential error reporting */
-	strcpy(lex->err_line, lex->line);
-	lex->err_num = lex->line_num;
-	lex->err_pos = lex->err_line + CURR_START(lex);
-	lex->err_len = lex->curr->len;
+/*
+ * resolve_path:
+ * Return the canonical form of the allocated path, so that the same file
+ * reached through different paths is parsed once.
+ */
+static char *resolve_path(char *path)
+{
+#if defined(__linux__) || defined(__APPLE__)
+	char real[PATH_MAX];
 
-	switch (lex->curr->val) {
-	case '^':
-		SET_MODS(*mods, KBM_CTRL_MASK, lex);
-		break;
-	case '!':
-		SET_MODS(*mods, KBM_SHIFT_MASK, lex);
-		break;
-	case '@':
-		SET_MODS(*mods, KBM_SUPER_MASK, lex);
-		break;
-	case '~':
-		SET_MODS(*mods, KBM_META_MASK, lex);
-		break;
-	default:
-		return 1;
+	if (realpath(path, real)) {
+		free(path);
+		path = strdup(real);
 	}
-
-	if (next_token(f, lex, 1, 1) != 0)
-		return 1;
-
-	if (lex->curr->tag == TOK_MOD)
-		return parse_mod(f, lex, retval, failnext);
-
-	return parse_key(f, lex, retval, failnext);
+#endif
+	return path;
 }
 
-static int parse_id(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+/*
+ * parse_include:
+ * Read an include statement, include "FILE", and copy the bindings of
+ * the file into the list keys. The layers of the file are named in the
+ * including file, and its global definitions are not used.
+ */
+static int parse_include(FILE *f, struct lexer *lex, struct layer_refs *refs,
+                         struct include *self, struct hotkey **keys)
 {
-	uint32_t *key, *mods;
+	struct include *inc;
+	struct hotkey *hk;
+	uint8_t layers[KBM_MAX_LAYERS + 1];
+	size_t i;
+	char *path;
 
-	key = (uint32_t *)retval;
-	mods = (uint32_t *)retval + 1;
-	if (!(*key = lookup_keycode(lex->curr->str))) {
-		err_invkey(lex);
+	if (refs->curr) {
+		err_generic(lex, "include cannot be inside a layer");
+		return 1;
+	}
+	if (next_token(f, lex, 0, 1) != 0)
+		return 1;
+	if (lex->curr->tag != TOK_STRLIT) {
+		err_generic(lex, "expected file name after include");
 		return 1;
 	}
 
-	if (K_ISMOD(*key)) {
-		/* mark start of token for potential error reporting */
-		strcpy(lex->err_line, lex->line);
-		lex->err_num = lex->line_num;
-		lex->err_pos = lex->err_line + CURR_START(lex);
-		lex->err_len = lex->curr->len;
+	path = include_path(lex->file_path, lex->curr->str);
+	/* the file loaded is parsed outside the cache */
+	if (strcmp(path, root_path) == 0) {
+		free(path);
+		err_generic(lex, "circular include of file");
+		return 1;
+	}
+	HASH_FIND_STR(includes, path, inc);
+	if (inc) {
+		free(path);
+	} else {
+		inc = calloc(1, sizeof *inc);
+		inc->path = path;
+		inc->state = INC_FAILED;
+		HASH_ADD_KEYPTR(hh, includes, inc->path, strlen(inc->path), inc);
 	}
 
-	if (next_token(f, lex, 1, failnext) != 0)
-		return failnext;
+	load_include(inc, lex->err_file);
+	if (inc->state == INC_PARSING) {
+		err_generic(lex, "circular include of file");
+		return 1;
+	}
+	if (inc->state == INC_FAILED) {
+		err_generic(lex, "errors in included file");
+		return 1;
+	}
 
-	if (K_ISMOD(*key) && lex->curr->tag == '-') {
-		switch (*key) {
-		case KEY_CTRL:
-			SET_MODS(*mods, KBM_CTRL_MASK, lex);
-			break;
-		case KEY_SHIFT:
-			SET_MODS(*mods, KBM_SHIFT_MASK, lex);
-			break;
-		case KEY_SUPER:
-			SET_MODS(*mods, KBM_SUPER_MASK, lex);
-			break;
-		case KEY_META:
-			SET_MODS(*mods, KBM_META_MASK, lex);
-			break;
-		}
-		if (next_token(f, lex, 1, 1) != 0)
+	layers[0] = 0;
+	for (i = 0; i < inc->map.nlayers; ++i) {
+		if (!(layers[i + 1] = name_layer(lex, refs,
+		                                 inc->map.layers[i])))
 			return 1;
+		if (inc->defined & 1 << (i + 1))
+			refs->defined |= 1 << layers[i + 1];
+	}
 
-		return parse_key(f, lex, retval, failnext);
+	while (*keys)
+		keys = &(*keys)->next;
+	for (hk = inc->map.keys; hk; hk = hk->next) {
+		*keys = copy_binding(hk, layers);
+		keys = &(*keys)->next;
 	}
 
+	if (self) {
+		self->deps = realloc(self->deps, (self->ndeps + 1)
+		                                 * sizeof *self->deps);
+		self->deps[self->ndeps].inc = inc;
+		self->deps[self->ndeps++].version = inc->version;
+	}
+	next_token(f, lex, 1, 0);
 	return 0;
 }
 
-static int parse_keynum(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+/*
+ * load_include:
+ * Bring the cached parse of included file inc up to date, parsing it
+ * again if the file or any file it includes has changed.
+ */
+static void load_include(struct include *inc, FILE *err)
 {
-	uint32_t *key;
+	struct stat st;
+	size_t i;
+	int stale;
 
-	key = (uint32_t *)retval;
-	if (lex->curr->val + KEY_0 > KEY_9) {
-		err_invkey(lex);
-		return 1;
+	if (inc->load == load)
+		return;
+	inc->load = load;
+
+	stale = inc->state != INC_PARSED || stat(inc->path, &st) != 0
+	        || st.st_mtime != inc->mtime || st.st_size != inc->size;
+#ifdef __linux__
+	stale = stale || st.st_mtim.tv_nsec != inc->mtime_ns;
+#endif
+	for (i = 0; !stale && i < inc->ndeps; ++i) {
+		load_include(inc->deps[i].inc, err);
+		stale = inc->deps[i].inc->version != inc->deps[i].version;
+	}
+	if (!stale)
+		return;
+
+	free_include(inc);
+	if (stat(inc->path, &st) == 0) {
+		inc->mtime = st.st_mtime;
+		inc->size = st.st_size;
+#ifdef __linux__
+		inc->mtime_ns = st.st_mtim.tv_nsec;
+#endif
 	}
+	inc->version++;
+	inc->state = INC_PARSING;
+	PRINT_DEBUG("parsing included file %s\n", inc->path);
+	inc->state = parse_keymap(inc->path, &inc->map, err, inc) != 0
+	             ? INC_FAILED : INC_PARSED;
+}
 
-	*key = lex->curr->val + KEY_0;
-	if (next_token(f, lex, 1, failnext) != 0)
-		return failnext;
-	return 0;
+/* free_include: free the cached parse of included file inc */
+static void free_include(struct include *inc)
+{
+	if (inc->state == INC_PARSED) {
+		if (inc->map.keys)
+			free_keys(inc->map.keys);
+		free_windows(&inc->map);
+		free_layers(&inc->map);
+	}
+	memset(&inc->map, 0, sizeof inc->map);
+	free(inc->deps);
+	inc->deps = NULL;
+	inc->ndeps = 0;
+	inc->defined = 0;
 }
 
-static int parse_misc(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+/*
+ * free_ops:
+ * Free the arguments of the nops operations at ops, of a binding which
+ * failed to parse and so was never made into a hotkey.
+ */
+static void free_ops(struct operation *ops, size_t nops)
 {
-	uint32_t *key;
+	struct exec_cmd *cmd;
+	size_t i;
+#if defined(__linux__) || defined(__APPLE__)
+	char **argv;
+#endif
 
-	key = (uint32_t *)retval;
-	switch (lex->curr->tag) {
-	case '`':
-		*key = KEY_BTICK;
+	for (i = 0; i < nops; ++i) {
+		if (ops[i].op == OP_TYPE || ops[i].op == OP_GLIDE
+		    || ops[i].op == OP_MOVE)
+			free((void *)ops[i].args);
+		if (ops[i].op != OP_EXEC)
+			continue;
+
+		cmd = (struct exec_cmd *)ops[i].args;
+#if defined(__linux__) || defined(__APPLE__)
+		argv = cmd->argv;
+#ifdef __APPLE__
+		argv += 2;
+#endif
+		for (; *argv; ++argv)
+			free(*argv);
+		free(cmd->argv);
+#endif
+#ifdef __linux__
+		free(cmd->segs);
+		free(cmd->args);
+		free(cmd->buf);
+#endif
+#if defined(__CYGWIN__) || defined (__MINGW32__)
+		free(cmd->cmd);
+#endif
+		free(cmd);
+	}
+}
+
+/* copy_args: return a copy of the arguments of operation op */
+static uint64_t copy_args(const struct operation *op, const uint8_t *layers)
+{
+	struct exec_cmd *cmd, *src;
+	uint64_t args;
+	size_t n;
+#if defined(__linux__) || defined(__APPLE__)
+	size_t i;
+#endif
+#ifdef __linux__
+	struct glide *g;
+	struct mover *m;
+	uint32_t *text;
+#endif
+
+	args = op->args;
+	switch (op->op) {
+	case OP_EXEC:
+		src = (struct exec_cmd *)op->args;
+		cmd = calloc(1, sizeof *cmd);
+		cmd->flags = src->flags;
+		cmd->max = src->max;
+#if defined(__linux__) || defined(__APPLE__)
+		for (n = 0; src->argv[n]; ++n)
+			;
+		cmd->argv = malloc((n + 1) * sizeof *cmd->argv);
+		for (i = 0; i < n; ++i)
+			cmd->argv[i] = strdup(src->argv[i]);
+		cmd->argv[n] = NULL;
+#endif
+#ifdef __APPLE__
+		/* "open" "-a" are not dynamically allocated */
+		free(cmd->argv[0]);
+		free(cmd->argv[1]);
+		cmd->argv[0] = src->argv[0];
+		cmd->argv[1] = src->argv[1];
+#endif
+#ifdef __linux__
+		compile_exec(cmd);
+#endif
+#if defined(__CYGWIN__) || defined (__MINGW32__)
+		cmd->cmd = strdup(src->cmd);
+		KBM_UNUSED(n);
+#endif
+		memcpy(&args, &cmd, sizeof cmd);
 		break;
-	case '-':
-		*key = KEY_MINUS;
+#ifdef __linux__
+	case OP_TYPE:
+		for (n = 0; ((const uint32_t *)op->args)[n]; ++n)
+			;
+		text = malloc((n + 1) * sizeof *text);
+		memcpy(text, (const uint32_t *)op->args, (n + 1) * sizeof *text);
+		memcpy(&args, &text, sizeof text);
 		break;
-	case '=':
-		*key = KEY_EQUAL;
+	case OP_GLIDE:
+		g = calloc(1, sizeof *g);
+		g->dx = ((const struct glide *)op->args)->dx;
+		g->dy = ((const struct glide *)op->args)->dy;
+		g->ms = ((const struct glide *)op->args)->ms;
+		g->ease = ((const struct glide *)op->args)->ease;
+		memcpy(&args, &g, sizeof g);
+		break;
+	case OP_MOVE:
+		m = calloc(1, sizeof *m);
+		m->vx = ((const struct mover *)op->args)->vx;
+		m->vy = ((const struct mover *)op->args)->vy;
+		m->accel = ((const struct mover *)op->args)->accel;
+		memcpy(&args, &m, sizeof m);
+		break;
+	case OP_LAYER:
+		args = (args & 0xFF) | (uint64_t)layers[args >> 8 & 0xFF] << 8;
+		break;
+#endif
+	}
+#ifndef __linux__
+	KBM_UNUSED(layers);
+#endif
+	return args;
+}
+
+/*
+ * copy_binding:
+ * Return a copy of binding hk, with each of its layers replaced by
+ * its entry in layers.
+ */
+static struct hotkey *copy_binding(const struct hotkey *hk,
+                                   const uint8_t *layers)
+{
+	struct operation ops[KBM_MAX_OPS];
+	struct hotkey *copy;
+	size_t i;
+#ifdef __linux__
+	size_t size;
+#endif
+
+	for (i = 0; i < hk->nops; ++i) {
+		ops[i].op = hk->ops[i].op;
+		ops[i].args = copy_args(&hk->ops[i], layers);
+	}
+	copy = create_hotkey(hk->kbm_code, hk->kbm_modmask, ops, hk->nops,
+	                     hk->key_flags);
+#ifdef __linux__
+	if (hk->seq) {
+		size = sizeof *hk->seq + hk->seq->len * sizeof *hk->seq->keys;
+		copy->seq = malloc(size);
+		memcpy(copy->seq, hk->seq, size);
+	}
+	if (hk->hold)
+		copy->hold = copy_binding(hk->hold, layers);
+	copy->hold_ms = hk->hold_ms;
+	copy->layer = layers[hk->layer];
+#endif
+	return copy;
+}
+
+/*
+ * parse_binding:
+ * Read a complete keybinding declaration from f.
+ * The format of a keybinding is KEY -> [macro] FUNC [ARGS] [QUALS] [& ...].
+ * Return a struct hotkey representing the binding.
+ */
+static struct hotkey *parse_binding(FILE *f, struct lexer *lex,
+                                    struct layer_refs *refs)
+{
+	struct operation ops[KBM_MAX_OPS];
+	uint64_t key, seq[KBM_MAX_SEQ - 1];
+	uint32_t flags, kind, tap_flags;
+	size_t nops, nseq, ntap, i;
+	unsigned int hold_ms, long_ms;
+	struct hotkey *hk, *hold;
+
+	key = flags = kind = tap_flags = nops = nseq = ntap = 0;
+	hold_ms = long_ms = 0;
+	if (parse_key(f, lex, &key, 1) != 0 || !validkey(&key, lex))
+		return NULL;
+	if (refs->curr && K_ISBUTTON(key & 0xFFFFFFFF)) {
+		err_generic(lex, "a mouse button cannot be bound in a layer");
+		return NULL;
+	}
+
+	/* keys joined by plus signs make a chord */
+	while (lex->curr->tag == '+') {
+#ifndef __linux__
+		err_generic(lex, "chords are not supported on this platform");
+		return NULL;
+#endif
+		if (refs->curr) {
+			err_generic(lex, "a chord cannot be bound in a layer");
+			return NULL;
+		}
+		if (!nseq && !chord_key_ok(key, 1, lex))
+			return NULL;
+		if (nseq == KBM_MAX_CHORD - 1) {
+			err_generic(lex, "chords cannot exceed "
+			                 KBM_STR(KBM_MAX_CHORD) " keys");
+			return NULL;
+		}
+		if (next_token(f, lex, 1, 1) != 0)
+			return NULL;
+		seq[nseq] = 0;
+		if (parse_key(f, lex, &seq[nseq], 1) != 0
+		    || !validkey(&seq[nseq], lex)
+		    || !chord_key_ok(seq[nseq], 0, lex))
+			return NULL;
+		for (i = 0; i <= nseq; ++i) {
+			if (((i ? seq[i - 1] : key) & 0xFFFFFFFF)
+			    == (seq[nseq] & 0xFFFFFFFF)) {
+				err_generic(lex, "a chord cannot contain "
+				                 "the same key twice");
+				return NULL;
+			}
+		}
+		kind = KBM_CHORD;
+		nseq++;
+	}
+
+	/* further keys before the arrow make a key sequence */
+	while (IS_KEY_START(lex->curr)) {
+#ifndef __linux__
+		err_generic(lex, "key sequences are not supported "
+		                 "on this platform");
+		return NULL;
+#endif
+		if (refs->curr) {
+			err_generic(lex, "a key sequence cannot be bound "
+			                 "in a layer");
+			return NULL;
+		}
+		if (kind == KBM_CHORD) {
+			err_generic(lex, "a chord cannot be part of "
+			                 "a key sequence");
+			return NULL;
+		}
+		if (nseq == KBM_MAX_SEQ - 1) {
+			err_generic(lex, "key sequences cannot exceed "
+			                 KBM_STR(KBM_MAX_SEQ) " keys");
+			return NULL;
+		}
+		if (!nseq && !seq_key_ok(key, lex))
+			return NULL;
+		seq[nseq] = 0;
+		if (parse_key(f, lex, &seq[nseq], 1) != 0
+		    || !validkey(&seq[nseq], lex)
+		    || !seq_key_ok(seq[nseq], lex))
+			return NULL;
+		kind = KBM_SEQUENCE;
+		nseq++;
+	}
+
+	/* match the arrow following the key */
+	if (lex->curr->tag != TOK_ARROW) {
+		err_generic(lex, "expected '->' after key");
+		return NULL;
+	}
+	if (next_token(f, lex, 1, 1) != 0)
+		return NULL;
+
+	/* a macro plays back its operations over time */
+	if (lex->curr->tag == TOK_FUNC && strcmp(lex->curr->str, "macro") == 0) {
+#ifndef __linux__
+		err_generic(lex, "macros are not supported on this platform");
+		return NULL;
+#endif
+		flags |= KBM_MACRO;
+		if (next_token(f, lex, 0, 1) != 0)
+			return NULL;
+	}
+
+	for (;;) {
+		if (nops == KBM_MAX_OPS) {
+			err_generic(lex, "too many operations in binding");
+			goto err_ops;
+		}
+
+		/* match the hotkey operation */
+		if (lex->curr->tag != TOK_FUNC) {
+			err_generic(lex, ntap && nops == ntap
+			                 ? "expected function after hold"
+			                 : nops ? "expected function after '&'"
+			                        : "expected function after '->'");
+			goto err_ops;
+		}
+		if (strcmp(lex->curr->str, "wait") == 0
+		    && !(flags & KBM_MACRO)) {
+			err_generic(lex, "wait can only be used in a macro");
+			goto err_ops;
+		}
+		if (strcmp(lex->curr->str, "toggle") == 0 && refs->curr) {
+			err_generic(lex, "toggle cannot be used in a layer");
+			goto err_ops;
+		}
+		if (strcmp(lex->curr->str, "move") == 0
+		    && (nops > ntap || flags & KBM_MACRO)) {
+			err_generic(lex, "move must be the only operation "
+			                 "in a binding");
+			goto err_ops;
+		}
+		ops[nops].args = 0;
+		if (parse_func(f, lex, refs, &ops[nops].op,
+		               &ops[nops].args) != 0)
+			goto err_ops;
+
+		while (lex->curr && IS_QUAL(lex->curr, ops[nops].op)) {
+			if (IS_GESTURE(lex->curr)
+			    && !gesture_ok(key, kind, ntap, lex))
+				goto err_op;
+			if (parse_qual(f, lex, &flags, ops[nops].op,
+			               ops[nops].args, &long_ms) != 0)
+				goto err_op;
+		}
+		nops++;
+
+		/* a move operation has to know when its key is released */
+		if (ops[nops - 1].op == OP_MOVE && lex->curr
+		    && lex->curr->tag == '&') {
+			err_generic(lex, "move must be the only operation "
+			                 "in a binding");
+			goto err_ops;
+		}
+
+		/* operations after hold run when the key is held down */
+		if (lex->curr && IS_HOLD(lex->curr)) {
+			if (flags & (KBM_DOUBLE | KBM_LONG)) {
+				err_generic(lex, "hold cannot be applied to "
+				                 "a double or long binding");
+				goto err_ops;
+			}
+			if (parse_hold(f, lex, key, kind, ntap, &hold_ms) != 0)
+				goto err_ops;
+			ntap = nops;
+			tap_flags = flags;
+			flags = 0;
+			continue;
+		}
+
+		/* further operations are separated by ampersands */
+		if (!lex->curr || lex->curr->tag != '&')
+			break;
+		if (next_token(f, lex, 1, 1) != 0)
+			goto err_ops;
+	}
+
+	hold = NULL;
+	if (ntap) {
+		hold = create_hotkey(key & 0xFFFFFFFF, (key >> 32) & 0xFF,
+		                     ops + ntap, nops - ntap, flags);
+		nops = ntap;
+		flags = tap_flags;
+	}
+	if ((key >> 32) & ANY_MODS)
+		flags |= KBM_WILDCARD;
+
+	hk = create_hotkey(key & 0xFFFFFFFF, (key >> 32) & 0xFF,
+	                   ops, nops, flags);
+#ifdef __linux__
+	if (nseq)
+		set_sequence(hk, seq, nseq, kind);
+	if (hold)
+		set_hold(hk, hold, hold_ms);
+	if (flags & KBM_LONG)
+		hk->hold_ms = long_ms;
+	hk->layer = refs->curr;
+#endif
+	return hk;
+
+err_op:
+	nops++;
+err_ops:
+	free_ops(ops, nops);
+	return NULL;
+}
+
+/*
+ * parse_layer_op:
+ * Read the arguments of a layer operation: push or set followed by the
+ * name of a layer, or pop. The action is stored in the lower 8 bits of
+ * args and the layer in the next 8.
+ */
+static int parse_layer_op(FILE *f, struct lexer *lex, struct layer_refs *refs,
+                          uint64_t *args)
+{
+#ifndef __linux__
+	KBM_UNUSED(f);
+	KBM_UNUSED(refs);
+	KBM_UNUSED(args);
+	err_generic(lex, "layers are not supported on this platform");
+	return 1;
+#else
+	unsigned int layer;
+
+	if (next_token(f, lex, 0, 1) != 0)
+		return 1;
+	if (lex->curr->tag == TOK_ID && strcmp(lex->curr->str, "pop") == 0) {
+		*args = LAYER_POP;
+		next_token(f, lex, 1, 0);
+		return 0;
+	}
+	if (lex->curr->tag == TOK_ID && strcmp(lex->curr->str, "push") == 0) {
+		*args = LAYER_PUSH;
+	} else if (lex->curr->tag == TOK_ID
+	           && strcmp(lex->curr->str, "set") == 0) {
+		*args = LAYER_SET;
+	} else {
+		err_generic(lex, "expected push, pop or set after layer");
+		return 1;
+	}
+
+	if (next_token(f, lex, 1, 1) != 0)
+		return 1;
+	if (lex->curr->tag != TOK_ID) {
+		err_generic(lex, "expected layer name");
+		return 1;
+	}
+	if (!(layer = find_layer(lex, refs)))
+		return 1;
+	*args |= layer << 8;
+	next_token(f, lex, 1, 0);
+	return 0;
+#endif
+}
+
+/*
+ * parse_profile:
+ * Read the profile switched to by a profile operation: next, or the
+ * number of a keymap file as given on the command line. Next is stored
+ * as 0, as profiles are numbered from 1.
+ */
+static int parse_profile(FILE *f, struct lexer *lex, uint64_t *args)
+{
+#ifndef __linux__
+	KBM_UNUSED(f);
+	KBM_UNUSED(args);
+	err_generic(lex, "profiles are not supported on this platform");
+	return 1;
+#else
+	if (next_token(f, lex, 0, 1) != 0)
+		return 1;
+	if (lex->curr->tag == TOK_ID && strcmp(lex->curr->str, "next") == 0) {
+		*args = 0;
+	} else if (lex->curr->tag == TOK_NUM) {
+		if (lex->curr->val < 1 || lex->curr->val > KBM_MAX_PROFILES) {
+			err_generic(lex, "profile number must be between "
+			                 "1 and " KBM_STR(KBM_MAX_PROFILES));
+			return 1;
+		}
+		*args = lex->curr->val;
+	} else {
+		err_generic(lex, "expected next or a number after profile");
+		return 1;
+	}
+	next_token(f, lex, 1, 0);
+	return 0;
+#endif
+}
+
+/*
+ * parse_hold:
+ * Read the hold keyword dividing the operations of a tap and hold binding
+ * of key, and the time after which the key counts as held, if given.
+ */
+static int parse_hold(FILE *f, struct lexer *lex, uint64_t key,
+                      uint32_t kind, size_t ntap, unsigned int *ms)
+{
+#ifndef __linux__
+	KBM_UNUSED(f);
+	KBM_UNUSED(key);
+	KBM_UNUSED(kind);
+	KBM_UNUSED(ntap);
+	KBM_UNUSED(ms);
+	err_generic(lex, "hold is not supported on this platform");
+	return 1;
+#else
+	if (ntap) {
+		err_generic(lex, "a binding can only have one hold");
+		return 1;
+	}
+	if (kind) {
+		err_generic(lex, "hold cannot be applied to a chord or "
+		                 "a key sequence");
+		return 1;
+	}
+	if (K_ISBUTTON(key & 0xFFFFFFFF)) {
+		err_generic(lex, "hold cannot be applied to a mouse button");
+		return 1;
+	}
+	if (next_token(f, lex, 0, 1) != 0)
+		return 1;
+
+	if (lex->curr->tag == TOK_NUM) {
+		if (lex->curr->val < 1 || lex->curr->val > KBM_MAX_HOLD_TIME) {
+			err_generic(lex, "hold time must be between 1 and "
+			                 KBM_STR(KBM_MAX_HOLD_TIME) " ms");
+			return 1;
+		}
+		*ms = lex->curr->val;
+		if (next_token(f, lex, 1, 1) != 0)
+			return 1;
+	}
+	return 0;
+#endif
+}
+
+/* parse_key: parse a key declaration and its modifiers */
+static int parse_key(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+{
+	if (lex->curr->tag == TOK_MOD) {
+		if (parse_mod(f, lex, retval, failnext) != 0)
+			return 1;
+	} else if (lex->curr->tag == TOK_ID) {
+		if (parse_id(f, lex, retval, failnext) != 0)
+			return 1;
+	} else if (lex->curr->tag == TOK_NUM) {
+		if (parse_keynum(f, lex, retval, failnext) != 0)
+			return 1;
+	} else if (strchr(MISC_KEYS, lex->curr->tag)) {
+		if (parse_misc(f, lex, retval, failnext) != 0)
+			return 1;
+	} else {
+		err_invkey(lex);
+		return 1;
+	}
+	return 0;
+}
+
+/* parse_mod: process a token of type MOD */
+static int parse_mod(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+{
+	uint32_t *mods;
+
+	mods = (uint32_t *)retval + 1;
+
+	/* mark start of token for potential error reporting */
+	strcpy(lex->err_line, lex->line);
+	lex->err_num = lex->line_num;
+	lex->err_pos = lex->err_line + CURR_START(lex);
+	lex->err_len = lex->curr->len;
+
+	switch (lex->curr->val) {
+	case '^':
+		SET_MODS(*mods, KBM_CTRL_MASK, lex);
+		break;
+	case '!':
+		SET_MODS(*mods, KBM_SHIFT_MASK, lex);
+		break;
+	case '@':
+		SET_MODS(*mods, KBM_SUPER_MASK, lex);
+		break;
+	case '~':
+		SET_MODS(*mods, KBM_META_MASK, lex);
+		break;
+	case '*':
+#ifndef __linux__
+		err_generic(lex, "wildcard modifiers are not supported "
+		                 "on this platform");
+		return 1;
+#endif
+		/* only a binding's own key can match several modifiers */
+		if (!failnext) {
+			err_generic(lex, "a sent key cannot have "
+			                 "wildcard modifiers");
+			return 1;
+		}
+		SET_MODS(*mods, ANY_MODS, lex);
+		break;
+	default:
+		return 1;
+	}
+
+	if (next_token(f, lex, 1, 1) != 0)
+		return 1;
+
+	if (lex->curr->tag == TOK_MOD)
+		return parse_mod(f, lex, retval, failnext);
+
+	return parse_key(f, lex, retval, failnext);
+}
+
+static int parse_id(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+{
+	uint32_t *key, *mods;
+
+	key = (uint32_t *)retval;
+	mods = (uint32_t *)retval + 1;
+	if (strcmp(lex->curr->str, "keycode") == 0)
+		return parse_rawkey(f, lex, retval, failnext);
+
+	if (!(*key = lookup_keycode(lex->curr->str))) {
+		err_invkey(lex);
+		return 1;
+	}
+	if (OSCODE(*key) == NOKEY) {
+		err_generic(lex, "key does not exist on this platform");
+		return 1;
+	}
+
+	/* buttons can only be the trigger of a binding, not sent as keys */
+	if (K_ISBUTTON(*key) && !failnext) {
+		err_generic(lex, "a mouse button cannot be sent as a key");
+		return 1;
+	}
+
+	if (K_ISMOD(*key)) {
+		/* mark start of token for potential error reporting */
+		strcpy(lex->err_line, lex->line);
+		lex->err_num = lex->line_num;
+		lex->err_pos = lex->err_line + CURR_START(lex);
+		lex->err_len = lex->curr->len;
+	}
+
+	if (next_token(f, lex, 1, failnext) != 0)
+		return failnext;
+
+	if (K_ISMOD(*key) && lex->curr->tag == '-') {
+#ifndef __linux__
+		if (K_ISRMOD(*key)) {
+			err_generic(lex, "right-hand modifiers are not "
+			                 "supported on this platform");
+			return 1;
+		}
+#endif
+		switch (*key) {
+		case KEY_CTRL:
+			SET_MODS(*mods, KBM_CTRL_MASK, lex);
+			break;
+		case KEY_SHIFT:
+			SET_MODS(*mods, KBM_SHIFT_MASK, lex);
+			break;
+		case KEY_SUPER:
+			SET_MODS(*mods, KBM_SUPER_MASK, lex);
+			break;
+		case KEY_META:
+			SET_MODS(*mods, KBM_META_MASK, lex);
+			break;
+		case KEY_RCTRL:
+			SET_MODS(*mods, KBM_CTRL_MASK | KBM_RCTRL_MASK, lex);
+			break;
+		case KEY_RSHIFT:
+			SET_MODS(*mods, KBM_SHIFT_MASK | KBM_RSHIFT_MASK, lex);
+			break;
+		case KEY_RSUPER:
+			SET_MODS(*mods, KBM_SUPER_MASK | KBM_RSUPER_MASK, lex);
+			break;
+		case KEY_RMETA:
+			SET_MODS(*mods, KBM_META_MASK | KBM_RMETA_MASK, lex);
+			break;
+		}
+		if (next_token(f, lex, 1, 1) != 0)
+			return 1;
+
+		return parse_key(f, lex, retval, failnext);
+	}
+
+	return 0;
+}
+
+static int parse_keynum(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+{
+	uint32_t *key;
+
+	key = (uint32_t *)retval;
+	if (lex->curr->val + KEY_0 > KEY_9) {
+		err_invkey(lex);
+		return 1;
+	}
+
+	*key = lex->curr->val + KEY_0;
+	if (next_token(f, lex, 1, failnext) != 0)
+		return failnext;
+	return 0;
+}
+
+/* parse_rawkey: parse a key given by OS keycode, as keycode:NNN */
+static int parse_rawkey(FILE *f, struct lexer *lex,
+                        uint64_t *retval, int failnext)
+{
+	uint32_t *key;
+
+	key = (uint32_t *)retval;
+	if (next_token(f, lex, 1, 1) != 0)
+		return 1;
+	if (lex->curr->tag != ':') {
+		err_generic(lex, "expected ':' after keycode");
+		return 1;
+	}
+	if (next_token(f, lex, 1, 1) != 0)
+		return 1;
+	if (lex->curr->tag != TOK_NUM || lex->curr->val < 1
+	    || lex->curr->val > KEY_RAW_MAX) {
+		err_generic(lex, "keycode must be between "
+		                 "1 and " KBM_STR(KEY_RAW_MAX));
+		return 1;
+	}
+
+	*key = KEY_RAW(lex->curr->val);
+	if (next_token(f, lex, 1, failnext) != 0)
+		return failnext;
+	return 0;
+}
+
+static int parse_misc(FILE *f, struct lexer *lex, uint64_t *retval, int failnext)
+{
+	uint32_t *key;
+
+	key = (uint32_t *)retval;
+	switch (lex->curr->tag) {
+	case '`':
+		*key = KEY_BTICK;
+		break;
+	case '-':
+		*key = KEY_MINUS;
+		break;
+	case '=':
+		*key = KEY_EQUAL;
 		break;
 	case '[':
 		*key = KEY_LSQBR;
@@ -690,7 +1753,8 @@ static int parse_misc(FILE *f, struct lexer *lex, uint64_t *retval, int failnext
  * Parse an operation and its arguments from f.
  * Store opcode in op and arguments into args.
  */
-static int parse_func(FILE *f, struct lexer *lex, uint8_t *op, uint64_t *args)
+static int parse_func(FILE *f, struct lexer *lex, struct layer_refs *refs,
+                      uint8_t *op, uint64_t *args)
 {
 	uint32_t *x, *y;
 
@@ -704,6 +1768,37 @@ static int parse_func(FILE *f, struct lexer *lex, uint8_t *op, uint64_t *args)
 		next_token(f, lex, 0, 0);
 		return 0;
 	}
+	if (strcmp(lex->curr->str, "mclick") == 0) {
+		*op = OP_MCLICK;
+		next_token(f, lex, 0, 0);
+		return 0;
+	}
+	if (strcmp(lex->curr->str, "scroll") == 0) {
+		*op = OP_SCROLL;
+		next_token(f, lex, 0, 1);
+		return parse_scroll(f, lex, args);
+	}
+	if (strcmp(lex->curr->str, "press") == 0) {
+		*op = OP_PRESS;
+		next_token(f, lex, 0, 1);
+		return parse_button(f, lex, args);
+	}
+	if (strcmp(lex->curr->str, "release") == 0) {
+		*op = OP_RELEASE;
+		next_token(f, lex, 0, 1);
+		return parse_button(f, lex, args);
+	}
+	if (strcmp(lex->curr->str, "drag") == 0) {
+		*op = OP_DRAG;
+		x = (uint32_t *)args;
+		y = (uint32_t *)args + 1;
+		if (next_token(f, lex, 0, 1) != 0 || parse_num(f, lex, x) != 0)
+			return 1;
+		if (next_token(f, lex, 1, 1) != 0 || parse_num(f, lex, y) != 0)
+			return 1;
+		next_token(f, lex, 1, 0);
+		return 0;
+	}
 	if (strcmp(lex->curr->str, "jump") == 0) {
 		*op = OP_JUMP;
 		x = (uint32_t *)args;
@@ -713,8 +1808,22 @@ static int parse_func(FILE *f, struct lexer *lex, uint8_t *op, uint64_t *args)
 		if (next_token(f, lex, 1, 1) != 0 || parse_num(f, lex, y) != 0)
 			return 1;
 		next_token(f, lex, 1, 1);
+
+		/* the jump may be spread out over a duration */
+		if (lex->curr && lex->curr->tag == TOK_ID
+		    && strcmp(lex->curr->str, "over") == 0)
+			return parse_glide(f, lex, op, args);
 		return 0;
 	}
+	if (strcmp(lex->curr->str, "jumpto") == 0) {
+		*op = OP_JUMPTO;
+		return parse_jumpto(f, lex, args);
+	}
+	if (strcmp(lex->curr->str, "move") == 0) {
+		*op = OP_MOVE;
+		next_token(f, lex, 0, 1);
+		return parse_move(f, lex, args);
+	}
 	if (strcmp(lex->curr->str, "key") == 0) {
 		*op = OP_KEY;
 		next_token(f, lex, 0, 1);
@@ -725,11 +1834,56 @@ static int parse_func(FILE *f, struct lexer *lex, uint8_t *op, uint64_t *args)
 		next_token(f, lex, 0, 0);
 		return 0;
 	}
+	if (strcmp(lex->curr->str, "layer") == 0) {
+		*op = OP_LAYER;
+		return parse_layer_op(f, lex, refs, args);
+	}
+	if (strcmp(lex->curr->str, "profile") == 0) {
+		*op = OP_PROFILE;
+		return parse_profile(f, lex, args);
+	}
 	if (strcmp(lex->curr->str, "quit") == 0) {
 		*op = OP_QUIT;
 		next_token(f, lex, 0, 0);
 		return 0;
 	}
+	if (strcmp(lex->curr->str, "wait") == 0) {
+		*op = OP_WAIT;
+		/* the wait time in milliseconds */
+		if (next_token(f, lex, 0, 1) != 0)
+			return 1;
+		if (lex->curr->tag != TOK_NUM) {
+			err_generic(lex, "invalid token - expected a number");
+			return 1;
+		}
+		*args = lex->curr->val;
+		next_token(f, lex, 1, 0);
+		return 0;
+	}
+	if (strcmp(lex->curr->str, "macro") == 0) {
+		err_generic(lex, "macro must begin a binding");
+		return 1;
+	}
+	if (strcmp(lex->curr->str, "hold") == 0) {
+		err_generic(lex, "hold must follow the operations run "
+		                 "when the key is tapped");
+		return 1;
+	}
+	if (strcmp(lex->curr->str, "type") == 0) {
+		*op = OP_TYPE;
+#ifndef __linux__
+		err_generic(lex, "type is not supported on this platform");
+		return 1;
+#else
+		if (next_token(f, lex, 0, 1) != 0)
+			return 1;
+		if (lex->curr->tag != TOK_STRLIT) {
+			err_generic(lex, "invalid token - expected a string");
+			return 1;
+		}
+		return parse_text(f, lex, args);
+#endif
+	}
 	if (strcmp(lex->curr->str, "exec") == 0) {
 		*op = OP_EXEC;
 		/* at least one argument is required */
@@ -739,38 +1893,288 @@ static int parse_func(FILE *f, struct lexer *lex, uint8_t *op, uint64_t *args)
 			err_generic(lex, "invalid token - expected a string");
 			return 1;
 		}
-		return parse_exec(f, lex, args);
+		return parse_exec(f, lex, args);
+	}
+	return 1;
+}
+
+/* parse_num: read a number from f into num */
+static int parse_num(FILE *f, struct lexer *lex, uint32_t *num)
+{
+	int mult;
+
+	if (lex->curr->tag != '-' && lex->curr->tag != TOK_NUM) {
+		err_generic(lex, "invalid token - expected a number");
+		return 1;
+	}
+
+	mult = 1;
+	if (lex->curr->tag == '-') {
+		mult = -1;
+		if (next_token(f, lex, 1, 1) != 0)
+			return 1;
+		if (lex->curr->tag != TOK_NUM) {
+			err_generic(lex, "invalid token - expected a number");
+			return 1;
+		}
+	}
+
+	*num = mult * lex->curr->val;
+	return 0;
+}
+
+/*
+ * parse_glide:
+ * Read the duration and optional path of a jump spread out over time,
+ * following the jump's offsets, which are stored in args.
+ */
+static int parse_glide(FILE *f, struct lexer *lex, uint8_t *op, uint64_t *args)
+{
+#ifdef __linux__
+	struct glide *g;
+	unsigned int line;
+
+	if (next_token(f, lex, 1, 1) != 0)
+		return 1;
+	if (lex->curr->tag != TOK_NUM) {
+		err_generic(lex, "invalid token - expected a number");
+		return 1;
+	}
+	if (lex->curr->val < 1 || lex->curr->val > KBM_MAX_GLIDE) {
+		err_generic(lex, "jump duration must be between "
+		                 "1 and " KBM_STR(KBM_MAX_GLIDE) " ms");
+		return 1;
+	}
+
+	g = calloc(1, sizeof *g);
+	g->dx = *args & 0xFFFFFFFF;
+	g->dy = (*args >> 32) & 0xFFFFFFFF;
+	g->ms = lex->curr->val;
+	g->ease = GLIDE_LINEAR;
+	*op = OP_GLIDE;
+	memcpy(args, &g, sizeof g);
+
+	/* a name on the following line is the key of the next binding */
+	line = lex->line_num;
+	if (next_token(f, lex, 1, 0) != 0 || lex->curr->tag != TOK_ID
+	    || lex->line_num != line)
+		return 0;
+
+	if (strcmp(lex->curr->str, "ease") == 0)
+		g->ease = GLIDE_EASE;
+	else if (strcmp(lex->curr->str, "linear") != 0)
+		return 0;
+	next_token(f, lex, 1, 0);
+	return 0;
+#else
+	KBM_UNUSED(f);
+	KBM_UNUSED(op);
+	KBM_UNUSED(args);
+	err_generic(lex, "jump over is not supported on this platform");
+	return 1;
+#endif
+}
+
+/*
+ * parse_move:
+ * Read the initial speeds of a move operation in pixels per second
+ * and its optional acceleration, storing the operation in args.
+ */
+static int parse_move(FILE *f, struct lexer *lex, uint64_t *args)
+{
+#ifdef __linux__
+	struct mover *m;
+	uint32_t vx, vy;
+	unsigned int line;
+
+	if (!lex->curr || parse_num(f, lex, &vx) != 0)
+		return 1;
+	if (next_token(f, lex, 1, 1) != 0 || parse_num(f, lex, &vy) != 0)
+		return 1;
+	if (abs((int32_t)vx) > KBM_MAX_SPEED
+	    || abs((int32_t)vy) > KBM_MAX_SPEED) {
+		err_generic(lex, "move speed cannot exceed "
+		                 KBM_STR(KBM_MAX_SPEED) " pixels per second");
+		return 1;
+	}
+
+	m = calloc(1, sizeof *m);
+	m->vx = vx;
+	m->vy = vy;
+	m->accel = MOVE_ACCEL;
+	memcpy(args, &m, sizeof m);
+
+	line = lex->line_num;
+	if (next_token(f, lex, 1, 0) != 0 || lex->curr->tag != TOK_ID
+	    || lex->line_num != line
+	    || strcmp(lex->curr->str, "accel") != 0)
+		return 0;
+
+	/* acceleration in percent of the initial speed per second */
+	if (next_token(f, lex, 1, 1) != 0)
+		goto err_free;
+	if (lex->curr->tag != TOK_NUM || lex->curr->val > KBM_MAX_ACCEL) {
+		err_generic(lex, "move acceleration must be between "
+		                 "0 and " KBM_STR(KBM_MAX_ACCEL));
+		goto err_free;
+	}
+	m->accel = lex->curr->val;
+	next_token(f, lex, 1, 0);
+	return 0;
+
+err_free:
+	free(m);
+	*args = 0;
+	return 1;
+#else
+	KBM_UNUSED(f);
+	KBM_UNUSED(args);
+	err_generic(lex, "move is not supported on this platform");
+	return 1;
+#endif
+}
+
+/*
+ * parse_jumpto:
+ * Read the optional monitor and the coordinates of a jumpto operation,
+ * each either in pixels or followed by '%', into args. The coordinates
+ * take up 16 bits each, followed by the monitor and the KBM_WARP flags.
+ */
+static int parse_jumpto(FILE *f, struct lexer *lex, uint64_t *args)
+{
+#ifdef __linux__
+	uint64_t monitor, flags, pos[2];
+	int i;
+
+	monitor = flags = 0;
+	if (next_token(f, lex, 0, 1) != 0)
+		return 1;
+
+	if (lex->curr->tag == TOK_ID && strcmp(lex->curr->str, "monitor") == 0) {
+		if (next_token(f, lex, 1, 1) != 0)
+			return 1;
+		if (lex->curr->tag != TOK_NUM || lex->curr->val < 1
+		    || lex->curr->val > KBM_MAX_MONITOR) {
+			err_generic(lex, "monitor must be between "
+			                 "1 and " KBM_STR(KBM_MAX_MONITOR));
+			return 1;
+		}
+		monitor = lex->curr->val;
+		if (next_token(f, lex, 1, 1) != 0)
+			return 1;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if (lex->curr->tag != TOK_NUM) {
+			err_generic(lex, "invalid token - expected a number");
+			return 1;
+		}
+		if (lex->curr->val > KBM_MAX_COORD) {
+			err_generic(lex, "coordinates cannot exceed "
+			                 KBM_STR(KBM_MAX_COORD));
+			return 1;
+		}
+		pos[i] = lex->curr->val;
+
+		/* only the x coordinate must be followed by something */
+		if (next_token(f, lex, 1, !i) != 0) {
+			if (!i)
+				return 1;
+			break;
+		}
+		if (lex->curr->tag == '%') {
+			if (pos[i] > 100) {
+				err_generic(lex, "percentage cannot exceed 100");
+				return 1;
+			}
+			flags |= i ? KBM_WARP_YPCT : KBM_WARP_XPCT;
+			if (next_token(f, lex, 1, !i) != 0 && !i)
+				return 1;
+		}
 	}
+
+	*args = pos[0] | pos[1] << 16 | monitor << 32 | flags << 48;
+	return 0;
+#else
+	KBM_UNUSED(f);
+	KBM_UNUSED(args);
+	err_generic(lex, "jumpto is not supported on this platform");
 	return 1;
+#endif
 }
 
-/* parse_num: read a number from f into num */
-static int parse_num(FILE *f, struct lexer *lex, uint32_t *num)
+/* parse_button: read the name of a mouse button into args */
+static int parse_button(FILE *f, struct lexer *lex, uint64_t *args)
 {
-	int mult;
+	if (!lex->curr || lex->curr->tag != TOK_ID) {
+		err_generic(lex, "expected left, middle or right");
+		return 1;
+	}
 
-	if (lex->curr->tag != '-' && lex->curr->tag != TOK_NUM) {
-		err_generic(lex, "invalid token - expected a number");
+	if (strcmp(lex->curr->str, "left") == 0) {
+		*args = KBM_BUTTON_LEFT;
+	} else if (strcmp(lex->curr->str, "middle") == 0) {
+		*args = KBM_BUTTON_MIDDLE;
+	} else if (strcmp(lex->curr->str, "right") == 0) {
+		*args = KBM_BUTTON_RIGHT;
+	} else {
+		err_generic(lex, "expected left, middle or right");
 		return 1;
 	}
+	next_token(f, lex, 1, 0);
+	return 0;
+}
 
-	mult = 1;
-	if (lex->curr->tag == '-') {
-		mult = -1;
-		if (next_token(f, lex, 1, 1) != 0)
-			return 1;
-		if (lex->curr->tag != TOK_NUM) {
-			err_generic(lex, "invalid token - expected a number");
-			return 1;
-		}
+/*
+ * parse_scroll:
+ * Read the direction and optional notch count of a scroll operation.
+ * The direction is stored in the lower 32 bits of args, the count in the upper.
+ */
+static int parse_scroll(FILE *f, struct lexer *lex, uint64_t *args)
+{
+	uint32_t *dir, *count;
+	unsigned int line;
+
+	dir = (uint32_t *)args;
+	count = (uint32_t *)args + 1;
+	if (!lex->curr || lex->curr->tag != TOK_ID) {
+		err_generic(lex, "expected up, down, left or right");
+		return 1;
 	}
 
-	*num = mult * lex->curr->val;
+	if (strcmp(lex->curr->str, "up") == 0) {
+		*dir = KBM_SCROLL_UP;
+	} else if (strcmp(lex->curr->str, "down") == 0) {
+		*dir = KBM_SCROLL_DOWN;
+	} else if (strcmp(lex->curr->str, "left") == 0) {
+		*dir = KBM_SCROLL_LEFT;
+	} else if (strcmp(lex->curr->str, "right") == 0) {
+		*dir = KBM_SCROLL_RIGHT;
+	} else {
+		err_generic(lex, "expected up, down, left or right");
+		return 1;
+	}
+
+	/* a number on the following line is the key of the next binding */
+	*count = 1;
+	line = lex->line_num;
+	if (next_token(f, lex, 1, 0) != 0 || lex->curr->tag != TOK_NUM
+	    || lex->line_num != line)
+		return 0;
+
+	if (lex->curr->val < 1 || lex->curr->val > KBM_MAX_SCROLL) {
+		err_generic(lex, "scroll count must be between "
+		                 "1 and " KBM_STR(KBM_MAX_SCROLL));
+		return 1;
+	}
+	*count = lex->curr->val;
+	next_token(f, lex, 1, 0);
 	return 0;
 }
 
 static int parse_exec(FILE *f, struct lexer *lex, uint64_t *retval)
 {
+	struct exec_cmd *cmd;
 #if defined(__linux__) || defined(__APPLE__)
 	char **argv;
 	size_t argc, allocsz;
@@ -802,14 +2206,13 @@ static int parse_exec(FILE *f, struct lexer *lex, uint64_t *retval)
 	while (lex->curr && lex->curr->tag == TOK_STRLIT) {
 		if (argc == allocsz - 1) {
 			allocsz *= 2;
-			argv = realloc(argv, allocsz);
+			argv = realloc(argv, allocsz * sizeof *argv);
 		}
 		argv[argc++] = lex->curr->str;
 		free(lex->curr);
 		next_token(f, lex, 0, 0);
 	}
 	argv[argc] = NULL;
-	memcpy(retval, &argv, sizeof *retval);
 #endif
 
 #if defined(__CYGWIN__) || defined (__MINGW32__)
@@ -846,22 +2249,404 @@ static int parse_exec(FILE *f, struct lexer *lex, uint64_t *retval)
 	}
 	/* get rid of final space */
 	*--s = '\0';
-	memcpy(retval, &args, sizeof *retval);
 #endif
 
+	cmd = calloc(1, sizeof *cmd);
+#if defined(__linux__) || defined(__APPLE__)
+	cmd->argv = argv;
+#endif
+#ifdef __linux__
+	compile_exec(cmd);
+#endif
+#if defined(__CYGWIN__) || defined (__MINGW32__)
+	cmd->cmd = args;
+#endif
+	memcpy(retval, &cmd, sizeof *retval);
+
+	return 0;
+}
+
+#ifdef __linux__
+/* text_keysym: return the keysym which types unicode character cp */
+static uint32_t text_keysym(uint32_t cp)
+{
+	switch (cp) {
+	case '\n':
+		return 0xFF0D;  /* XK_Return */
+	case '\t':
+		return 0xFF09;  /* XK_Tab */
+	}
+	if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0))
+		return 0;
+
+	/* latin-1 keysyms match their code points */
+	if (cp <= 0xFF)
+		return cp;
+	return 0x01000000 | cp;
+}
+
+/*
+ * parse_text:
+ * Convert the UTF-8 string of a type operation into a zero-terminated
+ * array of keysyms and store its address in retval.
+ */
+static int parse_text(FILE *f, struct lexer *lex, uint64_t *retval)
+{
+	const unsigned char *s;
+	uint32_t *text, cp;
+	size_t n, i, len;
+
+	s = (const unsigned char *)lex->curr->str;
+	text = malloc((strlen(lex->curr->str) + 1) * sizeof *text);
+	for (n = 0; *s; s += len) {
+		if (*s < 0x80) {
+			cp = *s;
+			len = 1;
+		} else if ((*s & 0xE0) == 0xC0) {
+			cp = *s & 0x1F;
+			len = 2;
+		} else if ((*s & 0xF0) == 0xE0) {
+			cp = *s & 0x0F;
+			len = 3;
+		} else if ((*s & 0xF8) == 0xF0) {
+			cp = *s & 0x07;
+			len = 4;
+		} else {
+			goto err_invalid;
+		}
+		for (i = 1; i < len; ++i) {
+			if ((s[i] & 0xC0) != 0x80)
+				goto err_invalid;
+			cp = cp << 6 | (s[i] & 0x3F);
+		}
+		if (!(text[n++] = text_keysym(cp))) {
+			err_generic(lex, "string contains an untypeable "
+			                 "control character");
+			free(text);
+			return 1;
+		}
+	}
+	text[n] = 0;
+
+	memcpy(retval, &text, sizeof text);
+	free_token(lex->curr);
+	next_token(f, lex, 0, 0);
 	return 0;
+
+err_invalid:
+	err_generic(lex, "string is not valid UTF-8");
+	free(text);
+	return 1;
+}
+
+/* names of the values which can be substituted into exec arguments */
+static const char *const slot_names[EXEC_NUM_SLOTS] = {
+	[EXEC_SLOT_WINDOW] = "window",
+	[EXEC_SLOT_X] = "x",
+	[EXEC_SLOT_Y] = "y",
+	[EXEC_SLOT_KEY] = "key"
+};
+
+/*
+ * match_slot:
+ * If s starts with a placeholder such as {window}, return its slot
+ * and store its length in len. Return -1 otherwise.
+ */
+static int match_slot(const char *s, size_t *len)
+{
+	size_t i, n;
+
+	if (*s != '{')
+		return -1;
+
+	for (i = 0; i < EXEC_NUM_SLOTS; ++i) {
+		n = strlen(slot_names[i]);
+		if (strncmp(s + 1, slot_names[i], n) == 0 && s[n + 1] == '}') {
+			*len = n + 2;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * compile_exec:
+ * Split every argument of cmd containing placeholders into segments of
+ * literal text and slots, and preallocate the buffers into which its
+ * argv is assembled at launch. Commands without placeholders are left
+ * untouched and run their argv directly.
+ */
+static void compile_exec(struct exec_cmd *cmd)
+{
+	struct exec_seg *seg;
+	size_t argc, i, pos, start, n, bufsz;
+	int slot, pass;
+
+	for (argc = 0; cmd->argv[argc]; ++argc)
+		;
+
+	/* count the segments on the first pass and fill them on the second */
+	seg = NULL;
+	for (pass = 0; pass < 2; ++pass) {
+		cmd->nsegs = 0;
+		bufsz = 0;
+		for (i = 0; i < argc; ++i) {
+			for (pos = 0; cmd->argv[i][pos]; ++pos) {
+				if (match_slot(cmd->argv[i] + pos, &n) != -1)
+					break;
+			}
+			if (!cmd->argv[i][pos])
+				continue;
+
+			start = 0;
+			for (pos = 0;; ++pos) {
+				slot = cmd->argv[i][pos]
+				       ? match_slot(cmd->argv[i] + pos, &n)
+				       : EXEC_LITERAL;
+				if (slot == -1)
+					continue;
+
+				if (pos > start) {
+					if (seg) {
+						seg->arg = i;
+						seg->slot = EXEC_LITERAL;
+						seg->off = start;
+						seg->len = pos - start;
+						seg++;
+					}
+					cmd->nsegs++;
+				}
+				if (slot == EXEC_LITERAL)
+					break;
+
+				if (seg) {
+					seg->arg = i;
+					seg->slot = slot;
+					seg++;
+				}
+				cmd->nsegs++;
+				cmd->slots |= 1 << slot;
+				bufsz += EXEC_SLOT_LEN;
+
+				pos += n - 1;
+				start = pos + 1;
+			}
+			bufsz += strlen(cmd->argv[i]) + 1;
+		}
+
+		if (!cmd->nsegs)
+			return;
+		if (pass == 0) {
+			cmd->segs = malloc(cmd->nsegs * sizeof *cmd->segs);
+			seg = cmd->segs;
+		}
+	}
+
+	cmd->buf = malloc(bufsz);
+	cmd->args = malloc((argc + 1) * sizeof *cmd->args);
+	memcpy(cmd->args, cmd->argv, (argc + 1) * sizeof *cmd->args);
 }
+#endif
 
-/* parse_qual: parse a hotkey qualifier */
-static int parse_qual(FILE *f, struct lexer *lex, uint32_t *flags)
+/*
+ * parse_qual:
+ * Parse a hotkey qualifier. Qualifiers other than norepeat, repeat, double
+ * and long apply to the command of an exec operation stored in args.
+ * The time of a long press is stored in ms.
+ */
+static int parse_qual(FILE *f, struct lexer *lex, uint32_t *flags,
+                      uint8_t op, uint64_t args, unsigned int *ms)
 {
-	if (strcmp(lex->curr->str, "norepeat") == 0)
+	struct exec_cmd *cmd;
+
+	if (strcmp(lex->curr->str, "norepeat") == 0) {
 		*flags |= KBM_NOREPEAT;
+		next_token(f, lex, 0, 0);
+		return 0;
+	}
+
+	if (IS_GESTURE(lex->curr)) {
+#ifndef __linux__
+		err_generic(lex, "double and long are not supported "
+		                 "on this platform");
+		return 1;
+#endif
+		if (*flags & (KBM_DOUBLE | KBM_LONG)) {
+			err_generic(lex, "a binding cannot be both "
+			                 "double and long");
+			return 1;
+		}
+		if (strcmp(lex->curr->str, "double") == 0) {
+			*flags |= KBM_DOUBLE;
+			next_token(f, lex, 0, 0);
+			return 0;
+		}
+		if (next_token(f, lex, 0, 1) != 0)
+			return 1;
+		if (lex->curr->tag != TOK_NUM) {
+			err_generic(lex, "invalid token - expected a number");
+			return 1;
+		}
+		if (lex->curr->val < 1 || lex->curr->val > KBM_MAX_HOLD_TIME) {
+			err_generic(lex, "long press time must be between "
+			                 "1 and " KBM_STR(KBM_MAX_HOLD_TIME) " ms");
+			return 1;
+		}
+		*flags |= KBM_LONG;
+		*ms = lex->curr->val;
+		next_token(f, lex, 1, 0);
+		return 0;
+	}
+
+	if (strcmp(lex->curr->str, "repeat") == 0) {
+#ifndef __linux__
+		err_generic(lex, "repeat is not supported on this platform");
+		return 1;
+#endif
+		if (*flags & KBM_MACRO) {
+			err_generic(lex, "repeat cannot be applied to a macro");
+			return 1;
+		}
+		if (op == OP_MOVE) {
+			err_generic(lex, "repeat cannot be applied to move");
+			return 1;
+		}
+		if (next_token(f, lex, 0, 1) != 0)
+			return 1;
+		if (lex->curr->tag != TOK_NUM) {
+			err_generic(lex, "invalid token - expected a number");
+			return 1;
+		}
+		if (lex->curr->val < 1 || lex->curr->val > KBM_MAX_RATE) {
+			err_generic(lex, "repeat rate must be between "
+			                 "1 and " KBM_STR(KBM_MAX_RATE) " Hz");
+			return 1;
+		}
+		*flags = (*flags & 0xFFFF) | KBM_REPEAT
+		         | (uint32_t)lex->curr->val << 16;
+		next_token(f, lex, 1, 0);
+		return 0;
+	}
+
+	if (op != OP_EXEC) {
+		err_generic(lex, "qualifier can only be applied to exec");
+		return 1;
+	}
+
+	cmd = (struct exec_cmd *)args;
+	if (strcmp(lex->curr->str, "single") == 0) {
+		cmd->max = 1;
+	} else if (strcmp(lex->curr->str, "toggle") == 0) {
+		cmd->flags |= EXEC_TOGGLE;
+	} else if (strcmp(lex->curr->str, "capture") == 0) {
+		cmd->flags |= EXEC_CAPTURE;
+	} else if (strcmp(lex->curr->str, "max") == 0) {
+		if (next_token(f, lex, 0, 1) != 0)
+			return 1;
+		if (lex->curr->tag != TOK_NUM) {
+			err_generic(lex, "invalid token - expected a number");
+			return 1;
+		}
+		if (lex->curr->val < 1 || lex->curr->val > EXEC_MAX_PROCS) {
+			err_generic(lex, "instance limit must be between "
+			                 "1 and " KBM_STR(EXEC_MAX_PROCS));
+			return 1;
+		}
+		cmd->max = lex->curr->val;
+		next_token(f, lex, 1, 0);
+		return 0;
+	}
 
 	next_token(f, lex, 0, 0);
 	return 0;
 }
 
+/*
+ * seq_key_ok:
+ * Check if a parsed key can be part of a key sequence. Sequences are
+ * matched key by key, so they cannot contain buttons or wildcards.
+ */
+static int seq_key_ok(uint64_t key, struct lexer *lex)
+{
+	if (K_ISBUTTON(key & 0xFFFFFFFF)) {
+		err_generic(lex, "a key sequence cannot contain "
+		                 "mouse buttons");
+		return 0;
+	}
+	if ((key >> 32) & ANY_MODS) {
+		err_generic(lex, "a key sequence cannot contain "
+		                 "wildcard modifiers");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * gesture_ok:
+ * Check if the binding of key can be told apart by double taps and long
+ * presses. Both are timed on a single key pressed with exact modifiers.
+ */
+static int gesture_ok(uint64_t key, uint32_t kind, size_t ntap,
+                      struct lexer *lex)
+{
+	if (kind) {
+		err_generic(lex, "double and long cannot be applied to "
+		                 "a chord or a key sequence");
+		return 0;
+	}
+	if (ntap) {
+		err_generic(lex, "double and long cannot be applied to "
+		                 "a tap and hold binding");
+		return 0;
+	}
+	if ((key >> 32) & ANY_MODS) {
+		err_generic(lex, "double and long cannot be applied to "
+		                 "a wildcard binding");
+		return 0;
+	}
+	if (K_ISBUTTON(key & 0xFFFFFFFF)) {
+		err_generic(lex, "double and long cannot be applied to "
+		                 "a mouse button");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * chord_key_ok:
+ * Check if a parsed key can be part of a chord. Chords are formed of
+ * ordinary keys, and modifiers are only given before the first key.
+ */
+static int chord_key_ok(uint64_t key, int first, struct lexer *lex)
+{
+	uint32_t mods;
+
+	mods = (key >> 32) & 0xFFFFFFFF;
+	if (K_ISBUTTON(key & 0xFFFFFFFF)) {
+		err_generic(lex, "a chord cannot contain mouse buttons");
+		return 0;
+	}
+	if (K_ISMOD(key & 0xFFFFFFFF)) {
+		err_generic(lex, "a chord cannot contain modifier keys");
+		return 0;
+	}
+	if (mods & ANY_MODS) {
+		err_generic(lex, "a chord cannot contain wildcard modifiers");
+		return 0;
+	}
+	if (mods & KBM_RIGHT_MASKS) {
+		err_generic(lex, "a chord cannot require right-hand "
+		                 "modifiers");
+		return 0;
+	}
+	if (mods && !first) {
+		err_generic(lex, "the modifiers of a chord must precede "
+		                 "its first key");
+		return 0;
+	}
+	return 1;
+}
+
 /* validkey: check if a key-modifier combination is valid */
 static int validkey(uint64_t *key, struct lexer *lex)
 {
@@ -884,6 +2669,18 @@ static int validkey(uint64_t *key, struct lexer *lex)
 		case KEY_META:
 			mask = KBM_META_MASK;
 			break;
+		case KEY_RCTRL:
+			mask = KBM_RCTRL_MASK;
+			break;
+		case KEY_RSHIFT:
+			mask = KBM_RSHIFT_MASK;
+			break;
+		case KEY_RSUPER:
+			mask = KBM_RSUPER_MASK;
+			break;
+		case KEY_RMETA:
+			mask = KBM_RMETA_MASK;
+			break;
 		}
 		if (mods & mask) {
 			err_selfmod(lex);
@@ -893,3 +2690,195 @@ static int validkey(uint64_t *key, struct lexer *lex)
 
 	return 1;
 }
+
+/* count_mods: return the number of modifiers set in mask */
+static unsigned int count_mods(uint8_t mask)
+{
+	unsigned int n;
+
+	for (n = 0; mask; mask &= mask - 1)
+		n++;
+	return n;
+}
+
+/* layer_of: return the layer of the binding of hk, 0 if it has none */
+static unsigned int layer_of(const struct hotkey *hk)
+{
+#ifdef __linux__
+	return hk->layer;
+#else
+	KBM_UNUSED(hk);
+	return 0;
+#endif
+}
+
+/*
+ * covers:
+ * Check if binding a takes precedence over wildcard binding b when the
+ * modifiers in mods are held. Exact bindings win over wildcards, and of
+ * two wildcards, the one naming more modifiers wins, or the earlier one.
+ */
+static int covers(const struct hotkey *a, const struct hotkey *b,
+                  uint8_t mods, int earlier)
+{
+	unsigned int na, nb;
+
+	/* a chord leaves its keys pressed alone to other bindings */
+	if (a->key_flags & KBM_CHORD)
+		return 0;
+	if (!(a->key_flags & KBM_WILDCARD))
+		return a->kbm_modmask == mods;
+	if (a->kbm_modmask & ~mods)
+		return 0;
+
+	na = count_mods(a->kbm_modmask);
+	nb = count_mods(b->kbm_modmask);
+	return na > nb || (na == nb && earlier);
+}
+
+/* shadowed: check if no combination of modifiers ever runs wildcard hk */
+static int shadowed(struct hotkey *head, const struct hotkey *hk)
+{
+	const struct hotkey *other;
+	uint8_t free_mods, sub;
+	int earlier;
+
+	free_mods = KBM_BASE_MASKS & ~hk->kbm_modmask;
+	sub = free_mods;
+	do {
+		earlier = 1;
+		for (other = head; other; other = other->next) {
+			if (other == hk) {
+				earlier = 0;
+				continue;
+			}
+			if (other->kbm_code == hk->kbm_code
+			    && layer_of(other) == layer_of(hk)
+			    && covers(other, hk, hk->kbm_modmask | sub,
+			              earlier))
+				break;
+		}
+		if (!other)
+			return 0;
+		sub = (sub - 1) & free_mods;
+	} while (sub != free_mods);
+
+	return 1;
+}
+
+/* seq_len: return the number of keys in the binding of hk */
+static size_t seq_len(const struct hotkey *hk)
+{
+#ifdef __linux__
+	if (hk->seq)
+		return hk->seq->len + 1;
+#else
+	KBM_UNUSED(hk);
+#endif
+	return 1;
+}
+
+/* same_key: check if the ith keys of the bindings of a and b are equal */
+static int same_key(const struct hotkey *a, const struct hotkey *b, size_t i)
+{
+	if (!i)
+		return a->kbm_code == b->kbm_code
+		       && a->kbm_modmask == b->kbm_modmask
+		       && (a->key_flags & KBM_WILDCARD)
+		          == (b->key_flags & KBM_WILDCARD);
+#ifdef __linux__
+	return a->seq->keys[i - 1].kbm_code == b->seq->keys[i - 1].kbm_code
+	       && a->seq->keys[i - 1].kbm_modmask
+	          == b->seq->keys[i - 1].kbm_modmask;
+#else
+	return 0;
+#endif
+}
+
+/* same_chord: check if a and b are chords of the same keys */
+static int same_chord(const struct hotkey *a, const struct hotkey *b)
+{
+#ifdef __linux__
+	size_t i, j;
+
+	if (a->kbm_modmask != b->kbm_modmask || a->seq->len != b->seq->len)
+		return 0;
+
+	/* the keys of a chord are pressed in any order */
+	for (i = 0; i <= a->seq->len; ++i) {
+		for (j = 0; j <= b->seq->len; ++j) {
+			if ((i ? a->seq->keys[i - 1].kbm_code : a->kbm_code)
+			    == (j ? b->seq->keys[j - 1].kbm_code
+			          : b->kbm_code))
+				break;
+		}
+		if (j > b->seq->len)
+			return 0;
+	}
+	return 1;
+#else
+	KBM_UNUSED(a);
+	KBM_UNUSED(b);
+	return 0;
+#endif
+}
+
+/*
+ * check_bindings:
+ * Warn about bindings which can never run, either because the same keys
+ * are bound earlier in the file, because one binding is the start of a
+ * key sequence bound elsewhere, or because more specific bindings cover
+ * every combination of modifiers matched by a wildcard.
+ */
+static void check_bindings(struct lexer *lex, struct hotkey *head,
+                           const struct binding_pos *pos)
+{
+	struct hotkey *hk, *prev;
+	size_t i, j, n;
+
+	for (hk = head, i = 0; hk; hk = hk->next, ++i) {
+		for (prev = head; prev != hk; prev = prev->next) {
+			/* each layer binds keys separately */
+			if (layer_of(prev) != layer_of(hk))
+				continue;
+			/* a chord key's own binding runs if it is alone */
+			if ((prev->key_flags ^ hk->key_flags) & KBM_CHORD)
+				continue;
+			/* a key's taps, double taps and long presses differ */
+			if ((prev->key_flags ^ hk->key_flags)
+			    & (KBM_DOUBLE | KBM_LONG))
+				continue;
+			if (hk->key_flags & KBM_CHORD) {
+				if (same_chord(prev, hk))
+					break;
+				continue;
+			}
+			n = seq_len(prev) < seq_len(hk) ? seq_len(prev)
+			                                : seq_len(hk);
+			for (j = 0; j < n && same_key(prev, hk, j); ++j)
+				;
+			if (j == n)
+				break;
+		}
+		if (prev != hk && hk->key_flags & KBM_CHORD)
+			warn_binding(lex, pos[i].line, pos[i].col,
+			             "duplicate chord starting with",
+			             keystr(hk->kbm_code, hk->kbm_modmask));
+		else if (prev != hk && seq_len(prev) == seq_len(hk))
+			warn_binding(lex, pos[i].line, pos[i].col,
+			             seq_len(hk) > 1
+			             ? "duplicate key sequence starting with"
+			             : "duplicate binding of",
+			             keystr(hk->kbm_code, hk->kbm_modmask));
+		else if (prev != hk)
+			warn_binding(lex, pos[i].line, pos[i].col,
+			             "binding conflicts with a key sequence "
+			             "starting with",
+			             keystr(hk->kbm_code, hk->kbm_modmask));
+		else if (hk->key_flags & KBM_WILDCARD && shadowed(head, hk))
+			warn_binding(lex, pos[i].line, pos[i].col,
+			             "more specific bindings shadow every use "
+			             "of wildcard",
+			             keystr(hk->kbm_code, hk->kbm_modmask));
+	}
+}
@@ -27,7 +27,8 @@
 #define CURR_START(lex) (CURR_IND(lex) - lex->curr->len)
 #define HAS_STR(tok) \
 	(tok->tag == TOK_ID || tok->tag == TOK_FUNC \
-	 || tok->tag == TOK_STRLIT || tok->tag == TOK_QUAL)
+	 || tok->tag == TOK_STRLIT || tok->tag == TOK_QUAL \
+	 || tok->tag == TOK_GDEF)
 
 /* parser token types */
 enum {
@@ -0,0 +1,438 @@
+/*
+ * proc.c
+ * Copyright (C) 2016-2017 Alexei Frolov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include "display.h"
+#include "kbm.h"
+#include "loop.h"
+#include "proc.h"
+#include "ring.h"
+
+static void child_exit(int fd, void *data);
+static void child_output(int fd, void *data);
+static ssize_t read_output(struct child *c);
+static void close_output(struct child *c);
+
+/* whether the kernel, or the sandbox kbm runs in, provides clone3 */
+static int have_clone3 = 1;
+
+/*
+ * fork_pidfd:
+ * Fork, storing a pidfd of the child in *pidfd, or -1 if none could be
+ * opened. The child waits until the pidfd is open, so that it cannot
+ * have exited and had its pid reused by then.
+ */
+static pid_t fork_pidfd(int *pidfd)
+{
+	int sync[2];
+	pid_t pid;
+	char c;
+
+	if (pipe2(sync, O_CLOEXEC) != 0) {
+		perror("pipe2");
+		return -1;
+	}
+	if ((pid = fork()) == 0) {
+		close(sync[1]);
+		while (read(sync[0], &c, 1) < 0 && errno == EINTR)
+			;
+		close(sync[0]);
+		return 0;
+	}
+
+	close(sync[0]);
+	*pidfd = -1;
+	if (pid > 0 && (*pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0)
+		perror("pidfd_open");
+	close(sync[1]);
+	return pid;
+}
+
+/*
+ * clone_pidfd:
+ * Fork, storing a pidfd of the child in *pidfd. The pidfd is created
+ * along with the child, so it cannot refer to another process reusing
+ * the pid of a child which has already exited and been reaped. Without
+ * clone3, the pidfd is opened after a fork instead.
+ */
+static pid_t clone_pidfd(int *pidfd)
+{
+	struct clone_args args;
+	pid_t pid;
+
+	if (have_clone3) {
+		memset(&args, 0, sizeof args);
+		args.flags = CLONE_PIDFD;
+		args.pidfd = (uintptr_t)pidfd;
+		args.exit_signal = SIGCHLD;
+		if ((pid = syscall(SYS_clone3, &args, sizeof args)) != -1
+		    || errno != ENOSYS)
+			return pid;
+		PRINT_DEBUG("clone3 not available, using fork\n");
+		have_clone3 = 0;
+	}
+	return fork_pidfd(pidfd);
+}
+
+static int signal_pidfd(int pidfd, int sig)
+{
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+/* dump_output: print the captured output log on SIGUSR1 */
+static void dump_output(int sig)
+{
+	KBM_UNUSED(sig);
+	ring_dump(stderr);
+}
+
+/*
+ * proc_init:
+ * Children are never waited on; the kernel reaps them as soon as they
+ * exit. Their termination is instead observed through pidfds, opened
+ * with each child and polled by the event loop. The output of capturing
+ * children is dumped on SIGUSR1.
+ */
+void proc_init(void)
+{
+	struct sigaction sa;
+
+	sa.sa_handler = SIG_DFL;
+	sa.sa_flags = SA_NOCLDWAIT;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	loop_signal(SIGUSR1, dump_output);
+}
+
+/* permit: check whether cmd may start another instance */
+static int permit(struct exec_cmd *cmd)
+{
+	unsigned int mask;
+	int i;
+
+	if ((cmd->flags & EXEC_TOGGLE) && cmd->nprocs) {
+		mask = cmd->running;
+		while ((i = ffs(mask))) {
+			mask &= ~(1U << --i);
+			PRINT_DEBUG("killing process %d\n", cmd->procs[i].pid);
+			signal_pidfd(cmd->procs[i].pidfd, SIGTERM);
+		}
+		return 0;
+	}
+
+	if (cmd->max && cmd->nprocs >= cmd->max) {
+		PRINT_DEBUG("%u instances already running\n", cmd->nprocs);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * open_capture:
+ * Create a pipe for the output of a child process. Only the read
+ * end is nonblocking; the child's writes should block as usual.
+ */
+static int open_capture(int out[2])
+{
+	if (pipe2(out, O_CLOEXEC) != 0) {
+		perror("pipe2");
+		out[0] = out[1] = -1;
+		return 1;
+	}
+	fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * child_init:
+ * Reset process state inherited from kbm in a forked child
+ * and redirect its output to out, if it is being captured.
+ */
+static void child_init(int out)
+{
+	struct sigaction sa;
+	sigset_t set;
+
+	sa.sa_handler = SIG_DFL;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	/* signals handled by the event loop are blocked in kbm */
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	if (out != -1) {
+		dup2(out, STDOUT_FILENO);
+		dup2(out, STDERR_FILENO);
+	}
+}
+
+/*
+ * track:
+ * Store pid in a free slot of cmd's process table and watch its pidfd
+ * for its exit and outfd for its output. If the table is full, or there
+ * is no pidfd, the child runs untracked.
+ */
+static void track(struct exec_cmd *cmd, pid_t pid, int fd, int outfd)
+{
+	struct child *c;
+	int i;
+
+	if (fd < 0)
+		goto err_outfd;
+	if (!(i = ffs(~cmd->running & ((1U << EXEC_MAX_PROCS) - 1)))) {
+		close(fd);
+		goto err_outfd;
+	}
+
+	c = &cmd->procs[--i];
+	c->pid = pid;
+	c->pidfd = fd;
+	c->outfd = -1;
+	c->cmd = cmd;
+
+	if (loop_add(fd, child_exit, c) != 0) {
+		close(fd);
+		goto err_outfd;
+	}
+	cmd->running |= 1U << i;
+	cmd->nprocs++;
+
+	if (outfd != -1) {
+		if (loop_add(outfd, child_output, c) != 0)
+			goto err_outfd;
+		c->outfd = outfd;
+	}
+	return;
+
+err_outfd:
+	if (outfd != -1)
+		close(outfd);
+}
+
+/*
+ * build_argv:
+ * Return the argv with which to launch cmd. For a templated command,
+ * current values are substituted into the preallocated argument buffer.
+ */
+static char **build_argv(struct exec_cmd *cmd)
+{
+	char vals[EXEC_NUM_SLOTS][EXEC_SLOT_LEN];
+	size_t lens[EXEC_NUM_SLOTS];
+	struct exec_seg *seg, *end;
+	unsigned int i;
+	char *s;
+	int x, y;
+
+	if (!cmd->nsegs)
+		return cmd->argv;
+
+	if (cmd->slots & (1 << EXEC_SLOT_WINDOW)) {
+		lens[EXEC_SLOT_WINDOW] = snprintf(vals[EXEC_SLOT_WINDOW],
+		                                  EXEC_SLOT_LEN, "%lu",
+		                                  active_window());
+	}
+	if (cmd->slots & (1 << EXEC_SLOT_X | 1 << EXEC_SLOT_Y)) {
+		cursor_position(&x, &y);
+		lens[EXEC_SLOT_X] = snprintf(vals[EXEC_SLOT_X],
+		                             EXEC_SLOT_LEN, "%d", x);
+		lens[EXEC_SLOT_Y] = snprintf(vals[EXEC_SLOT_Y],
+		                             EXEC_SLOT_LEN, "%d", y);
+	}
+	if (cmd->slots & (1 << EXEC_SLOT_KEY)) {
+		lens[EXEC_SLOT_KEY] = snprintf(vals[EXEC_SLOT_KEY],
+		                               EXEC_SLOT_LEN, "%s",
+		                               keystr(cmd->hk->kbm_code,
+		                                      cmd->hk->kbm_modmask));
+	}
+
+	/* snprintf gives the length of a value before it was cut short */
+	for (i = 0; i < EXEC_NUM_SLOTS; ++i) {
+		if (cmd->slots & (1 << i) && lens[i] > EXEC_SLOT_LEN - 1)
+			lens[i] = EXEC_SLOT_LEN - 1;
+	}
+
+	s = cmd->buf;
+	end = cmd->segs + cmd->nsegs;
+	for (seg = cmd->segs; seg < end; ++seg) {
+		if (seg == cmd->segs || seg->arg != seg[-1].arg) {
+			if (seg != cmd->segs)
+				*s++ = '\0';
+			cmd->args[seg->arg] = s;
+		}
+		if (seg->slot == EXEC_LITERAL) {
+			memcpy(s, cmd->argv[seg->arg] + seg->off, seg->len);
+			s += seg->len;
+		} else {
+			memcpy(s, vals[seg->slot], lens[seg->slot]);
+			s += lens[seg->slot];
+		}
+	}
+	*s = '\0';
+
+	return cmd->args;
+}
+
+/* proc_spawn: start a new instance of cmd, subject to its qualifiers */
+void proc_spawn(struct exec_cmd *cmd)
+{
+	char **argv;
+	int out[2], pidfd;
+	pid_t pid;
+
+	if (!permit(cmd))
+		return;
+
+	/*
+	 * Output is only captured if the child can be tracked;
+	 * otherwise it would have nobody reading its pipe.
+	 */
+	out[0] = out[1] = -1;
+	if ((cmd->flags & EXEC_CAPTURE) && cmd->nprocs < EXEC_MAX_PROCS)
+		open_capture(out);
+
+	argv = build_argv(cmd);
+
+	switch ((pid = clone_pidfd(&pidfd))) {
+	case -1:
+		perror("fork");
+		if (out[0] != -1) {
+			close(out[0]);
+			close(out[1]);
+		}
+		return;
+	case 0:
+		child_init(out[1]);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		exit(1);
+	default:
+		if (out[1] != -1)
+			close(out[1]);
+		track(cmd, pid, pidfd, out[0]);
+		break;
+	}
+}
+
+/* proc_forget: stop tracking all running instances of cmd */
+void proc_forget(struct exec_cmd *cmd)
+{
+	unsigned int mask;
+	int i;
+
+	mask = cmd->running;
+	while ((i = ffs(mask))) {
+		mask &= ~(1U << --i);
+		loop_remove(cmd->procs[i].pidfd);
+		close(cmd->procs[i].pidfd);
+		close_output(&cmd->procs[i]);
+	}
+	cmd->running = 0;
+	cmd->nprocs = 0;
+}
+
+/* child_exit: release the slot of a child process which has terminated */
+static void child_exit(int fd, void *data)
+{
+	struct child *c;
+	struct exec_cmd *cmd;
+
+	c = data;
+	cmd = c->cmd;
+
+	PRINT_DEBUG("process %d exited\n", c->pid);
+	loop_remove(fd);
+	close(fd);
+
+	/* collect anything the child wrote before exiting */
+	if (c->outfd != -1) {
+		while (read_output(c) > 0)
+			;
+		close_output(c);
+	}
+
+	cmd->running &= ~(1U << (c - cmd->procs));
+	cmd->nprocs--;
+}
+
+/*
+ * read_output:
+ * Read a single chunk of output from child c into the output log.
+ * Return the result of the read.
+ */
+static ssize_t read_output(struct child *c)
+{
+	char buf[RING_CHUNK];
+	ssize_t n;
+
+	if ((n = read(c->outfd, buf, sizeof buf)) > 0) {
+		ring_write(c->cmd->hk->kbm_code, c->cmd->hk->kbm_modmask,
+		           c->pid, buf, n);
+	}
+	return n;
+}
+
+/*
+ * child_output:
+ * Read available output of a capturing child. Only a single chunk is
+ * read each time so that a busy child cannot hold up the event loop.
+ */
+static void child_output(int fd, void *data)
+{
+	struct child *c;
+	ssize_t n;
+
+	KBM_UNUSED(fd);
+
+	c = data;
+	if ((n = read_output(c)) > 0)
+		return;
+
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		perror("read");
+	}
+	close_output(c);
+}
+
+/* close_output: stop capturing the output of child c */
+static void close_output(struct child *c)
+{
+	if (c->outfd == -1)
+		return;
+
+	loop_remove(c->outfd);
+	close(c->outfd);
+	c->outfd = -1;
+}
@@ -0,0 +1,36 @@
+/*
+ * proc.h
+ * Copyright (C) 2016-2017 Alexei Frolov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KBM_PROC_H
+#define KBM_PROC_H
+
+#include "hotkey.h"
+
+/* proc_init: prepare for supervising child processes */
+void proc_init(void);
+
+/*
+ * proc_spawn: start a new instance of cmd, subject to its qualifiers.
+ * The child is watched by the event loop until it exits.
+ */
+void proc_spawn(struct exec_cmd *cmd);
+
+/* proc_forget: stop tracking all running instances of cmd */
+void proc_forget(struct exec_cmd *cmd);
+
+#endif /* KBM_PROC_H */
@@ -0,0 +1,137 @@
+/*
+ * ring.c
+ * Copyright (C) 2016-2017 Alexei Frolov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include "keymap.h"
+#include "ring.h"
+
+/*
+ * The output log is a byte ring holding a sequence of records, each a
+ * header followed by len bytes of data. head and tail are free-running
+ * byte offsets: [tail, head) holds complete records and the oldest
+ * records are dropped to make room for new ones.
+ *
+ * There is a single writer, which never waits for readers. A reader
+ * copies out [tail, head) and then discards anything which the writer
+ * may have overwritten in the meantime, as indicated by tail having
+ * moved past it.
+ */
+struct record {
+	uint16_t        len;            /* length of the record's data */
+	uint16_t        kbm_code;       /* hotkey which started the process */
+	uint8_t         kbm_modmask;
+	int32_t         pid;            /* process which wrote the data */
+};
+
+#define RING_MASK (RING_SIZE - 1)
+
+static char ring[RING_SIZE];
+static _Atomic uint64_t head = 0;
+static _Atomic uint64_t tail = 0;
+
+/* copy of the ring taken by ring_dump */
+static char snapshot[RING_SIZE];
+
+/* copy_in: copy n bytes from src into the ring at offset pos */
+static void copy_in(uint64_t pos, const void *src, size_t n)
+{
+	size_t off, part;
+
+	off = pos & RING_MASK;
+	part = n < RING_SIZE - off ? n : RING_SIZE - off;
+	memcpy(ring + off, src, part);
+	memcpy(ring, (const char *)src + part, n - part);
+}
+
+/* copy_out: copy n bytes from the ring at offset pos into dst */
+static void copy_out(void *dst, uint64_t pos, size_t n)
+{
+	size_t off, part;
+
+	off = pos & RING_MASK;
+	part = n < RING_SIZE - off ? n : RING_SIZE - off;
+	memcpy(dst, ring + off, part);
+	memcpy((char *)dst + part, ring, n - part);
+}
+
+/* ring_write: append a record of process output to the ring */
+void ring_write(uint16_t kbm_code, uint8_t kbm_modmask, pid_t pid,
+                const char *buf, size_t len)
+{
+	struct record rec, old;
+	uint64_t h, t;
+
+	if (len > RING_CHUNK)
+		len = RING_CHUNK;
+
+	rec.len = len;
+	rec.kbm_code = kbm_code;
+	rec.kbm_modmask = kbm_modmask;
+	rec.pid = pid;
+
+	h = atomic_load_explicit(&head, memory_order_relaxed);
+	t = atomic_load_explicit(&tail, memory_order_relaxed);
+
+	/* drop the oldest records until the new one fits */
+	if (h + sizeof rec + len - t > RING_SIZE) {
+		do {
+			copy_out(&old, t, sizeof old);
+			t += sizeof old + old.len;
+		} while (h + sizeof rec + len - t > RING_SIZE);
+
+		/* readers must see the records are gone before they change */
+		atomic_store_explicit(&tail, t, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+	}
+
+	copy_in(h, &rec, sizeof rec);
+	copy_in(h + sizeof rec, buf, len);
+	atomic_store_explicit(&head, h + sizeof rec + len,
+	                      memory_order_release);
+}
+
+/* ring_dump: print every record in the output log to f */
+void ring_dump(FILE *f)
+{
+	struct record rec;
+	uint64_t h, t, valid, pos;
+	char *data;
+
+	h = atomic_load_explicit(&head, memory_order_acquire);
+	t = atomic_load_explicit(&tail, memory_order_acquire);
+	copy_out(snapshot, t, h - t);
+
+	/* anything before the current tail may have been overwritten */
+	atomic_thread_fence(memory_order_acquire);
+	valid = atomic_load_explicit(&tail, memory_order_relaxed);
+	if (valid >= h)
+		return;
+
+	for (pos = valid - t; pos < h - t; pos += sizeof rec + rec.len) {
+		memcpy(&rec, snapshot + pos, sizeof rec);
+		data = snapshot + pos + sizeof rec;
+
+		fprintf(f, "%s [%d]: ", keystr(rec.kbm_code, rec.kbm_modmask),
+		        rec.pid);
+		fwrite(data, 1, rec.len, f);
+		if (!rec.len || data[rec.len - 1] != '\n')
+			putc('\n', f);
+	}
+	fflush(f);
+}
@@ -0,0 +1,42 @@
+/*
+ * ring.h
+ * Copyright (C) 2016-2017 Alexei Frolov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KBM_RING_H
+#define KBM_RING_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* size of the output log in bytes, must be a power of two */
+#define RING_SIZE	0x10000
+
+/* largest amount of data stored in a single record */
+#define RING_CHUNK	512
+
+/*
+ * ring_write: append len bytes of output from process pid,
+ * started by the hotkey with the given code and modifiers.
+ */
+void ring_write(uint16_t kbm_code, uint8_t kbm_modmask, pid_t pid,
+                const char *buf, size_t len);
+
+/* ring_dump: print every record in the output log to f */
+void ring_dump(FILE *f);
+
+#endif /* KBM_RING_H */